@@ -7,18 +7,24 @@ LD_SRCS += \
 ../src/lscript.ld 
 
 C_SRCS += \
+../src/chunkhash.c \
 ../src/main.c \
 ../src/platform.c \
+../src/speck.c \
 ../src/util.c 
 
 OBJS += \
+./src/chunkhash.o \
 ./src/main.o \
 ./src/platform.o \
+./src/speck.o \
 ./src/util.o 
 
 C_DEPS += \
+./src/chunkhash.d \
 ./src/main.d \
 ./src/platform.d \
+./src/speck.d \
 ./src/util.d 
 
 
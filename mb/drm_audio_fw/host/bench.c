@@ -0,0 +1,1286 @@
+/*
+ * Host benchmark for the DRM firmware core
+ *
+ * Runs the unmodified verify/decrypt/playback code from ../src against the
+ * fake hardware in hal.c and reports per-song throughput, so performance
+ * regressions can be caught without a board.
+ *
+ * The song is either synthesized and protected with the device keys from
+ * secrets.h, or loaded from a .drm file produced by tools/protectSong.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xil_types.h"
+#include "xil_exception.h"
+#include "xaxidma.h"
+#include "xintc.h"
+#include "xparameters.h"
+#include "constants.h"
+#include "blake3.h"
+#include "speck.h"
+#include "chunkhash.h"
+#include "hal.h"
+
+#define BLK_SZ 16
+
+// DRM internals from main.c and secrets.h
+extern volatile cmd_channel *c;
+extern internal_state s;
+extern XAxiDma sAxiDma;
+extern char dma_intr;
+extern play_queue pq;
+extern const u8 PROVISIONED_UIDS[];
+extern const u8 PROVISIONED_RIDS[];
+XStatus fnConfigDma(XAxiDma *AxiDma);
+XStatus fnConfigDmaIntr(XIntc *XIntcInstancePtr, XAxiDma *AxiDma, u8 Id, XInterruptHandler hdlr);
+int init_cryptkeys();
+int verify_song();
+int md_hashed_sz(song *hdr);
+int verify_merkle(u32 chunknum, char *leaf, char path[][BLAKE3_OUT_LEN]);
+void load_chunk_proof(u32 chunknum, char proof[][BLAKE3_OUT_LEN]);
+int is_locked();
+int is_provisioned_uid(char uid);
+int is_provisioned_rid(char rid);
+void load_song_md();
+int uid_to_username(char uid, char **username, int provisioned_only);
+int username_to_uid(char *username, char *uid, int provisioned_only);
+void play_song();
+void digital_out();
+void myISR(void);
+void dmaISR(void);
+void audio_wait(u32 n);
+
+// pristine copy of the protected song, restored before each destructive run
+static u8 *drm_file;
+static u32 drm_len;
+// plaintext audio the synthesized song was made from
+static u8 *pcm;
+static u32 pcm_len;
+
+
+//////////////////////// SONG SYNTHESIS ////////////////////////
+
+
+#define ROTL64(x,r) (((x)<<(r)) | (x>>(64-(r))))
+#define ROTR64(x,r) (((x)>>(r)) | ((x)<<(64-(r))))
+#define ER64(x,y,k) (x=ROTR64(x,8), x+=y, x^=k, y=ROTL64(y,3), y^=x)
+#define DR64(x,y,k) (y^=x, y=ROTR64(y,3), x^=k, x-=y, x=ROTL64(x,8))
+
+static void put_u32(u8 *p, u32 v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+
+// Speck 128/256 CBC encryption with the key schedule from init_cryptkeys()
+static void ref_encrypt_cbc(u8 *buf, u32 len, const u8 *iv) {
+    u64 prev[2];
+    memcpy(prev, iv, BLK_SZ);
+    for (u32 i = 0; i < len; i += BLK_SZ) {
+        u64 b[2];
+        memcpy(b, buf + i, BLK_SZ);
+        b[0] ^= prev[0];
+        b[1] ^= prev[1];
+        for (int r = 0; r < 34; r++) ER64(b[1], b[0], s.rk[r]);
+        memcpy(buf + i, b, BLK_SZ);
+        prev[0] = b[0];
+        prev[1] = b[1];
+    }
+}
+
+
+// the IV chunk i of a DRM_EXT_CHUNK_IV song is encrypted from, as in constants.h
+static void ref_chunk_iv(const u8 *iv, u32 i, u8 *out) {
+    u8 num[4], hash[BLAKE3_OUT_LEN];
+    blake3_hasher h;
+    put_u32(num, i);
+    blake3_hasher_init(&h);
+    blake3_hasher_update(&h, iv, BLK_SZ);
+    blake3_hasher_update(&h, num, sizeof(num));
+    blake3_hasher_finalize(&h, hash, BLAKE3_OUT_LEN);
+    memcpy(out, hash, BLK_SZ);
+}
+
+
+static void keyed_hash(const char *key, const u8 *a, u32 alen, const u8 *b, u32 blen, u8 *out) {
+    blake3_hasher h;
+    blake3_hasher_init_keyed(&h, (const u8 *)key);
+    blake3_hasher_update(&h, a, alen);
+    if (b) {
+        blake3_hasher_update(&h, b, blen);
+    }
+    blake3_hasher_finalize(&h, out, BLAKE3_OUT_LEN);
+}
+
+
+/* fills in the levels of a Merkle tree above the n chunk hashes at the start
+ * of table, as described in constants.h
+ * returns the root, the last node of the table
+ */
+static u8 *merkle_build(u8 *table, u32 n) {
+    const u8 tag = 0x01;
+    u8 *level = table;
+
+    while (n > 1) {
+        u8 *up = level + n * BLAKE3_OUT_LEN;
+        for (u32 j = 0; j < n; j += 2) {
+            u8 *node = level + j * BLAKE3_OUT_LEN;
+            if (j + 1 < n) {
+                blake3_hasher h;
+                blake3_hasher_init_keyed(&h, (const u8 *)s.chunkKey);
+                blake3_hasher_update(&h, &tag, 1);
+                blake3_hasher_update(&h, node, 2 * BLAKE3_OUT_LEN);
+                blake3_hasher_finalize(&h, up + j / 2 * BLAKE3_OUT_LEN, BLAKE3_OUT_LEN);
+            } else {
+                memcpy(up + j / 2 * BLAKE3_OUT_LEN, node, BLAKE3_OUT_LEN);
+            }
+        }
+        level = up;
+        n = (n + 1) / 2;
+    }
+    return level;
+}
+
+
+// nodes in a Merkle tree over n chunk hashes, leaves included
+static u32 merkle_nodes(u32 n) {
+    u32 total = n;
+    while (n > 1) {
+        n = (n + 1) / 2;
+        total += n;
+    }
+    return total;
+}
+
+
+/* builds a .drm file the same way tools/protectSong does, owned by the first
+ * provisioned user and locked to the first provisioned region
+ * version is DRM_V1, or DRM_V2 with 1 << shift byte chunks and the drm_ext
+ * flags given
+ */
+static void synthesize_song(u32 audio_len, u32 version, u32 flags, u32 shift) {
+    u32 enc_len = (audio_len / BLK_SZ + 1) * BLK_SZ;
+    u32 chunk_sz = (version == DRM_V2) ? 1 << shift : CHUNK_SZ;
+    u32 nchunks = (enc_len + chunk_sz - 1) / chunk_sz;
+    u32 ext_sz = (flags & DRM_EXT_MERKLE) ? sizeof(drm_ext) : DRM_EXT_SZ;
+    u32 table_sz = ((flags & DRM_EXT_MERKLE) ? merkle_nodes(nchunks) : nchunks) * BLAKE3_OUT_LEN;
+    u32 table_off, audio_off;
+    if (version == DRM_V2) {
+        table_off = offsetof(song, ext) + ext_sz;
+        audio_off = (table_off + table_sz + 63) & ~63;
+    } else {
+        audio_off = offsetof(song, ext);
+        table_off = audio_off + enc_len;
+    }
+    u32 data_len = ((table_off > audio_off) ? table_off + table_sz : audio_off + enc_len) - 44;
+
+    free(pcm);
+    free(drm_file);
+    pcm_len = audio_len;
+    pcm = malloc(audio_len);
+    drm_len = 44 + data_len;
+    drm_file = calloc(1, drm_len);
+    srand(1);
+    for (u32 i = 0; i < audio_len; i++) {
+        pcm[i] = rand();
+    }
+
+    // WAV header, as written by python's wave module for 48 kHz mono 16-bit
+    u8 *p = drm_file;
+    memcpy(p, "RIFF", 4);
+    put_u32(p + 4, 36 + data_len);
+    memcpy(p + 8, "WAVEfmt ", 8);
+    put_u32(p + 16, 16);
+    p[20] = 1; p[22] = 1;
+    put_u32(p + 24, AUDIO_SAMPLING_RATE);
+    put_u32(p + 28, AUDIO_SAMPLING_RATE * BYTES_PER_SAMP);
+    p[32] = BYTES_PER_SAMP; p[34] = 8 * BYTES_PER_SAMP;
+    memcpy(p + 36, "data", 4);
+    put_u32(p + 40, data_len);
+
+    u8 *md_hash = p + 44;
+    u8 *iv = md_hash + BLAKE3_OUT_LEN;
+    u8 *md = iv + BLK_SZ + 8;
+    u8 *audio = p + audio_off;
+    u8 *hashes = p + table_off;
+    drm_ext *ext = (drm_ext *)(md + MD_SZ);
+
+    for (int i = 0; i < BLK_SZ; i++) {
+        iv[i] = rand();
+    }
+    put_u32(iv + BLK_SZ, version << 24 | nchunks);
+    put_u32(iv + BLK_SZ + 4, enc_len);
+
+    md[0] = 5;
+    md[1] = PROVISIONED_UIDS[0];
+    md[2] = 1;
+    md[3] = 0;
+    md[4] = PROVISIONED_RIDS[0];
+
+    // PKCS#7 pad and encrypt
+    memcpy(audio, pcm, audio_len);
+    memset(audio + audio_len, enc_len - audio_len, enc_len - audio_len);
+    if (flags & DRM_EXT_CHUNK_IV) {
+        for (u32 i = 0; i < nchunks; i++) {
+            u8 chunk_iv[BLK_SZ];
+            ref_chunk_iv(iv, i, chunk_iv);
+            ref_encrypt_cbc(audio + i * chunk_sz,
+                            (enc_len - i * chunk_sz > chunk_sz) ? chunk_sz : enc_len - i * chunk_sz, chunk_iv);
+        }
+    } else {
+        ref_encrypt_cbc(audio, enc_len, iv);
+    }
+
+    for (u32 i = 0; i < nchunks; i++) {
+        u32 len = (enc_len - i * chunk_sz > chunk_sz) ? chunk_sz : enc_len - i * chunk_sz;
+        keyed_hash(s.chunkKey, audio + i * chunk_sz, len, iv, BLK_SZ, hashes + i * BLAKE3_OUT_LEN);
+    }
+    if (version == DRM_V2) {
+        ext->chunk_shift = shift;
+        ext->flags = flags;
+        ext->ext_sz = ext_sz;
+        ext->table_off = table_off;
+        ext->audio_off = audio_off;
+        if (flags & DRM_EXT_MERKLE) {
+            memcpy(ext->root, merkle_build(hashes, nchunks), BLAKE3_OUT_LEN);
+        }
+    }
+    keyed_hash(s.mdKey, iv, BLK_SZ + 8 + MD_SZ + ((version == DRM_V2) ? ext_sz : 0), NULL, 0, md_hash);
+}
+
+
+static int load_song_file(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    drm_len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (drm_len > HOST_CHANNEL_SZ - offsetof(cmd_channel, song)) {
+        fprintf(stderr, "%s: too large for the command channel\n", path);
+        fclose(f);
+        return -1;
+    }
+    drm_file = malloc(drm_len);
+    if (fread(drm_file, 1, drm_len, f) != drm_len) {
+        perror(path);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+
+//////////////////////// TIMING ////////////////////////
+
+
+typedef struct {
+    const char *name;
+    double min, total;
+    int runs;
+} timing;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void record(timing *t, double us) {
+    if (t->runs == 0 || us < t->min) {
+        t->min = us;
+    }
+    t->total += us;
+    t->runs++;
+}
+
+static void report_unit(const timing *t, u32 bytes, u32 nunits, const char *unit) {
+    double mean = t->total / t->runs;
+    printf("%-12s min %10.1f us  mean %10.1f us", t->name, t->min, mean);
+    if (bytes) {
+        printf("  %8.2f MB/s  %7.3f us/%s", bytes / t->min, t->min / nunits, unit);
+    }
+    printf("\n");
+}
+
+static void report(const timing *t, u32 bytes, u32 nchunks) {
+    report_unit(t, bytes, nchunks, "chunk");
+}
+
+static void restore_song(void) {
+    memcpy((void *)&c->song, drm_file, drm_len);
+}
+
+
+//////////////////////// SIMULATED MIPOD ////////////////////////
+
+
+// next chunk to stream, and the DRM's seek count it follows
+static u32 feed_next, feed_seek;
+// layout of the song being streamed, read from its header as miPod does
+static u32 feed_chunk_sz, feed_table_off, feed_audio_off, feed_merkle;
+
+
+// plays miPod's part during playback: fills the free stream slots with the
+// next chunks of the song, continuing from wherever the DRM last seeked to
+static void feed_stream(void) {
+    const song *hdr = (const song *)drm_file;
+    const u8 *audio = drm_file + feed_audio_off;
+    u32 enc_len = hdr->encAudioLen, cs = feed_chunk_sz;
+
+    if (c->stream.seek != feed_seek) {
+        feed_seek = c->stream.seek;
+        feed_next = c->stream.want;
+    }
+    while (feed_next < drm_nchunks(hdr->numChunks) && c->stream.head - c->stream.tail < STREAM_SLOTS) {
+        volatile stream_slot *slot = &c->stream.slots[c->stream.head % STREAM_SLOTS];
+        u32 pos = feed_next * cs;
+        u32 len = (enc_len - pos > cs) ? cs : enc_len - pos;
+
+        slot->chunk = feed_next;
+        memcpy((void *)slot->hash, drm_file + feed_table_off + feed_next * BLAKE3_OUT_LEN, BLAKE3_OUT_LEN);
+        // with a Merkle tree, the sibling on each level instead
+        for (u32 n = drm_nchunks(hdr->numChunks), j = feed_next, start = 0, k = 0;
+             feed_merkle && n > 1; start += n, n = (n + 1) / 2, j >>= 1, k++) {
+            if ((j ^ 1) < n) {
+                memcpy((void *)slot->path[k], drm_file + feed_table_off + (start + (j ^ 1)) * BLAKE3_OUT_LEN,
+                       BLAKE3_OUT_LEN);
+            }
+        }
+        memcpy((void *)slot->data, audio + pos, len);
+        c->stream.head++;
+        feed_next++;
+    }
+}
+
+
+// loads the song the way miPod does for PLAY: only the header and metadata,
+// then the first chunks of the stream
+static void stream_song(void) {
+    const song *hdr = (const song *)drm_file;
+
+    if (drm_version(hdr->numChunks) == DRM_V2) {
+        feed_chunk_sz = 1 << hdr->ext.chunk_shift;
+        feed_table_off = hdr->ext.table_off;
+        feed_audio_off = hdr->ext.audio_off;
+        feed_merkle = hdr->ext.flags & DRM_EXT_MERKLE;
+    } else {
+        feed_merkle = 0;
+        feed_chunk_sz = CHUNK_SZ;
+        feed_audio_off = offsetof(song, ext);
+        feed_table_off = feed_audio_off + hdr->encAudioLen;
+    }
+    memcpy((void *)&c->song, drm_file, sizeof(song));
+    c->stream.head = c->stream.tail = c->stream.want = c->stream.seek = 0;
+    feed_next = feed_seek = 0;
+    feed_stream();
+}
+
+
+//////////////////////// SPECK KERNEL ////////////////////////
+
+
+// the original per-block Speck128256Decrypt(), kept as the baseline
+static void ref_decrypt_block(const u64 *rk, u64 *inCt, u64 outPt[], u64 *iv) {
+    outPt[0]=inCt[0]; outPt[1]=inCt[1];
+    for(int i=33;i>=0; i--) DR64(outPt[1],outPt[0],rk[i]);
+
+    outPt[0] ^= iv[0];
+    outPt[1] ^= iv[1];
+
+    iv[0] = inCt[0];
+    iv[1] = inCt[1];
+}
+
+static void ref_decrypt_cbc(const u64 *rk, const char *in, char *out, int len, char *iv) {
+    u64 Ct[2], Pt[2];
+    for (int i = 0; i < len; i += BLK_SZ) {
+        memcpy(Ct, in + i, BLK_SZ);
+        ref_decrypt_block(rk, Ct, Pt, (u64 *)iv);
+        memcpy(out + i, Pt, BLK_SZ);
+    }
+}
+
+typedef void (*cbc_fn)(const u64 *rk, const char *in, char *out, int len, char *iv);
+
+static const struct {
+    const char *name;
+    cbc_fn fn;
+} kernels[] = {
+    { "reference", ref_decrypt_cbc },
+    { "cbc64", speck_decrypt_cbc64 },
+    { "cbc32", speck_decrypt_cbc32 },
+};
+#define NKERNELS (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+static inline u64 cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+
+/* runs the Speck kernels against the published Speck128/256 test vector and
+ * against the reference on random keys, IVs and lengths, including runs split
+ * across calls and decrypted in place
+ * returns the number of failures
+ */
+static int test_speck(void) {
+    // Beaulieu et al., "The SIMON and SPECK Families of Lightweight Block Ciphers"
+    static const u64 K[4] = {
+        0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL,
+        0x1716151413121110ULL, 0x1f1e1d1c1b1a1918ULL,
+    };
+    static const u64 pt[2] = { 0x202e72656e6f6f70ULL, 0x65736f6874206e49ULL };
+    static const u64 ct[2] = { 0x4eeeb48d9c188f43ULL, 0x4109010405c0f53eULL };
+    static char in[64 * BLK_SZ], want[64 * BLK_SZ], got[64 * BLK_SZ];
+    u64 rk[SPECK_ROUNDS], out[2];
+    char iv[BLK_SZ], ivw[BLK_SZ], ivg[BLK_SZ];
+    int fails = 0;
+
+    speck_key_schedule(K, rk);
+    for (int k = 0; k < NKERNELS; k++) {
+        memset(iv, 0, BLK_SZ);
+        kernels[k].fn(rk, (const char *)ct, (char *)out, BLK_SZ, iv);
+        if (memcmp(out, pt, BLK_SZ) || memcmp(iv, ct, BLK_SZ)) {
+            fprintf(stderr, "speck: %s fails the published test vector\n", kernels[k].name);
+            fails++;
+        }
+    }
+
+    memset(iv, 0, BLK_SZ);
+    speck_encrypt_cbc(rk, (const char *)pt, (char *)out, BLK_SZ, iv);
+    if (memcmp(out, ct, BLK_SZ)) {
+        fprintf(stderr, "speck: speck_encrypt_cbc fails the published test vector\n");
+        fails++;
+    }
+
+    srand(2);
+    for (int trial = 0; trial < 2000; trial++) {
+        u64 key[4];
+        int len = (1 + rand() % 64) * BLK_SZ;
+        int split = (rand() % (len / BLK_SZ + 1)) * BLK_SZ;
+        // the first two trials are all zeros and all ones, to push the borrow
+        // and the rotates across every word boundary
+        int flat = trial < 2;
+        u8 fill = trial ? 0xff : 0x00;
+
+        for (int i = 0; i < 4; i++) {
+            key[i] = flat ? -(u64)trial : ((u64)rand() << 40) ^ ((u64)rand() << 20) ^ rand();
+        }
+        for (int i = 0; i < len; i++) in[i] = flat ? fill : rand();
+        for (int i = 0; i < BLK_SZ; i++) iv[i] = flat ? fill : rand();
+
+        speck_key_schedule(key, rk);
+        memcpy(ivw, iv, BLK_SZ);
+        ref_decrypt_cbc(rk, in, want, len, ivw);
+
+        // encrypting the reference plaintext must give back the ciphertext
+        memcpy(ivg, iv, BLK_SZ);
+        speck_encrypt_cbc(rk, want, got, len, ivg);
+        if (memcmp(got, in, len) || memcmp(ivg, ivw, BLK_SZ)) {
+            fprintf(stderr, "speck: speck_encrypt_cbc does not invert the reference (trial %d)\n", trial);
+            fails++;
+        }
+
+        for (int k = 1; k < NKERNELS; k++) {
+            memcpy(ivg, iv, BLK_SZ);
+            memcpy(got, in, len);
+            kernels[k].fn(rk, got, got, split, ivg);
+            kernels[k].fn(rk, got + split, got + split, len - split, ivg);
+            if (memcmp(got, want, len) || memcmp(ivg, ivw, BLK_SZ)) {
+                fprintf(stderr, "speck: %s differs from the reference (trial %d, %d B, split %d)\n",
+                        kernels[k].name, trial, len, split);
+                fails++;
+            }
+        }
+    }
+    return fails;
+}
+
+
+//////////////////////// CHUNK HASH ////////////////////////
+
+
+// keyed_hash vectors published with the Blake3 reference, for inputs of
+// bytes counting up mod 251
+static const struct {
+    u32 len;
+    const char *hash;
+} blake3_vectors[] = {
+    { 0, "92b2b75604ed3c761f9d6f62392c8a9227ad0ea3f09573e783f1498a4ed60d26" },
+    { 1, "6d7878dfff2f485635d39013278ae14f1454b8c0a3a2d34bc1ab38228a80c95b" },
+    { 1023, "c951ecdf03288d0fcc96ee3413563d8a6d3589547f2c2fb36d9786470f1b9d6e" },
+    { 1024, "75c46f6f3d9eb4f55ecaaee480db732e6c2105546f1e675003687c31719c7ba4" },
+    { 1025, "357dc55de0c7e382c900fd6e320acc04146be01db6a8ce7210b7189bd664ea69" },
+    { 2049, "9f29700902f7c86e514ddc4df1e3049f258b2472b6dd5267f61bf13983b78dd5" },
+    { 16384, "9e9fc4eb7cf081ea7c47d1807790ed211bfec56aa25bb7037784c13c4b707b0d" },
+    { 31744, "efa53b389ab67c593dba624d898d0f7353ab99e4ac9d42302ee64cbf9939a419" },
+};
+
+/* checks the in-tree chunk hash against the published Blake3 vectors, and
+ * against the Blake3 reference for inputs up to CHUNK_HASH_MAX_SZ, ending on
+ * and around block and Blake3 chunk boundaries, fed in one piece, in 64-byte
+ * lines before a 16-byte tail as the firmware does, and in odd pieces
+ * returns the number of failures
+ */
+static int test_chunkhash(void) {
+    static const u32 lens[] = {
+        0, 1, 16, 63, 64, 65, 80, 1023, 1024, 1025, 1040, 2048, 2064, 3089,
+        4096 + 16, CHUNK_SZ + 16, (1 << MAX_CHUNK_SHIFT) + 16, 31 * 1024 + 5, CHUNK_HASH_MAX_SZ,
+    };
+    static u8 in[CHUNK_HASH_MAX_SZ + 1];
+    u8 ref[BLAKE3_OUT_LEN], out[BLAKE3_OUT_LEN];
+    blake3_hasher b;
+    chunk_hasher h;
+    int fails = 0;
+
+    for (u32 i = 0; i < sizeof(in); i++) {
+        in[i] = i % 251;
+    }
+    blake3_hasher_init_keyed(&b, (const u8 *)"whats the Elvish word for friend");
+    for (u32 i = 0; i < sizeof(blake3_vectors) / sizeof(blake3_vectors[0]); i++) {
+        u32 len = blake3_vectors[i].len;
+        chunk_hash_start(&h, b.key);
+        chunk_hash_update(&h, in, len ? len - 1 : 0);
+        chunk_hash_final(&h, in + len - (len ? 1 : 0), len ? 1 : 0, out);
+        for (int j = 0; j < BLAKE3_OUT_LEN; j++) {
+            unsigned int x;
+            sscanf(blake3_vectors[i].hash + 2 * j, "%2x", &x);
+            ref[j] = x;
+        }
+        if (memcmp(out, ref, BLAKE3_OUT_LEN)) {
+            fprintf(stderr, "chunkhash: fails the published vector for %u bytes\n", len);
+            fails++;
+        }
+    }
+
+    for (u32 i = 0; i < sizeof(in); i++) {
+        in[i] = rand();
+    }
+    blake3_hasher_init_keyed(&b, (u8 *)s.chunkKey);
+    for (u32 i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        u32 len = lens[i];
+        keyed_hash(s.chunkKey, in, len, NULL, 0, ref);
+        for (int mode = 0; mode < 3; mode++) {
+            u32 tail = (mode == 0) ? len : (mode == 1) ? 16 : 1 + len % 5;
+            if (tail > len) {
+                tail = len;
+            }
+            u32 step = (mode == 1) ? 64 : 7;
+            chunk_hash_start(&h, b.key);
+            for (u32 off = 0; off < len - tail; off += step) {
+                chunk_hash_update(&h, in + off, (len - tail - off < step) ? len - tail - off : step);
+            }
+            if (chunk_hash_final(&h, in + len - tail, tail, out) != 0 || memcmp(out, ref, BLAKE3_OUT_LEN)) {
+                fprintf(stderr, "chunkhash: %u bytes with a %u byte tail do not match the reference\n", len, tail);
+                fails++;
+            }
+        }
+    }
+
+    chunk_hash_start(&h, b.key);
+    chunk_hash_update(&h, in, CHUNK_HASH_MAX_SZ);
+    if (chunk_hash_final(&h, in, 1, out) == 0) {
+        fprintf(stderr, "chunkhash: takes more than CHUNK_HASH_MAX_SZ bytes\n");
+        fails++;
+    }
+    return fails;
+}
+
+
+/* times the in-tree chunk hash against the Blake3 reference on one CHUNK_SZ
+ * chunk and its IV
+ * returns 0 if the hashes match
+ */
+static int bench_chunkhash(int iters) {
+    static u8 ct[CHUNK_SZ + BLK_SZ];
+    u8 ref[BLAKE3_OUT_LEN], out[BLAKE3_OUT_LEN];
+    timing tr = { "reference" }, tc = { "chunkhash" };
+    blake3_hasher b;
+    chunk_hasher h;
+
+    for (int i = 0; i < CHUNK_SZ + BLK_SZ; i++) ct[i] = rand();
+    blake3_hasher_init_keyed(&b, (u8 *)s.chunkKey);
+
+    printf("blake3: %d B chunk and IV\n", CHUNK_SZ);
+    for (int it = 0; it < iters * 20; it++) {
+        double t0 = now_us();
+        keyed_hash(s.chunkKey, ct, CHUNK_SZ, ct + CHUNK_SZ, BLK_SZ, ref);
+        record(&tr, now_us() - t0);
+        t0 = now_us();
+        chunk_hash_start(&h, b.key);
+        for (int i = 0; i < CHUNK_SZ; i += 64) {
+            chunk_hash_update(&h, ct + i, 64);
+        }
+        chunk_hash_final(&h, ct + CHUNK_SZ, BLK_SZ, out);
+        record(&tc, now_us() - t0);
+    }
+    report_unit(&tr, CHUNK_SZ, CHUNK_SZ / 64, "block");
+    report_unit(&tc, CHUNK_SZ, CHUNK_SZ / 64, "block");
+    if (memcmp(out, ref, BLAKE3_OUT_LEN)) {
+        fprintf(stderr, "blake3: chunkhash does not match the reference\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+//////////////////////// MERKLE TREE ////////////////////////
+
+
+/* checks Merkle tree verification on a synthesized song of 37 1 KB chunks, so
+ * most levels end in a node without a partner: single paths, with and without
+ * nodes verified earlier, and whole songs with one node of the table changed
+ * returns the number of failures
+ */
+static int test_merkle(void) {
+    static const struct {
+        u32 chunk;
+        int level;          // level of the path to change, or -1 for none
+        int ok;
+    } paths[] = {
+        { 9, -1, 1 }, { 9, 0, 1 },  // the second time chunk 9 is taken as verified
+        { 8, 0, 0 }, { 8, -1, 1 },  // its leaf is checked against the verified parent
+        { 30, 3, 0 }, { 30, -1, 1 }, { 36, -1, 1 }, { 35, 1, 0 },
+    };
+    char proof[MERKLE_MAX_DEPTH][BLAKE3_OUT_LEN];
+    int fails = 0;
+
+    synthesize_song(37 * 1024 - 100, DRM_V2, DRM_EXT_MERKLE, MIN_CHUNK_SHIFT);
+    u8 *table = drm_file + ((song *)drm_file)->ext.table_off;
+    s.logged_in = 1;
+    s.uid = PROVISIONED_UIDS[0];
+
+    restore_song();
+    if (verify_song() != 0 || s.layout.depth != 6) {
+        fprintf(stderr, "merkle: synthesized song does not verify\n");
+        return 1;
+    }
+    for (u32 i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        load_chunk_proof(paths[i].chunk, proof);
+        if (paths[i].level >= 0) {
+            proof[paths[i].level][0] ^= 1;
+        }
+        if ((verify_merkle(paths[i].chunk, (char *)table + paths[i].chunk * BLAKE3_OUT_LEN, proof) == 0)
+            != paths[i].ok) {
+            fprintf(stderr, "merkle: chunk %u with level %d changed %s\n", paths[i].chunk,
+                    paths[i].level, paths[i].ok ? "rejected" : "accepted");
+            fails++;
+        }
+    }
+
+    restore_song();
+    if (verify_song() != 0 || s.merkle[0].index != 36) {
+        fprintf(stderr, "merkle: verifying the song again forgets its verified nodes\n");
+        fails++;
+    }
+    digital_out();
+    if (c->song.wav_size != pcm_len || memcmp((char *)&c->song + c->dout.wav_off, pcm, pcm_len)) {
+        fprintf(stderr, "merkle: digital_out fails on the intact song\n");
+        fails++;
+    }
+    // a chunk hash, an interior node, and the last node of level 2, carried up
+    // from chunk 36 unchanged and the sibling of the paths from chunks 32-35
+    static const u32 nodes[] = { 20, 37 + 5, 37 + 19 + 9 };
+    for (u32 i = 0; i < sizeof(nodes) / sizeof(nodes[0]); i++) {
+        table[nodes[i] * BLAKE3_OUT_LEN] ^= 1;
+        restore_song();
+        digital_out();
+        if (c->song.wav_size != 0) {
+            fprintf(stderr, "merkle: digital_out accepts a song with table node %u changed\n", nodes[i]);
+            fails++;
+        }
+        stream_song();
+        host_hw_reset();
+        play_song();
+        if (host_hw_get_stats()->transfers >= 36) {
+            fprintf(stderr, "merkle: play_song plays a song with table node %u changed\n", nodes[i]);
+            fails++;
+        }
+        table[nodes[i] * BLAKE3_OUT_LEN] ^= 1;
+    }
+
+    // synthesize_song() is deterministic, so make the next song another one
+    synthesize_song(37 * 1024 - 116, DRM_V2, DRM_EXT_MERKLE, MIN_CHUNK_SHIFT);
+    restore_song();
+    if (verify_song() != 0 || s.merkle[0].index != (u32)-1) {
+        fprintf(stderr, "merkle: a new song keeps the nodes verified for the last one\n");
+        fails++;
+    }
+    return fails;
+}
+
+
+//////////////////////// CHUNK IVS ////////////////////////
+
+
+/* checks that digital_out decrypts songs with a derived IV per chunk, with and
+ * without a Merkle tree, and that a drm_ext flag this DRM does not know is
+ * rejected; test_seek() plays them
+ * returns the number of failures
+ */
+static int test_chunk_iv(void) {
+    static const u32 flags[] = { DRM_EXT_CHUNK_IV, DRM_EXT_MERKLE | DRM_EXT_CHUNK_IV };
+    int fails = 0;
+
+    s.logged_in = 1;
+    s.uid = PROVISIONED_UIDS[0];
+    for (u32 i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        synthesize_song(9 * 1024 + 5, DRM_V2, flags[i], MIN_CHUNK_SHIFT);
+        restore_song();
+        digital_out();
+        if (c->song.wav_size != pcm_len || memcmp((char *)&c->song + c->dout.wav_off, pcm, pcm_len)) {
+            fprintf(stderr, "chunk iv: digital_out fails on a song with flags %u\n", flags[i]);
+            fails++;
+        }
+    }
+
+    // with the metadata hash redone, so only the flag is wrong
+    song *hdr = (song *)drm_file;
+    hdr->ext.flags |= 0x04;
+    keyed_hash(s.mdKey, (u8 *)hdr->iv, md_hashed_sz(hdr), NULL, 0, (u8 *)hdr->mdHash);
+    restore_song();
+    if (verify_song() == 0) {
+        fprintf(stderr, "chunk iv: a song with an unknown drm_ext flag verifies\n");
+        fails++;
+    }
+    return fails;
+}
+
+
+//////////////////////// USERS ////////////////////////
+
+
+/* checks the username lookup against the uid table: every user is found again
+ * by name, only when provisioned if asked, and names one character off from a
+ * user's are not found
+ * returns the number of failures
+ */
+static int test_users(void) {
+    char *name, uid, buf[USERNAME_SZ];
+    int n, fails = 0;
+
+    for (n = 0; uid_to_username(n, &name, FALSE); n++) {
+        if (!username_to_uid(name, &uid, FALSE) || uid != n) {
+            fprintf(stderr, "users: '%s' is not found as uid %d\n", name, n);
+            fails++;
+        }
+        if (username_to_uid(name, &uid, TRUE) != is_provisioned_uid(n)) {
+            fprintf(stderr, "users: '%s' is found as provisioned %s\n", name,
+                    is_provisioned_uid(n) ? "only without it" : "without being it");
+            fails++;
+        }
+        size_t len = strlen(name);
+        strcpy(buf, name);
+        strcpy(buf + len, "#");
+        if (username_to_uid(buf, &uid, FALSE)) {
+            fprintf(stderr, "users: '%s' is found as uid %d\n", buf, uid);
+            fails++;
+        }
+        // the prefix may only be found if it is a user itself
+        char *other;
+        buf[len - 1] = 0;
+        if (username_to_uid(buf, &uid, FALSE) &&
+            (!uid_to_username(uid, &other, FALSE) || strcmp(buf, other))) {
+            fprintf(stderr, "users: '%s' is found as uid %d\n", buf, uid);
+            fails++;
+        }
+    }
+    if (n == 0 || username_to_uid("", &uid, FALSE)) {
+        fprintf(stderr, "users: the uid table is empty or finds the empty name\n");
+        fails++;
+    }
+    return fails;
+}
+
+
+/* checks is_locked() on the metadata of a synthesized song, with the owner,
+ * shared users and regions spread over the words of the bitmaps
+ * returns the number of failures
+ */
+static int test_locked(void) {
+    static const struct {
+        int logged_in, owner, shared, region, locked;
+    } cases[] = {
+        { 1, 1, 0, 1, 0 }, { 1, 0, 1, 1, 0 }, { 1, 0, 0, 1, 1 },
+        { 1, 1, 1, 0, 1 }, { 0, 1, 1, 1, 1 },
+    };
+    u8 me = 0xa7, other = 0x5c, rid = 255;
+    int fails = 0;
+
+    while (is_provisioned_rid(rid)) {
+        rid--;
+    }
+    synthesize_song(CHUNK_SZ, DRM_V1, 0, 0);
+    for (u32 i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        restore_song();
+        volatile drm_md *md = &c->song.md;
+        md->owner_id = cases[i].owner ? me : other;
+        md->num_regions = 3;
+        md->buf[0] = rid ^ 0x20;
+        md->buf[1] = cases[i].region ? PROVISIONED_RIDS[0] : rid;
+        md->buf[2] = rid;
+        md->num_users = 3;
+        md->buf[3] = other ^ 1;
+        md->buf[4] = cases[i].shared ? me : other ^ 2;
+        md->buf[5] = other;
+        load_song_md();
+        s.logged_in = cases[i].logged_in;
+        s.uid = me;
+        if (is_locked() != cases[i].locked) {
+            fprintf(stderr, "users: case %u is %slocked\n", i, cases[i].locked ? "not " : "");
+            fails++;
+        }
+    }
+    return fails;
+}
+
+
+//////////////////////// SEEKING ////////////////////////
+
+
+#define SEEK_TESTS 24
+
+/* sets up the DMA for simple transfers, or for the BD ring with sg, and has the
+ * firmware start buffers from the DMA interrupt with intr, or poll for it
+ */
+static void config_dma(int sg, int intr) {
+    static XIntc intc;
+
+    host_set_dma_sg(sg);
+    if (fnConfigDma(&sAxiDma) != XST_SUCCESS) {
+        fprintf(stderr, "DMA configuration failed\n");
+        exit(1);
+    }
+    if (intr) {
+        if (fnConfigDmaIntr(&intc, &sAxiDma, XPAR_INTC_0_AXIDMA_0_MM2S_INTROUT_VEC_ID,
+                            (XInterruptHandler)dmaISR) != XST_SUCCESS) {
+            fprintf(stderr, "DMA interrupt configuration failed\n");
+            exit(1);
+        }
+    } else {
+        XAxiDma_IntrDisable(&sAxiDma, XAXIDMA_IRQ_ALL_MASK, XAXIDMA_DMA_TO_DEVICE);
+    }
+    dma_intr = intr;
+}
+
+
+/* plays the synthesized song with FF and RW raised at random points, to a
+ * codec taking rate bytes per poll or an instant one, and checks the codec gets
+ * the audio a reference player would send, down to the sample, in one transfer
+ * per chunk played
+ * returns the number of failures
+ */
+static int seek_song(u32 version, u32 cs, u8 *out, u8 *ref, u32 cap, u32 rate, int sg, const char *mode) {
+    u32 enc_len = ((song *)drm_file)->encAudioLen;
+    u32 at[SEEK_TESTS];
+    char cmd[SEEK_TESTS];
+
+    // seeks far enough apart that each is taken before the next is raised,
+    // even with the DMA BRAM full of chunks decrypted ahead
+    stream_song();
+    host_hw_reset();
+    host_set_codec_rate(rate);
+    host_capture_audio(out, cap);
+    for (u32 i = 0, b = 0; i < SEEK_TESTS; i++) {
+        b += (rate ? DMA_BRAM_SZ : 0) + cs + rand() % SKIP_SZ;
+        at[i] = b;
+        cmd[i] = (rand() % 2) ? FF : RW;
+        host_schedule_interrupt(at[i], cmd[i]);
+    }
+    play_song();
+    // a seek past the end returns with the DMA still on its last transfer
+    audio_wait(0);
+    host_set_codec_rate(0);
+    u32 got = host_captured_bytes();
+
+    /* the reference: one transfer per chunk, with any seek taken after the
+     * transfer that crossed its byte count. The seek counts from the audio the
+     * DMA had finished with, which is the end of that transfer or the start of
+     * one it was still on. Slots already on the BD ring play out first, as does
+     * the end of the song if it was all decrypted, but with simple DMA no other
+     * slot decrypted after that transfer may
+     */
+    u32 pos = 0, n = 0, transfers = 0, next = 0, starts[DMA_NUM_SLOTS], queued = 0;
+    int ok = 1;
+    while (ok && pos < pcm_len) {
+        u32 end = (pos / cs + 1) * cs;
+        u32 len = ((end < pcm_len) ? end : pcm_len) - pos;
+        if (queued && (queued == DMA_NUM_SLOTS || n + len > got || memcmp(out + n, pcm + pos, len) ||
+                       (!sg && pcm_len - pos > (DMA_NUM_SLOTS - queued) * cs))) {
+            // the seek lands 5 s on or back from one of the points playback
+            // could have been at, or ends the song
+            int landed = 0;
+            for (int j = queued; j >= 0 && !landed; j--) {
+                u32 from = (j == (int)queued) ? pos : starts[j];
+                if (cmd[next] == FF && enc_len - from <= SKIP_SZ) {
+                    landed = (got == n) ? 2 : 0;
+                    continue;
+                }
+                u32 to = (cmd[next] == FF) ? (from + SKIP_SZ) & ~(BYTES_PER_SAMP - 1)
+                         : (from < SKIP_SZ) ? 0 : (from - SKIP_SZ) & ~(BYTES_PER_SAMP - 1);
+                u32 want = (pcm_len - to < 64) ? pcm_len - to : 64;
+                if (n + want <= got && !memcmp(out + n, pcm + to, want)) {
+                    pos = to;
+                    landed = 1;
+                }
+            }
+            if (landed != 1) {
+                ok = (landed == 2);
+                break;
+            }
+            queued = 0;
+            next++;
+            continue;
+        }
+        memcpy(ref + n, pcm + pos, len);
+        if (next < SEEK_TESTS && (queued || n + len >= at[next])) {
+            starts[queued++] = pos;
+        }
+        n += len;
+        pos += len;
+        transfers++;
+    }
+    if (!ok || got != n || memcmp(out, ref, n) || host_hw_get_stats()->transfers != transfers) {
+        fprintf(stderr, "seek: v%u song with %u B chunks sends %u B in %llu transfers after %u seeks "
+                "with %s%s, not %u B in %u\n", version ? 2 : 1, cs, got,
+                (unsigned long long)host_hw_get_stats()->transfers, next, mode,
+                rate ? " and a slow codec" : "", n, transfers);
+        return 1;
+    }
+    return 0;
+}
+
+
+/* plays synthesized songs straight through and then with FF and RW raised at
+ * random points, through seek_song(); a seek must find the chaining value for
+ * the chunk it lands on without miPod's help, and seek from what has been
+ * played when the firmware has decrypted ahead of a slow codec
+ * with sg, plays through the BD ring, and also straight through to a codec
+ * slower than the DMA, so that a BRAM half still queued would be overwritten
+ * if the firmware did not wait for it; with intr, from the DMA interrupt
+ * returns the number of failures
+ */
+static int test_seek(int sg, int intr) {
+    static const struct { u32 version, flags, shift; } songs[] = {
+        { DRM_V2, DRM_EXT_MERKLE, MAX_CHUNK_SHIFT }, { DRM_V2, 0, MIN_CHUNK_SHIFT }, { DRM_V1, 0, 0 },
+        { DRM_V2, DRM_EXT_MERKLE | DRM_EXT_CHUNK_IV, MIN_CHUNK_SHIFT },
+    };
+    const char *mode = sg ? (intr ? "BD ring from the interrupt" : "BD ring")
+                          : (intr ? "simple DMA from the interrupt" : "simple DMA");
+    int fails = 0;
+
+    config_dma(sg, intr);
+    for (u32 k = 0; k < sizeof(songs) / sizeof(songs[0]); k++) {
+        synthesize_song(3000001, songs[k].version, songs[k].flags, songs[k].shift);
+        u32 cs = (songs[k].version == DRM_V2) ? 1 << songs[k].shift : CHUNK_SZ;
+        u32 cap = 4 * pcm_len;
+        u8 *out = malloc(cap), *ref = malloc(cap);
+        s.logged_in = 1;
+        s.uid = PROVISIONED_UIDS[0];
+
+        for (u32 rate = 0; rate <= (sg ? 700 : 0); rate += 700) {
+            stream_song();
+            host_hw_reset();
+            host_set_codec_rate(rate);
+            host_capture_audio(out, cap);
+            play_song();
+            host_set_codec_rate(0);
+            if (host_captured_bytes() != pcm_len || memcmp(out, pcm, pcm_len)) {
+                fprintf(stderr, "seek: v%u song with %u B chunks does not play straight through with %s%s\n",
+                        songs[k].version ? 2 : 1, cs, mode, rate ? " and a slow codec" : "");
+                fails++;
+            }
+        }
+
+        // then with seeks, to an instant codec and to a slow one, which the
+        // firmware decrypts ahead of
+        for (u32 rate = 0; rate <= 700; rate += 700) {
+            fails += seek_song(songs[k].version, cs, out, ref, cap, rate, sg, mode);
+        }
+        host_capture_audio(NULL, 0);
+        free(out);
+        free(ref);
+    }
+    config_dma(0, 0);
+    return fails;
+}
+
+
+/* plays a song to a codec running in real time, well below the speed of the
+ * DRM, in each DMA mode, checking the audio arrives intact without the FIFO
+ * ever running dry; then to one far faster than the DRM, which must run dry;
+ * then stops one part way and dumps it while the queued slots play out
+ * the slow codec takes 16 ms to drain a full FIFO, so that the host being busy
+ * elsewhere for a moment does not fail the test; how often the FIFO ran low
+ * is left to the -r benchmark for the same reason
+ * returns the number of failures
+ */
+static int test_underrun(void) {
+    u32 cap = 2 * 250000;
+    u8 *out = malloc(cap);
+    int fails = 0;
+
+    synthesize_song(250000, DRM_V2, DRM_EXT_MERKLE, MAX_CHUNK_SHIFT);
+    s.logged_in = 1;
+    s.uid = PROVISIONED_UIDS[0];
+    for (int mode = 0; mode < 5; mode++) {
+        int sg = mode & 1, intr = (mode >> 1) & 1, fast = (mode == 4);
+        config_dma(sg, intr);
+        stream_song();
+        host_hw_reset();
+        host_capture_audio(out, cap);
+        host_set_codec_speed(fast ? 1000000000 : 1000);
+        play_song();
+        host_set_codec_speed(0);
+
+        const host_hw_stats *st = host_hw_get_stats();
+        const char *name = sg ? "BD ring" : "simple DMA";
+        if (host_captured_bytes() != pcm_len || memcmp(out, pcm, pcm_len)) {
+            fprintf(stderr, "underrun: %s%s does not play straight through to a timed codec\n",
+                    name, intr ? " from the interrupt" : "");
+            fails++;
+        }
+        if (fast ? pq.underruns == 0 : pq.underruns != 0) {
+            fprintf(stderr, "underrun: %s%s ran the FIFO dry %u times and low %u times with a %s codec\n",
+                    name, intr ? " from the interrupt" : "", pq.underruns, pq.low_water,
+                    fast ? "fast" : "slow");
+            fails++;
+        }
+        if (intr && st->dma_irqs == 0) {
+            fprintf(stderr, "underrun: %s never took the DMA interrupt\n", name);
+            fails++;
+        }
+    }
+
+    // a song stopped with slots still queued plays them out intact, even when
+    // digital_out decrypts into the DMA BRAM right after
+    stream_song();
+    host_hw_reset();
+    host_capture_audio(out, cap);
+    host_set_codec_speed(1000);
+    host_schedule_interrupt(2 * MAX_CHUNK_SZ, STOP);
+    play_song();
+    restore_song();
+    digital_out();
+    host_set_codec_speed(0);
+    if (host_captured_bytes() < 2 * MAX_CHUNK_SZ || memcmp(out, pcm, host_captured_bytes()) ||
+        c->song.wav_size != pcm_len || memcmp((char *)&c->song + c->dout.wav_off, pcm, pcm_len)) {
+        fprintf(stderr, "underrun: digital_out after a stopped song garbles the audio or the dump\n");
+        fails++;
+    }
+    host_capture_audio(NULL, 0);
+    config_dma(0, 0);
+    free(out);
+    return fails;
+}
+
+
+/* times each chunk decryption kernel on one CHUNK_SZ chunk and checks that
+ * all of them produce the same plaintext
+ * returns 0 if the outputs match
+ */
+static int bench_speck(int iters) {
+    static char ct[CHUNK_SZ], out[NKERNELS][CHUNK_SZ];
+    char iv0[BLK_SZ], iv[NKERNELS][BLK_SZ];
+    int blocks = CHUNK_SZ / BLK_SZ, ret = 0;
+
+    for (int i = 0; i < CHUNK_SZ; i++) ct[i] = rand();
+    for (int i = 0; i < BLK_SZ; i++) iv0[i] = rand();
+
+    printf("speck: %d B chunk, SPECK_UNROLL=%d, SPECK_LANES=%d, firmware uses cbc%d\n",
+           CHUNK_SZ, SPECK_UNROLL, SPECK_LANES, SPECK_WORD32 ? 32 : 64);
+    for (int k = 0; k < NKERNELS; k++) {
+        timing t = { kernels[k].name };
+        u64 best = ~0ULL;
+
+        for (int it = 0; it < iters * 20; it++) {
+            memcpy(iv[k], iv0, BLK_SZ);
+            double t0 = now_us();
+            u64 c0 = cycles();
+            kernels[k].fn(s.rk, ct, out[k], CHUNK_SZ, iv[k]);
+            u64 c1 = cycles();
+            record(&t, now_us() - t0);
+            if (c1 - c0 < best) best = c1 - c0;
+        }
+        report_unit(&t, CHUNK_SZ, blocks, "block");
+        if (best) {
+            printf("%-12s %.1f cycles/block\n", "", (double)best / blocks);
+        }
+        if (memcmp(out[k], out[0], CHUNK_SZ) || memcmp(iv[k], iv[0], BLK_SZ)) {
+            fprintf(stderr, "speck: %s does not match the reference\n", kernels[k].name);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+
+//////////////////////// MAIN ////////////////////////
+
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-s audio_bytes] [-V 1|2] [-c shift] [-F] [-I] [-f song.drm] [-u uid] [-n iters]\n"
+            "          [-g] [-i] [-r bytes_per_ms] [-k] [-t] [-v]\n"
+            "  -s  synthesize a song with this many bytes of audio (default 8000000)\n"
+            "  -V  file format version of the synthesized song (default 2)\n"
+            "  -c  v2 chunk size, as a power of two (default 14)\n"
+            "  -F  v2 with a flat chunk hash table instead of a Merkle tree\n"
+            "  -I  v2 with a derived IV per chunk instead of CBC chaining across chunks\n"
+            "  -f  benchmark an existing .drm file instead\n"
+            "  -u  log in as this uid (default: the song owner)\n"
+            "  -n  iterations per measurement (default 5)\n"
+            "  -g  play through the scatter-gather BD ring instead of simple transfers\n"
+            "  -i  start DMA buffers from the DMA interrupt instead of polling\n"
+            "  -r  play to a codec draining this many bytes per ms in real time (default: instantly)\n"
+            "  -k  benchmark the Speck kernels and the chunk hash against the reference code instead\n"
+            "  -t  run the self-tests instead\n"
+            "  -v  show DRM UART output\n", prog);
+}
+
+
+int main(int argc, char **argv) {
+    u32 audio_len = 8000000;
+    const char *song_path = NULL;
+    int uid = -1, iters = 5, kernel = 0, test = 0, sg = 0, intr = 0, version = 2, shift = MAX_CHUNK_SHIFT, opt;
+    u32 speed = 0;
+    u32 flags = DRM_EXT_MERKLE;
+
+    while ((opt = getopt(argc, argv, "s:V:c:FIf:u:n:gir:ktv")) != -1) {
+        switch (opt) {
+        case 's': audio_len = strtoul(optarg, NULL, 0); break;
+        case 'V': version = atoi(optarg); break;
+        case 'c': shift = atoi(optarg); break;
+        case 'F': flags &= ~DRM_EXT_MERKLE; break;
+        case 'I': flags |= DRM_EXT_CHUNK_IV; break;
+        case 'f': song_path = optarg; break;
+        case 'u': uid = atoi(optarg); break;
+        case 'n': iters = atoi(optarg); break;
+        case 'g': sg = 1; break;
+        case 'i': intr = 1; break;
+        case 'r': speed = strtoul(optarg, NULL, 0); break;
+        case 'k': kernel = 1; break;
+        case 't': test = 1; break;
+        case 'v': host_set_verbose(1); break;
+        default: usage(argv[0]); return 2;
+        }
+    }
+    if (iters <= 0 || audio_len == 0 || audio_len > MAX_SONG_SZ || (version != 1 && version != 2) ||
+        shift < MIN_CHUNK_SHIFT || shift > MAX_CHUNK_SHIFT) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    host_channel_init();
+    host_set_idle_hook(feed_stream);
+    microblaze_register_handler((XInterruptHandler)myISR, NULL);
+    if (init_cryptkeys() != 0) {
+        fprintf(stderr, "Error initializing keys\n");
+        return 1;
+    }
+    config_dma(sg, intr);
+
+    if (test) {
+        int fails = test_speck() + test_chunkhash() + test_merkle() + test_chunk_iv() + test_underrun() + test_users() + test_locked();
+        for (int mode = 0; mode < 4; mode++) {
+            fails += test_seek(mode & 1, mode >> 1);
+        }
+        printf("self-tests: %s\n", fails ? "FAILED" : "passed");
+        return fails ? 1 : 0;
+    }
+    if (kernel) {
+        return (bench_speck(iters) | bench_chunkhash(iters)) ? 1 : 0;
+    }
+
+    if (song_path) {
+        if (load_song_file(song_path) != 0) {
+            return 1;
+        }
+    } else {
+        synthesize_song(audio_len, (version == 2) ? DRM_V2 : DRM_V1, flags, shift);
+        if (drm_len > HOST_CHANNEL_SZ - offsetof(cmd_channel, song)) {
+            fprintf(stderr, "synthesized song too large for the command channel\n");
+            return 1;
+        }
+    }
+    restore_song();
+
+    u32 enc_len = c->song.encAudioLen;
+    u32 nchunks = drm_nchunks(c->song.numChunks);
+    s.logged_in = 1;
+    s.uid = (uid >= 0) ? uid : c->song.md.owner_id;
+    printf("song: %u B encrypted audio, %u chunks, uid %d\n", enc_len, nchunks, s.uid);
+
+    timing tv = { "verify_song" }, tp = { "play_song" }, td = { "digital_out" };
+    int ok = 1;
+
+    for (int i = 0; i < iters; i++) {
+        restore_song();
+        double t0 = now_us();
+        if (verify_song() != 0) {
+            fprintf(stderr, "verify_song failed\n");
+            return 1;
+        }
+        record(&tv, now_us() - t0);
+
+        stream_song();
+        host_hw_reset();
+        host_set_codec_speed(speed);
+        t0 = now_us();
+        play_song();
+        record(&tp, now_us() - t0);
+        host_set_codec_speed(0);
+        // every chunk played takes at least one transfer, apart from a last
+        // chunk that can be all padding
+        u32 cs = s.layout.chunk_sz;
+        u32 played = (is_locked() && enc_len > PREVIEW_SZ) ? (PREVIEW_SZ + cs - 1) / cs
+                     : nchunks - (enc_len % cs == BLK_SZ);
+        if (c->song.wav_size == 0 || host_hw_get_stats()->transfers < played) {
+            fprintf(stderr, "play_song failed\n");
+            return 1;
+        }
+
+        restore_song();
+        t0 = now_us();
+        digital_out();
+        record(&td, now_us() - t0);
+        if (c->song.wav_size == 0) {
+            fprintf(stderr, "digital_out failed\n");
+            return 1;
+        }
+        if (pcm && (c->song.wav_size != pcm_len ||
+                    memcmp((char *)&c->song + c->dout.wav_off, pcm, pcm_len) != 0)) {
+            ok = 0;
+        }
+    }
+
+    report(&tv, 0, 0);
+    report(&tp, enc_len, nchunks);
+    report(&td, enc_len, nchunks);
+    printf("dma: %llu transfers, %llu bytes\n",
+           (unsigned long long)host_hw_get_stats()->transfers,
+           (unsigned long long)host_hw_get_stats()->bytes);
+    if (speed) {
+        printf("fifo: ran dry %u times, low %u times, %llu DMA interrupts\n", pq.underruns, pq.low_water,
+               (unsigned long long)host_hw_get_stats()->dma_irqs);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "digital_out output does not match the source audio\n");
+        return 1;
+    }
+    host_channel_free();
+    return 0;
+}
@@ -0,0 +1,730 @@
+/*
+ * Fake MicroBlaze hardware for the host build of the DRM
+ *
+ * Provides the BSP functions the DRM sources call (DMA, interrupt controller,
+ * LED PWM, wolfCrypt Base64) on top of plain host memory. See hal.h for the
+ * harness-facing side.
+ */
+
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "xparameters.h"
+#include "xaxidma.h"
+#include "xintc.h"
+#include "xil_exception.h"
+#include "xil_printf.h"
+#include "wolfssl/wolfcrypt/coding.h"
+#include "PWM.h"
+#include "hal.h"
+
+// DRM globals defined in main.c
+extern volatile cmd_channel *c;
+
+// DMA BRAM is 0x8000 bytes on the board; the slack keeps an overlong transfer
+// from reading past the host allocation instead of faulting on the bus
+#define HOST_BRAM_SZ 0x8000
+u8 host_dma_bram[HOST_BRAM_SZ * 2];
+volatile u32 host_fifo_fill;
+
+static host_hw_stats stats;
+static u64 dma_pending;          // bytes the DMA has yet to push into the FIFO
+static u32 dma_off;              // BRAM offset it reads them from next
+static u32 codec_rate;           // bytes the codec drains per busy poll
+static double codec_speed;       // bytes the codec drains per microsecond, when timed
+static double codec_clock;       // time up to which the timed codec has drained
+static u8 *capture_buf;
+static u32 capture_cap, capture_len;
+static int verbose;
+static void (*idle_hook)(void);
+
+// SG engine: the TX BD ring, how many BDs from its HwHead the engine has
+// started, and the one it is playing
+static XAxiDma_BdRing *sg_ring;
+static int sg_issued;
+static XAxiDma_Bd *sg_active;
+
+// DMA interrupt status and enable bits, and a simple transfer in flight
+static u32 dma_irq, dma_irq_en;
+static int dma_simple;
+
+// the PS->PL line and the DMA interrupt, wherever the firmware connected them
+static XInterruptHandler isr, dma_isr;
+static void *isr_ref, *dma_isr_ref;
+
+/* the timed codec drains the FIFO from a timer signal, which stays out of the
+ * fake hardware while the firmware is inside it, and raises the DMA interrupt
+ * unless the firmware has interrupts off or is already in its handler
+ */
+static volatile sig_atomic_t hw_depth, irq_off, in_irq;
+
+// pending scheduled interrupts, fired in order as the codec receives audio
+#define HOST_MAX_SCHED 256
+static struct { u64 at_byte; char cmd; } sched[HOST_MAX_SCHED];
+static int sched_head, sched_tail;
+
+static void *channel;
+
+static XAxiDma_Config dma_cfg = { XPAR_AXIDMA_0_DEVICE_ID, 0, XPAR_AXIDMA_0_INCLUDE_SG };
+
+
+//////////////////////// HARNESS CONTROL ////////////////////////
+
+
+volatile cmd_channel *host_channel_init(void) {
+    channel = calloc(1, HOST_CHANNEL_SZ);
+    c = (volatile cmd_channel *)channel;
+    return c;
+}
+
+
+void host_channel_free(void) {
+    free(channel);
+    channel = NULL;
+    c = NULL;
+}
+
+
+void host_hw_reset(void) {
+    memset(&stats, 0, sizeof(stats));
+    dma_pending = 0;
+    dma_simple = 0;
+    dma_irq = 0;
+    host_fifo_fill = 0;
+    capture_len = 0;
+    sched_head = sched_tail = 0;
+}
+
+
+const host_hw_stats *host_hw_get_stats(void) {
+    return &stats;
+}
+
+
+void host_set_dma_sg(int sg) {
+    dma_cfg.HasSg = sg;
+}
+
+
+void host_set_codec_rate(u32 bytes_per_poll) {
+    codec_rate = bytes_per_poll;
+}
+
+
+static void codec_timer(int sig);
+
+void host_set_codec_speed(u32 bytes_per_ms) {
+    struct itimerval it = { { 0, 0 }, { 0, 0 } };
+
+    codec_speed = bytes_per_ms / 1000.0;
+    if (codec_speed) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        codec_clock = tv.tv_sec * 1e6 + tv.tv_usec;
+        signal(SIGALRM, codec_timer);
+        it.it_interval.tv_usec = it.it_value.tv_usec = 200;
+    }
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
+
+void host_capture_audio(u8 *buf, u32 cap) {
+    capture_buf = buf;
+    capture_cap = cap;
+    capture_len = 0;
+}
+
+
+u32 host_captured_bytes(void) {
+    return capture_len;
+}
+
+
+void host_raise_interrupt(char cmd) {
+    c->cmd = cmd;
+    if (isr) {
+        isr(isr_ref);
+    }
+}
+
+
+int host_schedule_interrupt(u64 at_byte, char cmd) {
+    if (sched_tail == HOST_MAX_SCHED) {
+        return -1;
+    }
+    sched[sched_tail].at_byte = at_byte;
+    sched[sched_tail].cmd = cmd;
+    sched_tail++;
+    return 0;
+}
+
+
+void host_set_idle_hook(void (*hook)(void)) {
+    idle_hook = hook;
+}
+
+
+void host_set_verbose(int v) {
+    verbose = v;
+}
+
+
+//////////////////////// FAKE CODEC FIFO ////////////////////////
+
+
+// fires any scheduled interrupts whose byte position has been reached
+static void fire_scheduled(void) {
+    while (sched_head < sched_tail && stats.bytes >= sched[sched_head].at_byte) {
+        host_raise_interrupt(sched[sched_head++].cmd);
+    }
+}
+
+
+/* advances the codec by one poll, or to the current time when timed: drain the
+ * FIFO, then let the DMA refill it
+ */
+static void codec_tick(void) {
+    u32 fill = host_fifo_fill, drain = codec_rate;
+    int instant = (codec_rate == 0 && codec_speed == 0);
+
+    if (codec_speed) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        double now = tv.tv_sec * 1e6 + tv.tv_usec;
+        drain = (u32)((now - codec_clock) * codec_speed);
+        // an empty FIFO does not bank time for later
+        codec_clock = (drain >= fill) ? now : codec_clock + drain / codec_speed;
+    }
+    if (instant) {
+        fill = 0;
+    } else {
+        fill = (fill > drain) ? fill - drain : 0;
+    }
+
+    u64 room = FIFO_CAP - fill;
+    u64 moved = (dma_pending < room) ? dma_pending : room;
+
+    // the DMA reads the BRAM as it goes, so audio overwritten before it has
+    // been read is what gets played; reads past the BRAM come back as silence
+    if (capture_buf) {
+        for (u64 i = 0; i < moved && capture_len < capture_cap; i++) {
+            u32 off = dma_off + i;
+            capture_buf[capture_len++] = (off < HOST_BRAM_SZ) ? host_dma_bram[off] : 0;
+        }
+    }
+    dma_off += moved;
+    dma_pending -= moved;
+    fill += moved;
+    if (dma_simple && dma_pending == 0) {
+        dma_simple = 0;
+        dma_irq |= XAXIDMA_IRQ_IOC_MASK;
+    }
+
+    // instant codec: whatever the DMA pushed has already been played
+    host_fifo_fill = instant ? 0 : fill;
+}
+
+
+// calls the DMA interrupt handler for as long as the DMA raises it
+static void deliver_irqs(void) {
+    while (dma_isr && (dma_irq & dma_irq_en) && !irq_off && !in_irq && !hw_depth) {
+        in_irq = 1;
+        stats.dma_irqs++;
+        dma_isr(dma_isr_ref);
+        in_irq = 0;
+    }
+}
+
+
+// brackets the fake hardware entry points the timer could otherwise interrupt
+static void hw_enter(void) {
+    hw_depth++;
+}
+
+static void hw_leave(void) {
+    hw_depth--;
+    deliver_irqs();
+}
+
+
+//////////////////////// AXI DMA ////////////////////////
+
+
+// starts the MM2S channel on Length bytes at BuffAddr, as a simple transfer or
+// for a BD, handing the samples to the codec
+static u32 dma_start(UINTPTR BuffAddr, u32 Length) {
+    // the MM2S channel only reaches the DMA BRAM
+    UINTPTR base = XPAR_MB_DMA_AXI_BRAM_CTRL_0_S_AXI_BASEADDR;
+    if (BuffAddr < base || BuffAddr >= base + HOST_BRAM_SZ) {
+        stats.rejected++;
+        return XST_INVALID_PARAM;
+    }
+
+    stats.transfers++;
+    stats.bytes += Length;
+    dma_pending = Length;
+    dma_off = BuffAddr - base;
+    codec_tick();
+    return XST_SUCCESS;
+}
+
+
+// returns the BD k places after BdPtr in the ring
+static XAxiDma_Bd *bd_at(XAxiDma_BdRing *RingPtr, XAxiDma_Bd *BdPtr, int k) {
+    u32 i = ((UINTPTR)BdPtr - RingPtr->FirstBdAddr) / RingPtr->Separation;
+    return (XAxiDma_Bd *)(RingPtr->FirstBdAddr + ((i + k) % RingPtr->AllCnt) * RingPtr->Separation);
+}
+
+
+/* runs the SG engine: completes the BD being played once the DMA has pushed all
+ * of it into the FIFO, then starts the next BD handed to the engine, if any
+ * a BD the DMA refuses completes with an error and halts the channel
+ */
+static void sg_step(void) {
+    XAxiDma_BdRing *r = sg_ring;
+
+    while (r && r->RunState == AXIDMA_CHANNEL_NOT_HALTED) {
+        if (sg_active) {
+            if (dma_pending) {
+                return;
+            }
+            XAxiDma_BdWrite(sg_active, XAXIDMA_BD_STS_OFFSET, XAXIDMA_BD_STS_COMPLETE_MASK);
+            sg_active = NULL;
+            dma_irq |= XAXIDMA_IRQ_IOC_MASK;
+        }
+        if (sg_issued == r->HwCnt) {
+            return;
+        }
+
+        XAxiDma_Bd *bd = bd_at(r, r->HwHead, sg_issued++);
+        UINTPTR addr = XAxiDma_BdRead(bd, XAXIDMA_BD_BUFA_OFFSET) |
+                       (UINTPTR)XAxiDma_BdRead(bd, XAXIDMA_BD_BUFA_MSB_OFFSET) << 16 << 16;
+        u32 len = XAxiDma_BdRead(bd, XAXIDMA_BD_CTRL_LEN_OFFSET) & r->MaxTransferLen;
+        if (len == 0 || dma_start(addr, len) != XST_SUCCESS) {
+            XAxiDma_BdWrite(bd, XAXIDMA_BD_STS_OFFSET,
+                            XAXIDMA_BD_STS_COMPLETE_MASK | XAXIDMA_BD_STS_DMA_INT_ERR_MASK);
+            r->RunState = AXIDMA_CHANNEL_HALTED;
+            dma_irq |= XAXIDMA_IRQ_ERROR_MASK;
+            return;
+        }
+        sg_active = bd;
+    }
+}
+
+
+
+XAxiDma_Config *XAxiDma_LookupConfig(u32 DeviceId) {
+    return (DeviceId == XPAR_AXIDMA_0_DEVICE_ID) ? &dma_cfg : NULL;
+}
+
+
+int XAxiDma_CfgInitialize(XAxiDma *InstancePtr, XAxiDma_Config *Config) {
+    InstancePtr->RegBase = Config->BaseAddr;
+    InstancePtr->HasSg = Config->HasSg;
+    InstancePtr->Initialized = 1;
+    return XST_SUCCESS;
+}
+
+
+u32 XAxiDma_Busy(XAxiDma *InstancePtr, int Direction) {
+    (void)InstancePtr;
+    (void)Direction;
+    u32 busy;
+
+    hw_enter();
+    codec_tick();
+    sg_step();
+    fire_scheduled();
+    busy = (dma_pending != 0);
+    if (busy) {
+        stats.busy_polls++;
+    }
+    hw_leave();
+    return busy;
+}
+
+
+u32 XAxiDma_SimpleTransfer(XAxiDma *InstancePtr, UINTPTR BuffAddr, u32 Length,
+        int Direction) {
+    (void)InstancePtr;
+
+    if (Direction != XAXIDMA_DMA_TO_DEVICE || Length == 0 || Length > HOST_DMA_MAX_LEN ||
+        InstancePtr->HasSg || dma_pending) {
+        stats.rejected++;
+        return (Length > HOST_DMA_MAX_LEN) ? XST_INVALID_PARAM : XST_FAILURE;
+    }
+
+    hw_enter();
+    dma_simple = 1;
+    u32 status = dma_start(BuffAddr, Length);
+    if (status != XST_SUCCESS) {
+        dma_simple = 0;
+    }
+    fire_scheduled();
+    hw_leave();
+    return status;
+}
+
+
+//////////////////////// AXI DMA BD RING ////////////////////////
+
+
+u32 XAxiDma_BdRingCreate(XAxiDma_BdRing *RingPtr, UINTPTR PhysAddr,
+        UINTPTR VirtAddr, u32 Alignment, int BdCount) {
+    (void)PhysAddr;
+
+    if (BdCount <= 0 || Alignment < XAXIDMA_BD_MINIMUM_ALIGNMENT || (Alignment & (Alignment - 1)) ||
+        (VirtAddr & (Alignment - 1))) {
+        return XST_INVALID_PARAM;
+    }
+    memset(RingPtr, 0, sizeof(*RingPtr));
+    RingPtr->RunState = AXIDMA_CHANNEL_HALTED;
+    RingPtr->MaxTransferLen = HOST_DMA_MAX_LEN;
+    RingPtr->FirstBdAddr = VirtAddr;
+    RingPtr->Separation = (sizeof(XAxiDma_Bd) + Alignment - 1) & ~(Alignment - 1);
+    RingPtr->FreeHead = RingPtr->PreHead = RingPtr->HwHead = RingPtr->PostHead = (XAxiDma_Bd *)VirtAddr;
+    RingPtr->FreeCnt = RingPtr->AllCnt = BdCount;
+    memset((void *)VirtAddr, 0, BdCount * RingPtr->Separation);
+
+    sg_ring = RingPtr;
+    sg_issued = 0;
+    sg_active = NULL;
+    return XST_SUCCESS;
+}
+
+
+int XAxiDma_BdRingClone(XAxiDma_BdRing *RingPtr, XAxiDma_Bd *SrcBdPtr) {
+    if (RingPtr->FreeCnt != RingPtr->AllCnt) {
+        return XST_FAILURE;
+    }
+    for (int i = 0; i < RingPtr->AllCnt; i++) {
+        memcpy(bd_at(RingPtr, (XAxiDma_Bd *)RingPtr->FirstBdAddr, i), SrcBdPtr, sizeof(XAxiDma_Bd));
+    }
+    return XST_SUCCESS;
+}
+
+
+int XAxiDma_BdRingAlloc(XAxiDma_BdRing *RingPtr, int NumBd, XAxiDma_Bd **BdSetPtr) {
+    if (NumBd <= 0 || RingPtr->FreeCnt < NumBd) {
+        return XST_FAILURE;
+    }
+    *BdSetPtr = RingPtr->FreeHead;
+    RingPtr->FreeHead = bd_at(RingPtr, RingPtr->FreeHead, NumBd);
+    RingPtr->FreeCnt -= NumBd;
+    RingPtr->PreCnt += NumBd;
+    return XST_SUCCESS;
+}
+
+
+int XAxiDma_BdRingUnAlloc(XAxiDma_BdRing *RingPtr, int NumBd, XAxiDma_Bd *BdSetPtr) {
+    (void)BdSetPtr;
+
+    if (NumBd <= 0 || RingPtr->PreCnt < NumBd) {
+        return XST_FAILURE;
+    }
+    RingPtr->FreeHead = bd_at(RingPtr, RingPtr->FreeHead, RingPtr->AllCnt - NumBd);
+    RingPtr->FreeCnt += NumBd;
+    RingPtr->PreCnt -= NumBd;
+    return XST_SUCCESS;
+}
+
+
+int XAxiDma_BdRingToHw(XAxiDma_BdRing *RingPtr, int NumBd, XAxiDma_Bd *BdSetPtr) {
+    if (NumBd <= 0 || RingPtr->PreCnt < NumBd || BdSetPtr != RingPtr->PreHead) {
+        return XST_FAILURE;
+    }
+    hw_enter();
+    for (int i = 0; i < NumBd; i++) {
+        XAxiDma_Bd *bd = bd_at(RingPtr, BdSetPtr, i);
+        u32 ctrl = XAxiDma_BdRead(bd, XAXIDMA_BD_CTRL_LEN_OFFSET);
+        // every packet here is a single BD
+        if ((ctrl & XAXIDMA_BD_CTRL_ALL_MASK) != XAXIDMA_BD_CTRL_ALL_MASK) {
+            hw_leave();
+            return XST_FAILURE;
+        }
+        XAxiDma_BdWrite(bd, XAXIDMA_BD_STS_OFFSET, 0);
+    }
+    RingPtr->PreHead = bd_at(RingPtr, RingPtr->PreHead, NumBd);
+    RingPtr->PreCnt -= NumBd;
+    RingPtr->HwCnt += NumBd;
+
+    sg_step();
+    fire_scheduled();
+    hw_leave();
+    return XST_SUCCESS;
+}
+
+
+int XAxiDma_BdRingFromHw(XAxiDma_BdRing *RingPtr, int BdLimit, XAxiDma_Bd **BdSetPtr) {
+    int n = 0;
+
+    hw_enter();
+    codec_tick();
+    sg_step();
+    fire_scheduled();
+    while (n < BdLimit && n < RingPtr->HwCnt &&
+           (XAxiDma_BdGetSts(bd_at(RingPtr, RingPtr->HwHead, n)) & XAXIDMA_BD_STS_COMPLETE_MASK)) {
+        n++;
+    }
+    *BdSetPtr = RingPtr->HwHead;
+    RingPtr->HwHead = bd_at(RingPtr, RingPtr->HwHead, n);
+    RingPtr->HwCnt -= n;
+    RingPtr->PostCnt += n;
+    if (RingPtr == sg_ring) {
+        sg_issued -= n;
+    }
+    if (RingPtr->HwCnt) {
+        stats.busy_polls++;
+    }
+    hw_leave();
+    return n;
+}
+
+
+int XAxiDma_BdRingFree(XAxiDma_BdRing *RingPtr, int NumBd, XAxiDma_Bd *BdSetPtr) {
+    if (NumBd <= 0 || RingPtr->PostCnt < NumBd || BdSetPtr != RingPtr->PostHead) {
+        return XST_FAILURE;
+    }
+    RingPtr->PostHead = bd_at(RingPtr, RingPtr->PostHead, NumBd);
+    RingPtr->PostCnt -= NumBd;
+    RingPtr->FreeCnt += NumBd;
+    return XST_SUCCESS;
+}
+
+
+int XAxiDma_BdRingStart(XAxiDma_BdRing *RingPtr) {
+    hw_enter();
+    RingPtr->RunState = AXIDMA_CHANNEL_NOT_HALTED;
+    sg_step();
+    fire_scheduled();
+    hw_leave();
+    return XST_SUCCESS;
+}
+
+
+int XAxiDma_BdSetLength(XAxiDma_Bd *BdPtr, u32 LenBytes, u32 LengthMask) {
+    if (LenBytes == 0 || LenBytes > LengthMask) {
+        return XST_INVALID_PARAM;
+    }
+    u32 ctrl = XAxiDma_BdRead(BdPtr, XAXIDMA_BD_CTRL_LEN_OFFSET);
+    XAxiDma_BdWrite(BdPtr, XAXIDMA_BD_CTRL_LEN_OFFSET, (ctrl & ~LengthMask) | LenBytes);
+    return XST_SUCCESS;
+}
+
+
+u32 XAxiDma_BdSetBufAddr(XAxiDma_Bd *BdPtr, UINTPTR Addr) {
+    // without the data realignment engine, buffers start on a 32-bit word
+    if (Addr & 3) {
+        return XST_INVALID_PARAM;
+    }
+    XAxiDma_BdWrite(BdPtr, XAXIDMA_BD_BUFA_OFFSET, (u32)Addr);
+    XAxiDma_BdWrite(BdPtr, XAXIDMA_BD_BUFA_MSB_OFFSET, (u32)(Addr >> 16 >> 16));
+    return XST_SUCCESS;
+}
+
+
+void XAxiDma_BdSetCtrl(XAxiDma_Bd *BdPtr, u32 Data) {
+    u32 ctrl = XAxiDma_BdRead(BdPtr, XAXIDMA_BD_CTRL_LEN_OFFSET);
+    XAxiDma_BdWrite(BdPtr, XAXIDMA_BD_CTRL_LEN_OFFSET,
+                    (ctrl & ~XAXIDMA_BD_CTRL_ALL_MASK) | (Data & XAXIDMA_BD_CTRL_ALL_MASK));
+}
+
+
+void XAxiDma_IntrEnable(XAxiDma *InstancePtr, u32 Mask, int Direction) {
+    (void)InstancePtr;
+    (void)Direction;
+    hw_enter();
+    dma_irq_en |= Mask & XAXIDMA_IRQ_ALL_MASK;
+    hw_leave();
+}
+
+
+void XAxiDma_IntrDisable(XAxiDma *InstancePtr, u32 Mask, int Direction) {
+    (void)InstancePtr;
+    (void)Direction;
+    hw_enter();
+    dma_irq_en &= ~Mask;
+    hw_leave();
+}
+
+
+u32 XAxiDma_IntrGetIrq(XAxiDma *InstancePtr, int Direction) {
+    (void)InstancePtr;
+    (void)Direction;
+    return dma_irq;
+}
+
+
+void XAxiDma_IntrAckIrq(XAxiDma *InstancePtr, u32 Mask, int Direction) {
+    (void)InstancePtr;
+    (void)Direction;
+    hw_enter();
+    dma_irq &= ~Mask;
+    hw_leave();
+}
+
+
+//////////////////////// INTERRUPTS ////////////////////////
+
+
+int XIntc_Initialize(XIntc *InstancePtr, u16 DeviceId) {
+    (void)DeviceId;
+    InstancePtr->IsReady = 1;
+    InstancePtr->IsStarted = 0;
+    return XST_SUCCESS;
+}
+
+
+int XIntc_Start(XIntc *InstancePtr, u8 Mode) {
+    (void)Mode;
+    InstancePtr->IsStarted = 1;
+    return XST_SUCCESS;
+}
+
+
+int XIntc_Connect(XIntc *InstancePtr, u8 Id, XInterruptHandler Handler, void *CallBackRef) {
+    (void)InstancePtr;
+    if (Id == XPAR_INTC_0_AXIDMA_0_MM2S_INTROUT_VEC_ID) {
+        dma_isr = Handler;
+        dma_isr_ref = CallBackRef;
+    } else {
+        isr = Handler;
+        isr_ref = CallBackRef;
+    }
+    return XST_SUCCESS;
+}
+
+
+void XIntc_Enable(XIntc *InstancePtr, u8 Id) {
+    (void)InstancePtr;
+    (void)Id;
+}
+
+
+void XIntc_InterruptHandler(XIntc *InstancePtr) {
+    (void)InstancePtr;
+    if (isr) {
+        isr(isr_ref);
+    }
+}
+
+
+void Xil_ExceptionInit(void) {}
+void Xil_ExceptionRegisterHandler(u32 Id, Xil_ExceptionHandler Handler, void *Data) {
+    (void)Id;
+    (void)Handler;
+    (void)Data;
+}
+void Xil_ExceptionEnable(void) {}
+
+
+void microblaze_register_handler(XInterruptHandler Handler, void *DataPtr) {
+    isr = Handler;
+    isr_ref = DataPtr;
+}
+
+
+void microblaze_disable_interrupts(void) {
+    irq_off = 1;
+}
+
+
+void microblaze_enable_interrupts(void) {
+    irq_off = 0;
+    deliver_irqs();
+}
+
+
+// the timed codec: plays on in real time while the firmware works
+static void codec_timer(int sig) {
+    (void)sig;
+    if (hw_depth || in_irq) {
+        return;
+    }
+    hw_enter();
+    codec_tick();
+    sg_step();
+    fire_scheduled();
+    hw_leave();
+}
+
+
+//////////////////////// MISC BSP ////////////////////////
+
+
+void xil_printf(const char *ctrl1, ...) {
+    va_list args;
+
+    if (!verbose) {
+        return;
+    }
+    va_start(args, ctrl1);
+    vfprintf(stderr, ctrl1, args);
+    va_end(args);
+}
+
+
+void host_usleep(unsigned long useconds) {
+    stats.sleep_us += useconds;
+    if (idle_hook) {
+        idle_hook();
+    }
+}
+
+
+void PWM_Set_Period(u32 baseAddr, u32 clocks) { (void)baseAddr; (void)clocks; }
+void PWM_Set_Duty(u32 baseAddr, u32 clocks, u32 pwmIndex) { (void)baseAddr; (void)clocks; (void)pwmIndex; }
+void PWM_Enable(u32 baseAddr) { (void)baseAddr; }
+
+
+int wolfCrypt_Init(void) { return 0; }
+int wolfCrypt_Cleanup(void) { return 0; }
+
+
+// returns the 6-bit value of a Base64 digit, or -1 if it is not one
+static int b64_val(byte ch) {
+    if (ch >= 'A' && ch <= 'Z') return ch - 'A';
+    if (ch >= 'a' && ch <= 'z') return ch - 'a' + 26;
+    if (ch >= '0' && ch <= '9') return ch - '0' + 52;
+    if (ch == '+') return 62;
+    if (ch == '/') return 63;
+    return -1;
+}
+
+
+/* decodes padded Base64 like wolfCrypt's Base64_Decode
+ * *outLen holds the output capacity on entry and the decoded length on return
+ * returns 0 on success, -1 on malformed input or a short output buffer
+ */
+int Base64_Decode(const byte *in, word32 inLen, byte *out, word32 *outLen) {
+    word32 n = 0;
+
+    if (inLen % 4 != 0) {
+        return -1;
+    }
+    for (word32 i = 0; i < inLen; i += 4) {
+        int v[4];
+        int pads = 0;
+        for (int j = 0; j < 4; j++) {
+            if (in[i + j] == '=' && i + 4 == inLen && j >= 2) {
+                v[j] = 0;
+                pads++;
+            } else if (pads || (v[j] = b64_val(in[i + j])) < 0) {
+                return -1;
+            }
+        }
+        u32 w = (v[0] << 18) | (v[1] << 12) | (v[2] << 6) | v[3];
+        if (n + 3 - pads > *outLen) {
+            return -1;
+        }
+        out[n++] = w >> 16;
+        if (pads < 2) out[n++] = (w >> 8) & 0xff;
+        if (pads < 1) out[n++] = w & 0xff;
+    }
+    *outLen = n;
+    return 0;
+}
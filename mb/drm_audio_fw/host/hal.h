@@ -0,0 +1,79 @@
+/*
+ * Fake MicroBlaze hardware for the host build of the DRM
+ *
+ * The DRM sources are compiled unchanged against the stub BSP headers in
+ * include/. This header exposes the knobs the harness uses to drive that fake
+ * hardware: the shared command channel, the PS->PL interrupt line, and the
+ * DMA/FIFO model feeding the audio codec.
+ */
+
+#ifndef HOST_HAL_H
+#define HOST_HAL_H
+
+#include "xil_types.h"
+#include "constants.h"
+
+// bytes reserved for the shared command channel, matching miPod's cmd_channel
+#define HOST_CHANNEL_SZ (offsetof(cmd_channel, song) + MAX_DRM_FILE_SZ)
+
+// maximum single DMA transfer, as for the 23-bit length register on the board
+#define HOST_DMA_MAX_LEN ((1 << 23) - 1)
+
+// statistics gathered by the fake DMA engine
+typedef struct {
+    u64 transfers;          // accepted XAxiDma_SimpleTransfer calls and BDs started
+    u64 rejected;           // transfers refused because busy or too long
+    u64 bytes;              // bytes handed to the codec
+    u64 busy_polls;         // XAxiDma_Busy or BD ring polls that reported busy
+    u64 sleep_us;           // total time the firmware asked to usleep()
+    u64 dma_irqs;           // DMA interrupts taken by the firmware
+} host_hw_stats;
+
+// allocates the heap-backed shared command channel and points the DRM at it
+volatile cmd_channel *host_channel_init(void);
+void host_channel_free(void);
+
+// resets the DMA/FIFO model and the statistics
+void host_hw_reset(void);
+const host_hw_stats *host_hw_get_stats(void);
+
+/* selects whether the DMA reports scatter-gather support to fnConfigDma()
+ * with it, the firmware plays through the TX BD ring, which the fake engine
+ * walks as the codec drains the FIFO
+ */
+void host_set_dma_sg(int sg);
+
+/* sets how many bytes the codec drains from the FIFO per busy poll
+ * 0 (the default) drains instantly so timings measure only DRM work
+ */
+void host_set_codec_rate(u32 bytes_per_poll);
+
+/* instead has the codec play bytes_per_ms in real time, draining the FIFO from
+ * a timer so the firmware has to keep it fed as it would on the board; the
+ * DMA interrupt is raised from the same timer. 0 turns the timer off
+ */
+void host_set_codec_speed(u32 bytes_per_ms);
+
+/* when non-NULL, every byte sent to the codec is appended to this buffer
+ * (up to cap bytes) so playback output can be compared against a reference
+ */
+void host_capture_audio(u8 *buf, u32 cap);
+u32 host_captured_bytes(void);
+
+// raises the PS->PL interrupt after writing cmd into the command channel
+void host_raise_interrupt(char cmd);
+
+/* queues cmd to be raised once the codec has received at least at_byte bytes
+ * commands fire in the order they were queued
+ */
+int host_schedule_interrupt(u64 at_byte, char cmd);
+
+/* sets a function called whenever the firmware sleeps, so the harness can
+ * play miPod's part meanwhile, such as streaming in the next chunks
+ */
+void host_set_idle_hook(void (*hook)(void));
+
+// enables the firmware's UART output on stderr
+void host_set_verbose(int verbose);
+
+#endif /* HOST_HAL_H */
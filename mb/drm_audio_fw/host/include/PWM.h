@@ -0,0 +1,14 @@
+/*
+ * Host stand-in for the RGB LED PWM driver
+ */
+
+#ifndef PWM_H
+#define PWM_H
+
+#include "xil_types.h"
+
+void PWM_Set_Period(u32 baseAddr, u32 clocks);
+void PWM_Set_Duty(u32 baseAddr, u32 clocks, u32 pwmIndex);
+void PWM_Enable(u32 baseAddr);
+
+#endif // PWM_H
@@ -0,0 +1,15 @@
+/*
+ * Host stand-in for the Xilinx BSP sleep.h
+ * Firmware delays are accounted for in hal.c rather than slept, so they do not
+ * show up in benchmark timings.
+ */
+
+#ifndef SLEEP_H
+#define SLEEP_H
+
+#include "xil_types.h"
+
+void host_usleep(unsigned long useconds);
+#define usleep(us) host_usleep(us)
+
+#endif /* SLEEP_H */
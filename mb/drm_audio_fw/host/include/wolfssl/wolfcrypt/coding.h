@@ -0,0 +1,20 @@
+/*
+ * Host stand-in for the wolfCrypt coding.h
+ * Only the Base64 decoder and library init/cleanup used by the DRM are
+ * provided; see hal.c.
+ */
+
+#ifndef WOLF_CRYPT_CODING_H
+#define WOLF_CRYPT_CODING_H
+
+#include <string.h>
+#include "xil_types.h"
+
+typedef u32 word32;
+typedef u8 byte;
+
+int Base64_Decode(const byte* in, word32 inLen, byte* out, word32* outLen);
+int wolfCrypt_Init(void);
+int wolfCrypt_Cleanup(void);
+
+#endif /* WOLF_CRYPT_CODING_H */
@@ -0,0 +1,117 @@
+/*
+ * Host stand-in for the Xilinx axidma driver
+ * Transfers, simple or through the TX BD ring, are served by the fake DMA
+ * engine in hal.c.
+ */
+
+#ifndef XAXIDMA_H_
+#define XAXIDMA_H_
+
+#include <string.h>
+
+#include "xil_types.h"
+#include "xstatus.h"
+#include "xparameters.h"
+
+#define XAXIDMA_DMA_TO_DEVICE		0x00
+#define XAXIDMA_DEVICE_TO_DMA		0x01
+
+typedef struct {
+	u32 DeviceId;
+	UINTPTR BaseAddr;
+	int HasSg;
+} XAxiDma_Config;
+
+#define XAXIDMA_BD_NUM_WORDS		16U
+#define XAXIDMA_BD_MINIMUM_ALIGNMENT	0x40
+
+#define XAXIDMA_BD_BUFA_OFFSET		0x08
+#define XAXIDMA_BD_BUFA_MSB_OFFSET	0x0C
+#define XAXIDMA_BD_CTRL_LEN_OFFSET	0x18
+#define XAXIDMA_BD_STS_OFFSET		0x1C
+
+#define XAXIDMA_BD_CTRL_TXSOF_MASK	0x08000000
+#define XAXIDMA_BD_CTRL_TXEOF_MASK	0x04000000
+#define XAXIDMA_BD_CTRL_ALL_MASK	0x0C000000
+#define XAXIDMA_BD_STS_COMPLETE_MASK	0x80000000
+#define XAXIDMA_BD_STS_DMA_INT_ERR_MASK	0x10000000
+
+#define XAXIDMA_IRQ_IOC_MASK		0x00001000
+#define XAXIDMA_IRQ_DELAY_MASK		0x00002000
+#define XAXIDMA_IRQ_ERROR_MASK		0x00004000
+#define XAXIDMA_IRQ_ALL_MASK		0x00007000
+
+#define AXIDMA_CHANNEL_NOT_HALTED	1
+#define AXIDMA_CHANNEL_HALTED		2
+#define XAXIDMA_ALL_BDS			0x0FFFFFFF
+
+typedef u32 XAxiDma_Bd[XAXIDMA_BD_NUM_WORDS];
+
+/* the TX BD ring, with the fields of the real driver the firmware uses
+ * BDs move from the free group to pre-work, work (handed to the engine) and
+ * post-work (completed) and back to free, in ring order
+ */
+typedef struct {
+	volatile int RunState;
+	u32 MaxTransferLen;
+	UINTPTR FirstBdAddr;
+	u32 Separation;
+	XAxiDma_Bd *FreeHead;
+	XAxiDma_Bd *PreHead;
+	XAxiDma_Bd *HwHead;
+	XAxiDma_Bd *PostHead;
+	int FreeCnt;
+	int PreCnt;
+	int HwCnt;
+	int PostCnt;
+	int AllCnt;
+} XAxiDma_BdRing;
+
+typedef struct {
+	UINTPTR RegBase;
+	int HasSg;
+	int Initialized;
+	XAxiDma_BdRing TxBdRing;
+} XAxiDma;
+
+#define XAxiDma_HasSg(InstancePtr)	((InstancePtr)->HasSg) ? TRUE : FALSE
+#define XAxiDma_GetTxRing(InstancePtr)	(&((InstancePtr)->TxBdRing))
+
+#define XAxiDma_BdRead(BaseAddress, Offset)		(((u32 *)(BaseAddress))[(Offset) / 4])
+#define XAxiDma_BdWrite(BaseAddress, Offset, Data)	(((u32 *)(BaseAddress))[(Offset) / 4] = (Data))
+#define XAxiDma_BdClear(BdPtr)				memset((void *)(BdPtr), 0, sizeof(XAxiDma_Bd))
+#define XAxiDma_BdGetSts(BdPtr)				XAxiDma_BdRead((BdPtr), XAXIDMA_BD_STS_OFFSET)
+#define XAxiDma_BdRingGetCnt(RingPtr)			((RingPtr)->AllCnt)
+#define XAxiDma_BdRingGetFreeCnt(RingPtr)		((RingPtr)->FreeCnt)
+
+XAxiDma_Config *XAxiDma_LookupConfig(u32 DeviceId);
+int XAxiDma_CfgInitialize(XAxiDma * InstancePtr, XAxiDma_Config *Config);
+u32 XAxiDma_Busy(XAxiDma *InstancePtr,int Direction);
+u32 XAxiDma_SimpleTransfer(XAxiDma *InstancePtr, UINTPTR BuffAddr, u32 Length,
+	int Direction);
+
+u32 XAxiDma_BdRingCreate(XAxiDma_BdRing * RingPtr, UINTPTR PhysAddr,
+		UINTPTR VirtAddr, u32 Alignment, int BdCount);
+int XAxiDma_BdRingClone(XAxiDma_BdRing * RingPtr, XAxiDma_Bd * SrcBdPtr);
+int XAxiDma_BdRingAlloc(XAxiDma_BdRing * RingPtr, int NumBd,
+		XAxiDma_Bd ** BdSetPtr);
+int XAxiDma_BdRingUnAlloc(XAxiDma_BdRing * RingPtr, int NumBd,
+		XAxiDma_Bd * BdSetPtr);
+int XAxiDma_BdRingToHw(XAxiDma_BdRing * RingPtr, int NumBd,
+		XAxiDma_Bd * BdSetPtr);
+int XAxiDma_BdRingFromHw(XAxiDma_BdRing * RingPtr, int BdLimit,
+		XAxiDma_Bd ** BdSetPtr);
+int XAxiDma_BdRingFree(XAxiDma_BdRing * RingPtr, int NumBd,
+		XAxiDma_Bd * BdSetPtr);
+int XAxiDma_BdRingStart(XAxiDma_BdRing * RingPtr);
+
+int XAxiDma_BdSetLength(XAxiDma_Bd* BdPtr, u32 LenBytes, u32 LengthMask);
+u32 XAxiDma_BdSetBufAddr(XAxiDma_Bd* BdPtr, UINTPTR Addr);
+void XAxiDma_BdSetCtrl(XAxiDma_Bd *BdPtr, u32 Data);
+
+void XAxiDma_IntrEnable(XAxiDma *InstancePtr, u32 Mask, int Direction);
+void XAxiDma_IntrDisable(XAxiDma *InstancePtr, u32 Mask, int Direction);
+u32 XAxiDma_IntrGetIrq(XAxiDma *InstancePtr, int Direction);
+void XAxiDma_IntrAckIrq(XAxiDma *InstancePtr, u32 Mask, int Direction);
+
+#endif /* XAXIDMA_H_ */
@@ -0,0 +1,11 @@
+/*
+ * Host stand-in for the Xilinx BSP xil_cache.h
+ * The host has coherent caches, so there is nothing to enable or flush.
+ */
+
+#ifndef XIL_CACHE_H
+#define XIL_CACHE_H
+
+#include "xil_types.h"
+
+#endif /* XIL_CACHE_H */
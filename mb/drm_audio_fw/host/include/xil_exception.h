@@ -0,0 +1,23 @@
+/*
+ * Host stand-in for the Xilinx BSP xil_exception.h
+ */
+
+#ifndef XIL_EXCEPTION_H
+#define XIL_EXCEPTION_H
+
+#include "xil_types.h"
+
+#define XIL_EXCEPTION_ID_INT		      16U
+
+typedef void (*Xil_ExceptionHandler)(void *Data);
+
+void Xil_ExceptionInit(void);
+void Xil_ExceptionRegisterHandler(u32 Id, Xil_ExceptionHandler Handler,
+				  void *Data);
+void Xil_ExceptionEnable(void);
+
+void microblaze_register_handler(XInterruptHandler Handler, void *DataPtr);
+void microblaze_disable_interrupts(void);
+void microblaze_enable_interrupts(void);
+
+#endif /* XIL_EXCEPTION_H */
@@ -0,0 +1,13 @@
+/*
+ * Host stand-in for the Xilinx BSP xil_mem.h
+ */
+
+#ifndef XIL_MEM_H
+#define XIL_MEM_H
+
+#include <string.h>
+#include "xil_types.h"
+
+#define Xil_MemCpy(dst, src, cnt) ((void)memcpy((dst), (src), (cnt)))
+
+#endif /* XIL_MEM_H */
@@ -0,0 +1,14 @@
+/*
+ * Host stand-in for the Xilinx BSP xil_printf.h
+ * Output goes to stderr and is dropped unless the harness enables it, so that
+ * the UART chatter does not dominate benchmark timings.
+ */
+
+#ifndef XIL_PRINTF_H
+#define XIL_PRINTF_H
+
+#include "xil_types.h"
+
+void xil_printf(const char *ctrl1, ...);
+
+#endif /* XIL_PRINTF_H */
@@ -0,0 +1,29 @@
+/*
+ * Host stand-in for the Xilinx BSP xil_types.h
+ * Only the types and constants used by the DRM sources are provided.
+ */
+
+#ifndef XIL_TYPES_H
+#define XIL_TYPES_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef TRUE
+#  define TRUE		1U
+#endif
+
+#ifndef FALSE
+#  define FALSE		0U
+#endif
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef uintptr_t UINTPTR;
+
+typedef void (*XInterruptHandler) (void *InstancePtr);
+
+#endif /* XIL_TYPES_H */
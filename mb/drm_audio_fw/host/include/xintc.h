@@ -0,0 +1,29 @@
+/*
+ * Host stand-in for the Xilinx intc driver
+ * The fake interrupt line in hal.c calls whatever handler was connected.
+ */
+
+#ifndef XINTC_H
+#define XINTC_H
+
+#include "xil_types.h"
+#include "xstatus.h"
+#include "xil_exception.h"
+#include "xparameters.h"
+
+#define XIN_SIMULATION_MODE     0
+#define XIN_REAL_MODE           1
+
+typedef struct {
+	u32 IsReady;
+	u32 IsStarted;
+} XIntc;
+
+int XIntc_Initialize(XIntc * InstancePtr, u16 DeviceId);
+int XIntc_Start(XIntc * InstancePtr, u8 Mode);
+int XIntc_Connect(XIntc * InstancePtr, u8 Id,
+		  XInterruptHandler Handler, void *CallBackRef);
+void XIntc_Enable(XIntc * InstancePtr, u8 Id);
+void XIntc_InterruptHandler(XIntc * InstancePtr);
+
+#endif /* XINTC_H */
@@ -0,0 +1,26 @@
+/*
+ * Host stand-in for the generated xparameters.h
+ * Peripheral base addresses point into host memory owned by the fake hardware
+ * in hal.c instead of the MicroBlaze address map.
+ */
+
+#ifndef XPARAMETERS_H
+#define XPARAMETERS_H
+
+#include "xil_types.h"
+
+extern u8 host_dma_bram[];
+extern volatile u32 host_fifo_fill;
+
+#define XPAR_INTC_0_DEVICE_ID 0
+#define XPAR_AXIDMA_0_DEVICE_ID 0
+#define XPAR_AXIDMA_0_INCLUDE_SG 0
+// the host DMA interrupt is routed, unlike on the board
+#define XPAR_INTC_0_AXIDMA_0_MM2S_INTROUT_VEC_ID 1
+
+#define XPAR_RGB_PWM_0_PWM_AXI_BASEADDR 0
+#define XPAR_MB_DMA_AXI_BRAM_CTRL_0_S_AXI_BASEADDR ((UINTPTR)host_dma_bram)
+#define XPAR_MB_DMA_AXI_BRAM_CTRL_0_S_AXI_HIGHADDR (XPAR_MB_DMA_AXI_BRAM_CTRL_0_S_AXI_BASEADDR + 0x7FFF)
+#define XPAR_FIFO_COUNT_AXI_GPIO_0_BASEADDR ((UINTPTR)&host_fifo_fill)
+
+#endif /* XPARAMETERS_H */
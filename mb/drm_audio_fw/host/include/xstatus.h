@@ -0,0 +1,16 @@
+/*
+ * Host stand-in for the Xilinx BSP xstatus.h
+ */
+
+#ifndef XSTATUS_H
+#define XSTATUS_H
+
+#include "xil_types.h"
+
+#define XST_SUCCESS                     0L
+#define XST_FAILURE                     1L
+#define XST_INVALID_PARAM               15L
+
+typedef s32 XStatus;
+
+#endif /* XSTATUS_H */
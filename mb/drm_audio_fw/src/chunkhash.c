@@ -0,0 +1,222 @@
+/*
+ * Keyed Blake3 of an audio chunk, specialised for the chunk verification
+ *
+ * The firmware hashes each chunk as it streams the ciphertext through in
+ * whole blocks, and always ends with the 16-byte song IV. So every block of
+ * the chunk itself is known not to be the last one when it arrives, and is
+ * compressed straight from the caller's buffer; only the tail is held back.
+ * Inputs are at most CHUNK_HASH_MAX_SZ, so the Blake3 tree needs a handful of
+ * subtree chaining values rather than the 1.7 KB CV stack of blake3_hasher.
+ */
+
+// optimized under the -O0 Debug configuration, for the reason given in speck.c
+#pragma GCC optimize ("O2")
+
+#include <string.h>
+#include "chunkhash.h"
+
+
+// Blake3 domain flags
+#define CHUNK_START 1
+#define CHUNK_END 2
+#define PARENT 4
+#define ROOT 8
+#define KEYED_HASH 16
+
+static const u32 IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+#define ROTR32(x,r) (((x)>>(r)) | ((x)<<(32-(r))))
+
+#define LOAD32(p) ((u32)(p)[0] | (u32)(p)[1] << 8 | (u32)(p)[2] << 16 | (u32)(p)[3] << 24)
+
+// the quarter-round on 32-bit words, which the MicroBlaze runs natively
+#define G(a,b,c,d,x,y) do {                                 \
+        a += b + (x); d = ROTR32(d ^ a, 16);                \
+        c += d;       b = ROTR32(b ^ c, 12);                \
+        a += b + (y); d = ROTR32(d ^ a, 8);                 \
+        c += d;       b = ROTR32(b ^ c, 7);                 \
+    } while (0)
+
+// one round, taking the message words in the order of message permutation r
+#define ROUND(m0,m1,m2,m3,m4,m5,m6,m7,m8,m9,m10,m11,m12,m13,m14,m15) do {   \
+        G(v0, v4, v8,  v12, m[m0],  m[m1]);                                 \
+        G(v1, v5, v9,  v13, m[m2],  m[m3]);                                 \
+        G(v2, v6, v10, v14, m[m4],  m[m5]);                                 \
+        G(v3, v7, v11, v15, m[m6],  m[m7]);                                 \
+        G(v0, v5, v10, v15, m[m8],  m[m9]);                                 \
+        G(v1, v6, v11, v12, m[m10], m[m11]);                                \
+        G(v2, v7, v8,  v13, m[m12], m[m13]);                                \
+        G(v3, v4, v9,  v14, m[m14], m[m15]);                                \
+    } while (0)
+
+
+/* Blake3 compression of one block into a new chaining value, with all seven
+ * rounds unrolled and the state in locals
+ *
+ * cv       : chaining value to compress into, may be the same as out
+ * block    : the block, zero padded to CHUNK_HASH_BLOCK_LEN
+ * len      : bytes of the block that are input
+ * counter  : Blake3 chunk number, or 0 for parents
+ * flags    : Blake3 domain flags
+ * out      : buffer to store the new chaining value
+ */
+static void compress(const u32 cv[8], const u8 *block, u32 len, u32 counter, u32 flags, u32 out[8]) {
+    u32 m[16];
+    for (int i = 0; i < 16; i++) {
+        m[i] = LOAD32(block + 4 * i);
+    }
+    u32 v0 = cv[0], v1 = cv[1], v2 = cv[2], v3 = cv[3];
+    u32 v4 = cv[4], v5 = cv[5], v6 = cv[6], v7 = cv[7];
+    u32 v8 = IV[0], v9 = IV[1], v10 = IV[2], v11 = IV[3];
+    u32 v12 = counter, v13 = 0, v14 = len, v15 = flags;
+
+    ROUND(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    ROUND(2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8);
+    ROUND(3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1);
+    ROUND(10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6);
+    ROUND(12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4);
+    ROUND(9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7);
+    ROUND(11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13);
+
+    out[0] = v0 ^ v8;  out[1] = v1 ^ v9;  out[2] = v2 ^ v10; out[3] = v3 ^ v11;
+    out[4] = v4 ^ v12; out[5] = v5 ^ v13; out[6] = v6 ^ v14; out[7] = v7 ^ v15;
+}
+
+
+// compresses the parent node of two chaining values into out
+static void parent_cv(const chunk_hasher *h, const u32 left[8], const u32 right[8], u32 flags, u32 out[8]) {
+    u8 block[CHUNK_HASH_BLOCK_LEN];
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 4; j++) {
+            block[4 * i + j] = left[i] >> (8 * j);
+            block[32 + 4 * i + j] = right[i] >> (8 * j);
+        }
+    }
+    compress(h->key, block, CHUNK_HASH_BLOCK_LEN, 0, KEYED_HASH | PARENT | flags, out);
+}
+
+
+/* compresses a full block that more input is known to follow, and when it
+ * ends a Blake3 chunk, merges the chunk into the finished subtrees the way
+ * the Blake3 reference does: one merge per trailing zero bit of the number of
+ * chunks finished
+ */
+static void compress_block(chunk_hasher *h, const u8 *block) {
+    u32 flags = KEYED_HASH;
+    if (h->blocks == 0) {
+        flags |= CHUNK_START;
+    }
+    if (h->blocks == CHUNK_HASH_CHUNK_LEN / CHUNK_HASH_BLOCK_LEN - 1) {
+        flags |= CHUNK_END;
+    }
+    compress(h->cv, block, CHUNK_HASH_BLOCK_LEN, h->chunks, flags, h->cv);
+    if (!(flags & CHUNK_END)) {
+        h->blocks++;
+        return;
+    }
+
+    u32 total = ++h->chunks;
+    while (!(total & 1)) {
+        h->ncvs--;
+        parent_cv(h, h->cvs[h->ncvs], h->cv, 0, h->cv);
+        total >>= 1;
+    }
+    memcpy(h->cvs[h->ncvs++], h->cv, sizeof(h->cv));
+    memcpy(h->cv, h->key, sizeof(h->cv));
+    h->blocks = 0;
+}
+
+
+/* starts a keyed Blake3 hash
+ *
+ * key      : Blake3 key as little-endian words, as in blake3_hasher
+ */
+void chunk_hash_start(chunk_hasher *h, const u32 key[8]) {
+    memcpy(h->key, key, sizeof(h->key));
+    memcpy(h->cv, key, sizeof(h->cv));
+    h->ncvs = 0;
+    h->chunks = 0;
+    h->blocks = 0;
+    h->len = 0;
+    h->buf_len = 0;
+}
+
+
+/* adds input that more input will follow, at least the final tail, so every
+ * full block is compressed as soon as it is there. whole blocks arriving with
+ * nothing held back are compressed in place, without a copy
+ */
+void chunk_hash_update(chunk_hasher *h, const void *in, u32 len) {
+    const u8 *p = in;
+    if (h->len > CHUNK_HASH_MAX_SZ || len > CHUNK_HASH_MAX_SZ - h->len) {
+        h->len = CHUNK_HASH_MAX_SZ + 1;
+        return;
+    }
+    h->len += len;
+
+    if (h->buf_len) {
+        u32 n = CHUNK_HASH_BLOCK_LEN - h->buf_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(h->buf + h->buf_len, p, n);
+        h->buf_len += n;
+        p += n;
+        len -= n;
+        if (h->buf_len < CHUNK_HASH_BLOCK_LEN) {
+            return;
+        }
+        compress_block(h, h->buf);
+        h->buf_len = 0;
+    }
+    for (; len >= CHUNK_HASH_BLOCK_LEN; p += CHUNK_HASH_BLOCK_LEN, len -= CHUNK_HASH_BLOCK_LEN) {
+        compress_block(h, p);
+    }
+    memcpy(h->buf, p, len);
+    h->buf_len = len;
+}
+
+
+/* adds the last of the input and finishes the hash
+ * returns 0 on success, -1 if the input was longer than CHUNK_HASH_MAX_SZ or
+ * there was input before an empty tail
+ *
+ * tail     : the end of the input, which must not be empty after updates
+ * len      : its length in bytes
+ * out      : buffer to store the hash
+ */
+int chunk_hash_final(chunk_hasher *h, const void *tail, u32 len, u8 out[CHUNK_HASH_OUT_LEN]) {
+    const u8 *p = tail;
+    if (h->len > CHUNK_HASH_MAX_SZ || len > CHUNK_HASH_MAX_SZ - h->len ||
+        (len == 0 && h->len != 0)) {
+        return -1;
+    }
+
+    // the input up to the last block, which may be full, goes through
+    // chunk_hash_update() as more input then follows
+    u32 last = (h->buf_len + len) % CHUNK_HASH_BLOCK_LEN;
+    if (last == 0 && len != 0) {
+        last = CHUNK_HASH_BLOCK_LEN;
+    }
+    u32 n = (len > last) ? len - last : 0;
+    chunk_hash_update(h, p, n);
+    memcpy(h->buf + h->buf_len, p + n, len - n);
+    memset(h->buf + last, 0, CHUNK_HASH_BLOCK_LEN - last);
+
+    u32 cv[8];
+    u32 flags = KEYED_HASH | CHUNK_END | (h->blocks == 0 ? CHUNK_START : 0);
+    compress(h->cv, h->buf, last, h->chunks, flags | (h->ncvs == 0 ? ROOT : 0), cv);
+    while (h->ncvs > 0) {
+        h->ncvs--;
+        parent_cv(h, h->cvs[h->ncvs], cv, h->ncvs == 0 ? ROOT : 0, cv);
+    }
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 4; j++) {
+            out[4 * i + j] = cv[i] >> (8 * j);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef CHUNKHASH_H
+#define CHUNKHASH_H
+
+#include "xil_types.h"
+
+// Blake3 sizes
+#define CHUNK_HASH_BLOCK_LEN 64
+#define CHUNK_HASH_CHUNK_LEN 1024
+#define CHUNK_HASH_OUT_LEN 32
+
+// longest input a chunk_hasher takes: an audio chunk of at most 16 KB and its
+// IV, rounded up to a power of two of Blake3 chunks. the Blake3 tree over that
+// many chunks is CHUNK_HASH_DEPTH subtrees deep at most
+#define CHUNK_HASH_MAX_SZ (32 * CHUNK_HASH_CHUNK_LEN)
+#define CHUNK_HASH_DEPTH 5
+
+// keyed Blake3 of one audio chunk, without the general hasher's CV stack
+typedef struct {
+    u32 key[8];
+    u32 cv[8];                      // chaining value of the Blake3 chunk being hashed
+    u32 cvs[CHUNK_HASH_DEPTH][8];   // chaining values of the finished subtrees
+    u32 ncvs;
+    u32 chunks;                     // Blake3 chunks finished
+    u32 blocks;                     // blocks compressed in the current Blake3 chunk
+    u32 len;                        // bytes taken in so far
+    u8 buf[CHUNK_HASH_BLOCK_LEN];   // the partial block after them
+    u32 buf_len;
+} chunk_hasher;
+
+void chunk_hash_start(chunk_hasher *h, const u32 key[8]);
+void chunk_hash_update(chunk_hasher *h, const void *in, u32 len);
+int chunk_hash_final(chunk_hasher *h, const void *tail, u32 len, u8 out[CHUNK_HASH_OUT_LEN]);
+
+#endif
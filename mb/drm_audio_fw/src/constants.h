@@ -1,14 +1,23 @@
 #ifndef SRC_CONSTANTS_H_
 #define SRC_CONSTANTS_H_
 
+#include <stddef.h>
 #include "xil_printf.h"
+#include "blake3.h"
 
 // shared DDR address
 #define SHARED_DDR_BASE (0x20000000 + 0x1CC00000)
 
 // memory constants
-#define CHUNK_SZ 16000
+#define CHUNK_SZ 16000                          // v1 chunk size
+#define MIN_CHUNK_SHIFT 10                      // v2 chunks are 1KB to 16KB
+#define MAX_CHUNK_SHIFT 14
+#define MAX_CHUNK_SZ (1 << MAX_CHUNK_SHIFT)     // one half of the DMA BRAM
 #define FIFO_CAP 4096*4
+#define FIFO_LOW_WATER (FIFO_CAP / 4)           // FIFO fill below which the DMA needs more audio
+#define FIFO_POLL_SZ 1024                       // bytes decrypted between FIFO checks, without the DMA interrupt
+#define DMA_BRAM_SZ 0x8000                      // mb_dma_axi_bram in lscript.ld
+#define DMA_NUM_SLOTS 3                         // most chunks queued in the DMA BRAM, and SG descriptors
 
 // number of seconds to record/playback
 #define PREVIEW_TIME_SEC 30
@@ -33,6 +42,11 @@
 #define MAX_SONG_SZ (1<<25)
 #define MD_SZ 100
 
+// bitmaps with a bit for each of the 256 possible uids or rids
+#define ID_MAP_WORDS (256 / 32)
+#define id_map_set(m, id) ((m)[(u8)(id) >> 5] |= 1u << ((u8)(id) & 31))
+#define id_map_has(m, id) (((m)[(u8)(id) >> 5] >> ((u8)(id) & 31)) & 1)
+
 
 // LED colors and controller
 struct color {
@@ -115,8 +129,97 @@ end
 
 MAX DRM FILE SIZE = 
    32 MB song --> (44 + 32 + 16 + 4 + 4 + 100 + 33,554,432 + (2098 * 32)) = 33621768
+
+
+===================================
+DRM SONG FILE FORMAT v2
+===================================
+v2 keeps everything up to the metadata, and puts the format version in the top
+byte of the chunk count (0 for the layout above). A drm_ext follows the
+metadata and is covered by the metadata hash along with it. It gives the chunk
+size, a power of two no larger than one DMA BRAM half, and where the chunk
+hash table and the audio start, so any chunk and its hash are found with one
+shift and add. The table comes before the audio, so a streaming reader can
+check chunk 0 without reading to the end of the file. The chunk hashes
+themselves are unchanged.
+
+start
+ ____________________________
+| WAV header .. metadata     |
+| (200 bytes, as for v1)     | ---> numChunks = 2 << 24 | chunks
+|____________________________|
+| v2 extension header        | ---> struct drm_ext
+| (12 bytes)                 |
+|____________________________|
+| chunk hash table           | ---> at table_off
+| (32 bytes per chunk)       |
+|____________________________|
+| (zeros, to a 64-byte line) |
+|____________________________|
+| encrypted [audio+padding]  | ---> at audio_off, chunk i at
+| in 1 << chunk_shift chunks |      audio_off + (i << chunk_shift)
+|____________________________|
+end
+
+MAX DRM FILE SIZE = 
+   32 MB song --> (212 + 2049 * 32 + 12 + 33,554,448) = 33620240
+
+
+With DRM_EXT_MERKLE set in the flags, the drm_ext also carries the root of a
+Merkle tree over the chunk hashes, so the metadata hash covers every chunk
+hash through it. The table then holds the whole tree, a level at a time from
+the chunk hashes up to the root:
+
+   level 0      : the nchunks chunk hashes, as above
+   level k + 1  : ceil(n_k / 2) nodes, node j = keyed Blake3 with the chunk
+                  key of [0x01 + node 2j + node 2j+1] from level k, or node 2j
+                  itself if it has no partner
+   last level   : the root alone
+
+Interior nodes hash 65 bytes and chunk hashes a multiple of 16, so one can
+never pass for the other. Any chunk is checked against the root with one
+sibling per level, at most MERKLE_MAX_DEPTH of them, without reading the rest
+of the table.
+
+MAX DRM FILE SIZE = 
+   32 MB song --> (244 + 4108 * 32 + 12 + 33,554,448) = 33686160
+
+
+With DRM_EXT_CHUNK_IV set in the flags, with or without DRM_EXT_MERKLE, the
+CBC chain restarts at every chunk rather than running on from the last
+ciphertext block of the chunk before. Chunk i is encrypted from
+
+   IV_i = first 16 bytes of Blake3 [song IV + i as a 32-bit little-endian]
+
+so any chunk decrypts on its own. The chunk hashes are unchanged, still over
+[chunk + song IV].
 */
 
+#define MAX_DRM_FILE_SZ 33686160
+
+// format versions, kept in the top byte of numChunks
+#define DRM_V1 0
+#define DRM_V2 2
+#define drm_version(n) ((u32)(n) >> 24)
+#define drm_nchunks(n) ((u32)(n) & 0xffffff)
+
+// drm_ext flags
+#define DRM_EXT_MERKLE 0x01     // the table is a Merkle tree, with its root in the drm_ext
+#define DRM_EXT_CHUNK_IV 0x02   // every chunk is encrypted from its own derived IV
+#define MERKLE_MAX_DEPTH 16     // levels above the chunk hashes, for up to 64K chunks
+
+// v2 extension header
+typedef struct __attribute__((__packed__)) {
+    u8 chunk_shift;         // log2 of the chunk size
+    u8 flags;               // DRM_EXT_ flags
+    u16 ext_sz;             // DRM_EXT_SZ, or sizeof(drm_ext) with DRM_EXT_MERKLE
+    u32 table_off;          // file offset of the chunk hash table
+    u32 audio_off;          // file offset of the first encrypted chunk
+    char root[32];          // Merkle root, with DRM_EXT_MERKLE only
+} drm_ext;
+
+#define DRM_EXT_SZ 12       // drm_ext without the root
+
 // struct to interpret shared buffer as a drm song file
 // packing values skip over non-relevant WAV metadata
 typedef struct __attribute__((__packed__)) {
@@ -131,14 +234,58 @@ typedef struct __attribute__((__packed__)) {
     int numChunks;          // number of encrypted audio chunks
     int encAudioLen;        // length of encrypted audio
     drm_md md;              // song metadata
+    drm_ext ext;            // v2 only, audio for v1
 } song;
 
 
 // accessors for variable-length file fields
 #define get_drm_rids(d) (d.md.buf)
 #define get_drm_uids(d) (d.md.buf + d.md.num_regions)
-#define get_drm_song(d) ((char *)(&d.md) + MD_SZ)
-#define get_drm_hash(d, i) (get_drm_song(d) + d.encAudioLen + (i*32))
+
+// accessors for a chunk and its hash, from the layout verify_song() checked
+#define get_layout_chunk(d, l, i) ((char *)&d + (l).audio_off + (i) * (l).chunk_sz)
+#define get_layout_hash(d, l, i) ((char *)&d + (l).table_off + (i) * 32)
+
+
+/* playback streams the song instead of loading all of it: miPod loads the
+ * header and metadata above, then keeps a ring of chunk slots after them filled
+ * with the chunks the DRM will play next. The DRM takes the slot at tail once
+ * miPod has moved head past it, and asks for a different chunk after a seek by
+ * setting want and bumping seek. Slots loaded before miPod saw a seek are
+ * recognized by their chunk number and dropped
+ */
+#define STREAM_SLOTS 16
+
+typedef struct __attribute__((__packed__)) {
+    u32 chunk;              // number of the chunk in this slot
+    char hash[32];          // chunk hash from the table, without DRM_EXT_MERKLE
+    char path[MERKLE_MAX_DEPTH][32]; // with DRM_EXT_MERKLE, the sibling of the
+                            // chunk's node at each level, where it has one
+    char data[MAX_CHUNK_SZ];// encrypted chunk
+} stream_slot;
+
+typedef struct __attribute__((__packed__)) {
+    song song;              // header and metadata, as at the start of the file
+    u32 head;               // slots filled, written by miPod
+    u32 tail;               // slots consumed, written by the DRM
+    u32 want;               // chunk to continue from after a seek, written by the DRM
+    u32 seek;               // seeks requested, written by the DRM
+    stream_slot slots[STREAM_SLOTS];
+} stream;
+
+
+/* digital_out leaves the decrypted audio where the song's chunks were, rather
+ * than moving it up to the WAV header, and says where that is: miPod writes the
+ * header, with the sizes filled in, and then wav_size bytes from wav_off
+ * meanwhile, dout_chunks in the command channel counts the chunks released so
+ * far, all of them whole but the last, so miPod can write them out as it goes
+ */
+#define WAV_HEADER_SZ 44
+
+typedef struct __attribute__((__packed__)) {
+    char header[WAV_HEADER_SZ]; // the song's WAV header
+    u32 wav_off;            // offset of the audio from the start of the song
+} dout_song;
 
 
 // shared buffer values
@@ -150,13 +297,17 @@ enum states   { STOPPED, WORKING, PLAYING, PAUSED };
 typedef volatile struct __attribute__((__packed__)) {
     char cmd;                   // from commands enum
     char drm_state;             // from states enum
-    char padding[2];            // unused
+    u16 dout_chunks;            // chunks digital_out has released so far
+    u32 done;                   // commands finished since boot, counted once STOPPED again
     char username[USERNAME_SZ]; // stores logged in or attempted username
     char pin[MAX_PIN_SZ];       // stores logged in or attempted pin
 
-    // shared buffer is either a drm song or a query
+    // shared buffer is either a drm song, a song being streamed, a song
+    // dumped by digital_out, or a query
     union {
         song song;
+        stream stream;
+        dout_song dout;
         query query;
     };
 } cmd_channel;
@@ -170,9 +321,79 @@ typedef struct {
     u8 rids[MAX_REGIONS];
     u8 num_users;
     u8 uids[MAX_USERS];
+    u32 rid_map[ID_MAP_WORDS];      // rids as a bitmap, from load_song_md()
+    u32 uid_map[ID_MAP_WORDS];      // uids shared with, as a bitmap
 } song_md;
 
 
+// where the parts of the current song are, taken from its verified header
+typedef struct {
+    u32 version;
+    u32 nchunks;
+    u32 enc_len;                    // encrypted audio length, with padding
+    u32 chunk_sz;
+    u32 chunk_shift;                // log2 of chunk_sz for v2, 0 for v1
+    u32 table_off;                  // file offset of the chunk hash table
+    u32 audio_off;                  // file offset of the first chunk
+    u32 md_hashed_sz;               // bytes the metadata hash covers, from the IV on
+    u32 flags;                      // DRM_EXT_ flags
+    u32 depth;                      // Merkle tree levels above the chunk hashes
+    char root[32];                  // Merkle root, with DRM_EXT_MERKLE
+} song_layout;
+
+
+// where playback resumes after a seek, from seek_locate()
+// chunk 0 chains from the song IV, any other from the last ciphertext block of
+// the chunk before it, which is verified first unless DRM_EXT_CHUNK_IV is set
+typedef struct {
+    u32 pos;                        // offset into the audio, on a sample boundary
+    u32 chunk;                      // chunk holding pos
+    u32 offset;                     // offset of pos into that chunk
+} seek_point;
+
+
+// decrypted chunks waiting in the DMA BRAM slots for the DMA: the playback
+// loop decrypts into a slot and bumps filled, and audio_pump() hands filled
+// slots to the DMA in order, from the DMA interrupt where the PL routes it
+typedef struct {
+    u32 slots;                      // slots of slot_sz the current song's chunks take
+    u32 slot_sz;
+    u32 len[DMA_NUM_SLOTS];         // bytes to play from each slot
+    volatile u32 filled;            // slots filled by the playback loop
+    volatile u32 issued;            // slots handed to the DMA
+    volatile u32 done;              // slots the DMA has finished with
+    volatile char running;          // whether audio has played without a break
+    volatile char error;            // whether the DMA refused a slot
+    volatile u32 underruns;         // times the FIFO ran dry before the next slot
+    volatile u32 low_water;         // times it was below FIFO_LOW_WATER instead
+} play_queue;
+
+
+// the part of a blake3_hasher before its CV stack, laid out the same. The
+// stack is only read below cv_stack_len and only pushed to once more than
+// BLAKE3_CHUNK_LEN bytes go in, so this is enough for a keyed template, or
+// to hash short inputs
+typedef struct {
+    uint32_t key[8];
+    blake3_chunk_state chunk;
+    uint8_t cv_stack_len;
+} hasher_head;
+
+// the prebuilt libblake3 must lay its hasher out the same, as hasher_head is
+// passed to it cast to a blake3_hasher
+_Static_assert(offsetof(hasher_head, key) == offsetof(blake3_hasher, key), "blake3_hasher layout");
+_Static_assert(offsetof(hasher_head, chunk) == offsetof(blake3_hasher, chunk), "blake3_hasher layout");
+_Static_assert(offsetof(hasher_head, cv_stack_len) == offsetof(blake3_hasher, cv_stack_len),
+               "blake3_hasher layout");
+
+
+// a Merkle tree node already checked against the root of the current song
+typedef struct {
+    u32 index;                      // position in its level, or -1 for none
+    char hash[32];
+} merkle_node;
+
+
 // store of internal state
 typedef struct {
     char logged_in;                 // whether or not a user is logged on
@@ -180,10 +401,17 @@ typedef struct {
     char username[USERNAME_SZ];     // logged on username
     char pin[MAX_PIN_SZ];           // logged on pin
     song_md song_md;                // current song metadata
+    song_layout layout;             // current song layout
+    merkle_node merkle[MERKLE_MAX_DEPTH]; // last verified node on each level
+                                    // below the root, kept across seeks
+    char merkleSong[32];            // metadata hash of the song they belong to
     char speckKey[64];              // base64 decoded Speck key
     char mdKey[64];                 // base64 decoded metadata key
     char chunkKey[64];              // base64 decoded encrypted audio chunk key
     u64 rk[64];                     // round keys for Speck
+    hasher_head mdHasher;           // keyed Blake3 hashers, ready to start from
+    hasher_head chunkHasher;
+    u32 rid_map[ID_MAP_WORDS];      // provisioned rids as a bitmap
 } internal_state;
 
 
@@ -4,6 +4,7 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
 #include "platform.h"
 #include "xparameters.h"
 #include "xil_exception.h"
@@ -17,13 +18,21 @@
 #include "sleep.h"
 #include "wolfssl/wolfcrypt/coding.h"
 #include "blake3.h"
+#include "speck.h"
+#include "chunkhash.h"
 
 
 //////////////////////// GLOBALS ////////////////////////
 
 
-// audio DMA access
-static XAxiDma sAxiDma;
+// audio DMA access, set up by fnConfigDma()
+XAxiDma sAxiDma;
+// whether the DMA interrupts when it finishes a buffer, set up by fnConfigDmaIntr()
+char dma_intr = FALSE;
+// chunks on their way to the DMA
+play_queue pq;
+// codec FIFO fill count
+volatile u32 *fifo_fill = (u32*) XPAR_FIFO_COUNT_AXI_GPIO_0_BASEADDR;
 
 // LED colors and controller
 u32 *led = (u32*) XPAR_RGB_PWM_0_PWM_AXI_BASEADDR;
@@ -57,73 +66,154 @@ void myISR(void) {
     InterruptProcessed = TRUE;
 }
 
-//////////////////////// SPECK ////////////////////////
+//////////////////////// PLAYBACK SCHEDULER ////////////////////////
 
 
-#define ROTL64(x,r) (((x)<<(r)) | (x>>(64-(r))))
-#define ROTR64(x,r) (((x)>>(r)) | ((x)<<(64-(r))))
-#define ER64(x,y,k) (x=ROTR64(x,8), x+=y, x^=k, y=ROTL64(y,3), y^=x)
-#define DR64(x,y,k) (y^=x, y=ROTR64(y,3), x^=k, x-=y, x=ROTL64(x,8))
+/* hands filled slots to the DMA: with scatter-gather all of them, each on a
+ * BD of its own, otherwise the next one once the DMA is idle. Counts the times
+ * the DMA was found idle with the FIFO drained during playback
+ * runs from the DMA interrupt, or from audio_kick()
+ */
+void audio_pump() {
+    char sg = XAxiDma_HasSg(&sAxiDma);
+
+    // the DMA only reports idle once it has been given something
+    if (sg) {
+        pq.done = pq.issued - fnAudioReclaim(&sAxiDma);
+    } else if (pq.issued != pq.done && !XAxiDma_Busy(&sAxiDma, XAXIDMA_DMA_TO_DEVICE)) {
+        pq.done = pq.issued;
+    }
 
+    while (pq.issued != pq.filled && (sg || pq.issued == pq.done) && !pq.error) {
+        u32 i = pq.issued % pq.slots;
+        if (pq.running && pq.issued == pq.done) {
+            if (*fifo_fill == 0) {
+                pq.underruns++;
+            } else if (*fifo_fill < FIFO_LOW_WATER) {
+                pq.low_water++;
+            }
+        }
+        u32 status = sg ? fnAudioQueue(&sAxiDma, i * pq.slot_sz, pq.len[i])
+                        : fnAudioPlay(sAxiDma, i * pq.slot_sz, pq.len[i]);
+        if (status != XST_SUCCESS) {
+            pq.error = TRUE;
+            break;
+        }
+        pq.issued++;
+        pq.running = TRUE;
+    }
+}
 
-/* Speck 128/256 decryption using CBC mode
- *
- * inCt     : pointer to the ciphertext to decrypt
- * outPt    : pointer to the buffer to store the plaintext
- * iv       : pointer to the initialization vector     
- */
-void Speck128256Decrypt(u64* inCt, u64 outPt[],u64* iv) {
-    outPt[0]=inCt[0]; outPt[1]=inCt[1];
-    for(int i=33;i>=0; i--) DR64(outPt[1],outPt[0],s.rk[i]);
 
-    outPt[0] ^= iv[0];
-    outPt[1] ^= iv[1];
+// DMA interrupt: a slot is done, so start the next one
+void dmaISR(void) {
+    XAxiDma_IntrAckIrq(&sAxiDma, XAxiDma_IntrGetIrq(&sAxiDma, XAXIDMA_DMA_TO_DEVICE),
+                       XAXIDMA_DMA_TO_DEVICE);
+    audio_pump();
+}
+
 
-    iv[0] = inCt[0];
-    iv[1] = inCt[1];
+// runs audio_pump() from the playback loop, keeping the DMA interrupt out
+void audio_kick() {
+    microblaze_disable_interrupts();
+    audio_pump();
+    microblaze_enable_interrupts();
 }
 
-/* Decrypt an audio chunk in-place using Speck128/256
- * returns 0 on success, -1 otherwise
- * 
- * chunk        : pointer to the current encrypted audio chunk
- * totalBytes   : length of chunk to decrypt in bytes
- * iv           : pointer to the initialization vector
+
+// waits until no more than n slots are filled but not yet done
+void audio_wait(u32 n) {
+    while (pq.filled - pq.done > n && !pq.error) {
+        audio_kick();
+    }
+}
+
+
+/* lets the DMA finish any song stopped part way, then splits the DMA BRAM into
+ * as many slots of chunk_sz as fit, up to DMA_NUM_SLOTS, so that playback can
+ * decrypt that many chunks less one ahead of the DMA
  */
-int speckDecryptChunk(char* chunk, int totalBytes, char* iv) {
-    if (chunk == NULL || totalBytes <= 0 || (totalBytes % SPECK_BLK_SZ != 0) || iv == NULL) {
-        return -1;
+void audio_setup(u32 chunk_sz) {
+    audio_wait(0);
+    pq.slot_sz = chunk_sz;
+    pq.slots = DMA_BRAM_SZ / chunk_sz;
+    pq.slots = (pq.slots > DMA_NUM_SLOTS) ? DMA_NUM_SLOTS : pq.slots;
+    pq.filled = pq.issued = pq.done = 0;
+    pq.running = pq.error = FALSE;
+    pq.underruns = pq.low_water = 0;
+}
+
+
+/* waits for the DMA to be done with the next slot
+ * returns where in the DMA BRAM to decrypt the next chunk to, or NULL if the
+ * DMA refused a slot
+ */
+char *audio_slot() {
+    audio_wait(pq.slots - 1);
+    if (pq.error) {
+        return NULL;
     }
-    u64 Pt[SPECK_BLK_SZ/8];
-    for (int i = 0; i < totalBytes; i+=SPECK_BLK_SZ) {
-        Speck128256Decrypt(chunk+i, Pt, (u64*)iv);
-        memcpy(chunk+i, (char*)Pt, SPECK_BLK_SZ);      
+    return (char *)(XPAR_MB_DMA_AXI_BRAM_CTRL_0_S_AXI_BASEADDR + (pq.filled % pq.slots) * pq.slot_sz);
+}
+
+
+/* queues len bytes from the start of the slot audio_slot() returned, to play
+ * after whatever is still playing
+ * returns 0 on success, -1 if the DMA refused a slot
+ */
+int audio_queue(u32 len) {
+    pq.len[pq.filled % pq.slots] = len;
+    pq.filled++;
+    audio_kick();
+    return pq.error ? -1 : 0;
+}
+
+
+/* drops the slots not yet handed to the DMA, so that what is queued after a
+ * seek or a pause plays next, and stops counting underruns until it does
+ * returns how many bytes of audio were dropped
+ */
+u32 audio_flush() {
+    u32 dropped = 0;
+
+    microblaze_disable_interrupts();
+    for (u32 i = pq.issued; i != pq.filled; i++) {
+        dropped += pq.len[i % pq.slots];
     }
-    return 0;
+    pq.filled = pq.issued;
+    pq.running = FALSE;
+    audio_pump();
+    microblaze_enable_interrupts();
+    return dropped;
 }
 
 
+// returns how many bytes of the queued audio the DMA has yet to finish with
+u32 audio_pending() {
+    u32 pending = 0;
+
+    microblaze_disable_interrupts();
+    for (u32 i = pq.done; i != pq.filled; i++) {
+        pending += pq.len[i % pq.slots];
+    }
+    microblaze_enable_interrupts();
+    return pending;
+}
+
 //////////////////////// UTILITY FUNCTIONS ////////////////////////
 
 
 // returns whether an rid has been provisioned
 int is_provisioned_rid(char rid) {
-    for (int i = 0; i < NUM_PROVISIONED_REGIONS; i++) {
-        if (rid == PROVISIONED_RIDS[i]) {
-            return TRUE;
-        }
-    }
-    return FALSE;
+    return (u8)rid < NUM_RIDS && RID_PROVISIONED[(u8)rid];
 }
 
 // looks up the region name corresponding to the rid
 int rid_to_region_name(char rid, char **region_name, int provisioned_only) {
-    for (int i = 0; i < NUM_REGIONS; i++) {
-        if (rid == REGION_IDS[i] &&
-            (!provisioned_only || is_provisioned_rid(rid))) {
-            *region_name = (char *)REGION_NAMES[i];
-            return TRUE;
-        }
+    if ((u8)rid < NUM_RIDS && RID_REGION_NAMES[(u8)rid] &&
+        (!provisioned_only || is_provisioned_rid(rid))) {
+        *region_name = (char *)RID_REGION_NAMES[(u8)rid];
+        return TRUE;
     }
 
     mb_printf("Could not find region ID '%d'\r\n", rid);
@@ -134,10 +224,10 @@ int rid_to_region_name(char rid, char **region_name, int provisioned_only) {
 
 // looks up the rid corresponding to the region name
 /*int region_name_to_rid(char *region_name, char *rid, int provisioned_only) {
-    for (int i = 0; i < NUM_REGIONS; i++) {
-        if (!strcmp(region_name, REGION_NAMES[i]) &&
-            (!provisioned_only || is_provisioned_rid(REGION_IDS[i]))) {
-            *rid = REGION_IDS[i];
+    for (int i = 0; i < NUM_RIDS; i++) {
+        if (RID_REGION_NAMES[i] && !strcmp(region_name, RID_REGION_NAMES[i]) &&
+            (!provisioned_only || is_provisioned_rid(i))) {
+            *rid = i;
             return TRUE;
         }
     }
@@ -150,23 +240,16 @@ int rid_to_region_name(char rid, char **region_name, int provisioned_only) {
 
 // returns whether a uid has been provisioned
 int is_provisioned_uid(char uid) {
-    for (int i = 0; i < NUM_PROVISIONED_USERS; i++) {
-        if (uid == PROVISIONED_UIDS[i]) {
-            return TRUE;
-        }
-    }
-    return FALSE;
+    return (u8)uid < NUM_UIDS && UID_PROVISIONED[(u8)uid];
 }
 
 
 // looks up the username corresponding to the uid
 int uid_to_username(char uid, char **username, int provisioned_only) {
-    for (int i = 0; i < NUM_USERS; i++) {
-        if (uid == USER_IDS[i] &&
-            (!provisioned_only || is_provisioned_uid(uid))) {
-            *username = (char *)USERNAMES[i];
-            return TRUE;
-        }
+    if ((u8)uid < NUM_UIDS && UID_USERNAMES[(u8)uid] &&
+        (!provisioned_only || is_provisioned_uid(uid))) {
+        *username = (char *)UID_USERNAMES[(u8)uid];
+        return TRUE;
     }
 
     mb_printf("Could not find uid '%d'\r\n", uid);
@@ -175,14 +258,26 @@ int uid_to_username(char uid, char **username, int provisioned_only) {
 }
 
 
+// FNV-1a of a username starting from seed, as tools/createDevice hashes it
+u32 name_hash(u32 seed, const char *name) {
+    u32 h = 0x811c9dc5 ^ seed;
+    for (int i = 0; i < USERNAME_SZ && name[i]; i++) {
+        h = (h ^ (u8)name[i]) * 0x01000193;
+    }
+    return h;
+}
+
+
 // looks up the uid corresponding to the username
+// the perfect hash from createDevice gives the only uid it can be
 int username_to_uid(char *username, char *uid, int provisioned_only) {
-    for (int i = 0; i < NUM_USERS; i++) {
-        if (!strncmp(username, USERNAMES[USER_IDS[i]], USERNAME_SZ) &&
-            (!provisioned_only || is_provisioned_uid(USER_IDS[i]))) {
-            *uid = USER_IDS[i];
-            return TRUE;
-        }
+    u32 b = name_hash(0, username) % USER_HASH_BUCKETS;
+    u8 u = USER_HASH_UIDS[name_hash(USER_HASH_SEEDS[b], username) % NUM_USERS];
+
+    if (!strncmp(username, UID_USERNAMES[u], USERNAME_SZ) &&
+        (!provisioned_only || is_provisioned_uid(u))) {
+        *uid = u;
+        return TRUE;
     }
 
     mb_printf("Could not find username '%s'\r\n", username);
@@ -199,6 +294,15 @@ void load_song_md() {
     s.song_md.num_users = c->song.md.num_users;
     memcpy(s.song_md.rids, (void *)get_drm_rids(c->song), s.song_md.num_regions);
     memcpy(s.song_md.uids, (void *)get_drm_uids(c->song), s.song_md.num_users);
+
+    memset(s.song_md.rid_map, 0, sizeof(s.song_md.rid_map));
+    memset(s.song_md.uid_map, 0, sizeof(s.song_md.uid_map));
+    for (int i = 0; i < s.song_md.num_regions; i++) {
+        id_map_set(s.song_md.rid_map, s.song_md.rids[i]);
+    }
+    for (int i = 0; i < s.song_md.num_users; i++) {
+        id_map_set(s.song_md.uid_map, s.song_md.uids[i]);
+    }
 }
 
 
@@ -214,31 +318,20 @@ int is_locked() {
         mb_printf("No user logged in\r\n");
     } else {
         // check if user is authorized to play song
-        if (s.uid == s.song_md.owner_id) {
-            locked = FALSE;
-        } else {
-            for (int i = 0; i < NUM_PROVISIONED_USERS && locked; i++) {
-                if (s.uid == s.song_md.uids[i]) {
-                    locked = FALSE;
-                }
-            }
-        }
+        locked = s.uid != s.song_md.owner_id && !id_map_has(s.song_md.uid_map, s.uid);
 
         if (locked) {
             mb_printf("User '%s' does not have access to this song\r\n", s.username);
             return locked;
         }
         mb_printf("User '%s' has access to this song\r\n", s.username);
-        locked = TRUE; // reset lock for region check
 
         // search for region match
-        for (int i = 0; i < s.song_md.num_regions; i++) {
-            for (int j = 0; j < (u8)NUM_PROVISIONED_REGIONS; j++) {
-                if (PROVISIONED_RIDS[j] == s.song_md.rids[i]) {
-                    locked = FALSE;
-                }
-            }
+        u32 match = 0;
+        for (int i = 0; i < ID_MAP_WORDS; i++) {
+            match |= s.song_md.rid_map[i] & s.rid_map[i];
         }
+        locked = !match;
 
         if (!locked) {
             mb_printf("Region Match. Full Song can be accessed. Unlocking...\r\n");
@@ -271,73 +364,407 @@ int init_cryptkeys() {
         return -1;
     }
     // compute Speck 128/256 key schedule
-    u64* K = (u64*)s.speckKey;
-    int i = 0;
-    u64 D=K[3], C=K[2], B=K[1], A=K[0];
-    for (i=0; i<33;) {
-        s.rk[i]=A; ER64(B,A,i++);
-        s.rk[i]=A; ER64(C,A,i++);
-        s.rk[i]=A; ER64(D,A,i++);
-    }
-    s.rk[i]=A;
+    speck_key_schedule((u64*)s.speckKey, s.rk);
+    // keyed hasher templates, see hasher_start()
+    blake3_hasher_init_keyed((blake3_hasher *)&s.mdHasher, (u8 *)s.mdKey);
+    blake3_hasher_init_keyed((blake3_hasher *)&s.chunkHasher, (u8 *)s.chunkKey);
+    // no Merkle tree nodes verified yet
+    memset(s.merkle, 0xff, sizeof(s.merkle));
+    // provisioned regions, for is_locked()
+    memset(s.rid_map, 0, sizeof(s.rid_map));
+    for (int i = 0; i < NUM_PROVISIONED_REGIONS; i++) {
+        id_map_set(s.rid_map, PROVISIONED_RIDS[i]);
+    }
     return (outLen != CHUNK_KEY_SZ);
 }
 
 
-/* create a new Blake3 hash
+// starts a blake3_hasher or a hasher_head from a keyed template in the
+// internal state, copying the key and empty chunk state but not the CV stack
+#define hasher_start(h, tmpl) memcpy((h), &(tmpl), sizeof(hasher_head))
+
+
+// a hasher_head holds all of a blake3_hasher up to the CV stack, which
+// create_hash() keeps Blake3 off by hashing at most BLAKE3_CHUNK_LEN bytes
+_Static_assert(offsetof(blake3_hasher, cv_stack) == offsetof(hasher_head, cv_stack_len) + 1,
+               "blake3_hasher layout");
+
+
+/* create a new Blake3 hash of at most BLAKE3_CHUNK_LEN bytes, which needs no
+ * CV stack
  * return 0 on success, -1 otherwise
  *
  * args     : number of different data to update hmac object with
  * data     : array of char pointers (data) to create hash with
  * dataLens : length of each data to be included in hash
- * key      : (optional) pointer to 32-bit key to create keyed hash
+ * key      : (optional) keyed hasher template to create keyed hash
  * out      : buffer to store resulting hash
  */
-int create_hash(int args, char* data[], int dataLens[], char* key, char* out) {
+int create_hash(int args, char* data[], int dataLens[], hasher_head *key, char* out) {
     if (args <= 0 || data == NULL || dataLens == NULL || out == NULL) {
         return -1;
     }
-    blake3_hasher h;
+    int total = 0;
+    for (int i = 0; i < args; i++) {
+        if (dataLens[i] < 0 || dataLens[i] > BLAKE3_CHUNK_LEN - total) {
+            return -1;
+        }
+        total += dataLens[i];
+    }
+    hasher_head h;
     if (key == NULL) {
-        blake3_hasher_init(&h);
+        blake3_hasher_init((blake3_hasher *)&h);
     } else {
-        blake3_hasher_init_keyed(&h, key);
+        hasher_start(&h, *key);
     }
     for (int i = 0; i < args; i++) {
-        blake3_hasher_update(&h, data[i], dataLens[i]);
+        blake3_hasher_update((blake3_hasher *)&h, data[i], dataLens[i]);
+    }
+    blake3_hasher_finalize((blake3_hasher *)&h, out, BLAKE3_OUT_LEN);
+    return 0;
+}
+
+
+// bytes covered by the metadata hash, from the IV on: IV, counts and metadata,
+// then for v2 the extension header
+#define MD_HASHED_SZ (SPECK_BLK_SZ + sizeof(int)*2 + MD_SZ)
+
+/* returns the number of bytes the metadata hash of a song header covers, or 0
+ * if its v2 extension header is neither size
+ */
+int md_hashed_sz(song *hdr) {
+    if (drm_version(hdr->numChunks) != DRM_V2) {
+        return MD_HASHED_SZ;
+    }
+    if (hdr->ext.ext_sz != DRM_EXT_SZ && hdr->ext.ext_sz != sizeof(drm_ext)) {
+        return 0;
+    }
+    return MD_HASHED_SZ + hdr->ext.ext_sz;
+}
+
+
+/* returns the number of Merkle tree nodes below level in a tree over n chunk
+ * hashes, which is also where that level starts in the table
+ */
+u32 merkle_level_start(u32 n, u32 level) {
+    u32 start = 0;
+    for (u32 k = 0; k < level; k++) {
+        start += n;
+        n = (n + 1) / 2;
+    }
+    return start;
+}
+
+
+/* fills in the layout of a song from a verified header and checks that it is
+ * one this DRM can play and that it fits in the shared buffer
+ * returns 0 on success, -1 otherwise
+ */
+int load_layout(song *hdr, song_layout *l) {
+    u32 table_sz;
+
+    l->version = drm_version(hdr->numChunks);
+    l->nchunks = drm_nchunks(hdr->numChunks);
+    l->enc_len = hdr->encAudioLen;
+    l->md_hashed_sz = md_hashed_sz(hdr);
+    l->flags = 0;
+    l->depth = 0;
+    if (l->version == DRM_V1) {
+        l->chunk_sz = CHUNK_SZ;
+        l->chunk_shift = 0;
+        l->audio_off = offsetof(song, ext);
+        l->table_off = l->audio_off + l->enc_len;
+        table_sz = l->nchunks * 32;
+    } else if (l->version == DRM_V2 &&
+               hdr->ext.chunk_shift >= MIN_CHUNK_SHIFT && hdr->ext.chunk_shift <= MAX_CHUNK_SHIFT &&
+               (((hdr->ext.flags & ~DRM_EXT_CHUNK_IV) == 0 && hdr->ext.ext_sz == DRM_EXT_SZ) ||
+                ((hdr->ext.flags & ~DRM_EXT_CHUNK_IV) == DRM_EXT_MERKLE && hdr->ext.ext_sz == sizeof(drm_ext)))) {
+        l->chunk_shift = hdr->ext.chunk_shift;
+        l->chunk_sz = 1 << l->chunk_shift;
+        l->table_off = hdr->ext.table_off;
+        l->audio_off = hdr->ext.audio_off;
+        l->flags = hdr->ext.flags;
+        if (l->flags & DRM_EXT_MERKLE) {
+            memcpy(l->root, hdr->ext.root, BLAKE3_OUT_LEN);
+            while (l->depth <= MERKLE_MAX_DEPTH && (l->nchunks - 1) >> l->depth) {
+                l->depth++;
+            }
+            if (l->depth > MERKLE_MAX_DEPTH) {
+                return -1;
+            }
+            table_sz = merkle_level_start(l->nchunks, l->depth + 1) * 32;
+        } else {
+            table_sz = l->nchunks * 32;
+        }
+        // bounded first, so the sums below cannot wrap
+        if (l->table_off > MAX_DRM_FILE_SZ || l->audio_off > MAX_DRM_FILE_SZ ||
+            l->table_off < offsetof(song, ext) + hdr->ext.ext_sz || l->audio_off < l->table_off + table_sz) {
+            return -1;
+        }
+    } else {
+        return -1;
+    }
+
+    if (l->enc_len == 0 || l->enc_len % SPECK_BLK_SZ || l->enc_len > MAX_SONG_SZ + SPECK_BLK_SZ ||
+        l->nchunks != (l->enc_len + l->chunk_sz - 1) / l->chunk_sz ||
+        l->table_off + table_sz > MAX_DRM_FILE_SZ || l->audio_off + l->enc_len > MAX_DRM_FILE_SZ) {
+        return -1;
     }
-    blake3_hasher_finalize(&h, out, BLAKE3_OUT_LEN);
     return 0;
 }
 
 
 /* verify integrity of a song using the metadata hash from the song in the shared buffer
+ * the header is checked from a private copy, and the layout it describes is
+ * kept in s.layout. Merkle tree nodes verified before are kept if the song
+ * has the same metadata hash, which covers the root, and forgotten otherwise
  * returns 0 on success, -1 otherwise
  */
 int verify_song() {
-    char mdHash[BLAKE3_OUT_LEN];
-    memcpy(mdHash, c->song.mdHash, BLAKE3_OUT_LEN);
+    song hdr;
+    memcpy(&hdr, (void *)&c->song, sizeof(song));
 
     mb_printf("Verifying Audio File...\r\n");
     char out[BLAKE3_OUT_LEN];
-    char* data[1] = { c->song.iv };
-    int dataLens[1] = { SPECK_BLK_SZ + sizeof(int)*2 + MD_SZ };
-    if (create_hash(1, data, dataLens, s.mdKey, out) != 0) {
+    char* data[1] = { hdr.iv };
+    int dataLens[1] = { md_hashed_sz(&hdr) };
+    if (dataLens[0] == 0 || create_hash(1, data, dataLens, &s.mdHasher, out) != 0) {
         mb_printf("Verification Failed\r\n");
         return -1;
     }
-    if (memcmp(mdHash, out, BLAKE3_OUT_LEN) != 0) {
+    if (memcmp(hdr.mdHash, out, BLAKE3_OUT_LEN) != 0 || load_layout(&hdr, &s.layout) != 0) {
         mb_printf("Verification Failed\r\n");
         return -1;
     }
+    if (memcmp(s.merkleSong, hdr.mdHash, BLAKE3_OUT_LEN) != 0) {
+        memset(s.merkle, 0xff, sizeof(s.merkle));
+        memcpy(s.merkleSong, hdr.mdHash, BLAKE3_OUT_LEN);
+    }
     mb_printf("Successfully Verified Audio File\r\n");
     return 0;
 }
 
 
+// first byte of every interior Merkle tree node, see constants.h
+#define MERKLE_NODE_TAG 0x01
+
+/* checks a chunk hash against the verified Merkle root of the current song,
+ * hashing up the tree with the sibling hashes miPod supplied. The climb stops
+ * early at a node already verified for this song, so playing on from a chunk
+ * usually costs a node or two, also after a seek. The nodes of a path that
+ * checks out are kept as verified
+ * returns 0 on success, -1 otherwise
+ *
+ * chunknum : number of the chunk
+ * leaf     : its keyed Blake3 chunk hash, as computed from the chunk
+ * path     : private copy of its sibling on each level, as in stream_slot
+ */
+int verify_merkle(u32 chunknum, char* leaf, char path[][BLAKE3_OUT_LEN]) {
+    merkle_node nodes[MERKLE_MAX_DEPTH];
+    char tag = MERKLE_NODE_TAG;
+    char node[BLAKE3_OUT_LEN];
+    u32 n = s.layout.nchunks, j = chunknum, k;
+
+    memcpy(node, leaf, BLAKE3_OUT_LEN);
+    for (k = 0; k < s.layout.depth && s.merkle[k].index != j; k++) {
+        nodes[k].index = j;
+        memcpy(nodes[k].hash, node, BLAKE3_OUT_LEN);
+        // the last node of an odd level moves up unchanged
+        if ((j ^ 1) < n) {
+            hasher_head h;
+            hasher_start(&h, s.chunkHasher);
+            blake3_hasher_update((blake3_hasher *)&h, &tag, 1);
+            blake3_hasher_update((blake3_hasher *)&h, (j & 1) ? path[k] : node, BLAKE3_OUT_LEN);
+            blake3_hasher_update((blake3_hasher *)&h, (j & 1) ? node : path[k], BLAKE3_OUT_LEN);
+            blake3_hasher_finalize((blake3_hasher *)&h, node, BLAKE3_OUT_LEN);
+        }
+        j >>= 1;
+        n = (n + 1) / 2;
+    }
+
+    if (memcmp(node, (k < s.layout.depth) ? s.merkle[k].hash : s.layout.root, BLAKE3_OUT_LEN) != 0) {
+        return -1;
+    }
+    memcpy(s.merkle, nodes, k * sizeof(merkle_node));
+    return 0;
+}
+
+
+/* copies what a chunk is checked against out of the hash table in the shared
+ * buffer: its sibling on each level of the Merkle tree, or its chunk hash
+ *
+ * chunknum : number of the chunk
+ * proof    : buffer for MERKLE_MAX_DEPTH hashes
+ */
+void load_chunk_proof(u32 chunknum, char proof[][BLAKE3_OUT_LEN]) {
+    if (!(s.layout.flags & DRM_EXT_MERKLE)) {
+        memcpy(proof[0], get_layout_hash(c->song, s.layout, chunknum), BLAKE3_OUT_LEN);
+        return;
+    }
+    u32 n = s.layout.nchunks, start = 0, j = chunknum;
+    for (u32 k = 0; k < s.layout.depth; k++) {
+        if ((j ^ 1) < n) {
+            memcpy(proof[k], get_layout_hash(c->song, s.layout, start + (j ^ 1)), BLAKE3_OUT_LEN);
+        }
+        start += n;
+        n = (n + 1) / 2;
+        j >>= 1;
+    }
+}
+
+
+/* derives the IV a chunk of a DRM_EXT_CHUNK_IV song is encrypted from: the
+ * first SPECK_BLK_SZ bytes of the Blake3 hash of [origIv + chunknum]
+ *
+ * origIv   : song initialization vector
+ * chunknum : number of the chunk
+ * iv       : buffer to store the IV
+ */
+void chunk_iv(char *origIv, u32 chunknum, char *iv) {
+    u8 num[4] = { chunknum, chunknum >> 8, chunknum >> 16, chunknum >> 24 };
+    char out[BLAKE3_OUT_LEN];
+    char* data[2] = { origIv, (char *)num };
+    int dataLens[2] = { SPECK_BLK_SZ, sizeof(num) };
+    create_hash(2, data, dataLens, NULL, out);
+    memcpy(iv, out, SPECK_BLK_SZ);
+}
+
+
+// bytes of ciphertext pulled from shared memory per step of verify_decrypt_chunk()
+#define CHUNK_LINE_SZ 64
+
+/* verify and decrypt an audio chunk in a single pass over shared memory
+ * each line of ciphertext is copied out of DDR once, then fed to both the keyed
+ * Blake3 chunk hash and the Speck CBC decryption. Working from the private copy
+ * also means miPod cannot swap the data between the hash and the decryption.
+ * The plaintext is wiped unless the final hash matches
+ * returns 0 on success, -1 otherwise
+ *
+ * inCt     : pointer to the encrypted audio chunk
+ * outPt    : buffer to store the plaintext, must not overlap inCt
+ * len      : length of chunk in bytes
+ * origIv   : song initialization vector, hashed after the chunk
+ * iv       : pointer to the CBC chaining value, updated for the next chunk
+ * chunknum : number of the chunk
+ * proof    : private copy of what the chunk is checked against, from
+ *            load_chunk_proof() or a stream slot: for a Merkle tree, the
+ *            sibling path for verify_merkle(), otherwise the expected keyed
+ *            Blake3 hash of [chunk + origIv]
+ */
+int verify_decrypt_chunk(char* inCt, char* outPt, int len, char* origIv, char* iv,
+                         u32 chunknum, char proof[][BLAKE3_OUT_LEN]) {
+    if (inCt == NULL || outPt == NULL || len <= 0 || (len % SPECK_BLK_SZ != 0) ||
+        origIv == NULL || iv == NULL || proof == NULL) {
+        return -1;
+    }
+    chunk_hasher h;
+    u64 line[CHUNK_LINE_SZ/8];
+    char out[BLAKE3_OUT_LEN];
+
+    chunk_hash_start(&h, s.chunkHasher.key);
+    for (int i = 0; i < len; i += CHUNK_LINE_SZ) {
+        int n = (len - i > CHUNK_LINE_SZ) ? CHUNK_LINE_SZ : len - i;
+        // without the DMA interrupt, give the DMA the buffer waiting for it
+        // once the FIFO runs low, rather than after the whole chunk
+        if (!dma_intr && i % FIFO_POLL_SZ == 0 && pq.issued != pq.filled && *fifo_fill < FIFO_LOW_WATER) {
+            audio_kick();
+        }
+        memcpy(line, inCt + i, n);
+        chunk_hash_update(&h, line, n);
+        speck_decrypt_cbc(s.rk, (char*)line, outPt + i, n, iv);
+    }
+
+    if (chunk_hash_final(&h, origIv, SPECK_BLK_SZ, (u8 *)out) != 0 ||
+        ((s.layout.flags & DRM_EXT_MERKLE) ? verify_merkle(chunknum, out, proof) != 0
+                                           : memcmp(proof[0], out, BLAKE3_OUT_LEN) != 0)) {
+        memset(outPt, 0, len);
+        return -1;
+    }
+    return 0;
+}
+
+
+// how long the DRM waits between looks at the stream while miPod loads a chunk
+#define STREAM_WAIT_US 100
+
+/* returns the stream slot holding chunk chunknum, dropping any slots miPod
+ * loaded before the last seek, or NULL if miPod has not loaded it yet
+ * the slot stays owned by the DRM until stream_release()
+ */
+volatile stream_slot *stream_get(u32 chunknum) {
+    while (c->stream.tail != c->stream.head) {
+        volatile stream_slot *slot = &c->stream.slots[c->stream.tail % STREAM_SLOTS];
+        if (slot->chunk == chunknum) {
+            return slot;
+        }
+        c->stream.tail++;
+    }
+    return NULL;
+}
+
+
+// hands the slot from stream_get() back to miPod
+void stream_release() {
+    c->stream.tail++;
+}
+
+
+// asks miPod to continue the stream from chunk chunknum
+void stream_seek(u32 chunknum) {
+    c->stream.want = chunknum;
+    c->stream.seek++;
+}
+
+
+/* maps an offset into the audio of the current song to where playback resumes:
+ * the offset rounded down to a whole sample, the chunk holding it, and how far
+ * into the chunk it is. v2 chunks are found with a shift
+ */
+void seek_locate(u32 pos, seek_point *p) {
+    p->pos = pos & ~(BYTES_PER_SAMP - 1);
+    p->chunk = s.layout.chunk_shift ? p->pos >> s.layout.chunk_shift : p->pos / s.layout.chunk_sz;
+    p->offset = p->pos - p->chunk * s.layout.chunk_sz;
+}
+
+
+/* moves a seek to a chunk of a song that chains CBC across chunks back by one,
+ * as the chunk is decrypted from the last block of the one before, and that
+ * block is only trusted from a chunk that verified
+ * returns whether chunknum was moved back
+ */
+int seek_chain(int *chunknum) {
+    if ((s.layout.flags & DRM_EXT_CHUNK_IV) || *chunknum == 0) {
+        return FALSE;
+    }
+    (*chunknum)--;
+    return TRUE;
+}
+
+
 //////////////////////// COMMAND FUNCTIONS ////////////////////////
 
 
+// checks the pin in the internal state against the hash of provisioned user i
+int check_pin(int i) {
+    // basedecode pin hash
+    word32 outLen = B64_PIN_HASH_SZ;
+    char saltedHash[B64_PIN_HASH_SZ];
+    if (Base64_Decode((unsigned char *)PROVISIONED_B64PIN_HASHES[i], (word32)B64_PIN_HASH_SZ, (unsigned char *)saltedHash, &outLen) != 0) {
+        return FALSE;
+    }
+    if (outLen != BLAKE3_OUT_LEN) return FALSE;
+    // hash pin+username
+    char out[32];
+    char* data[2] = { s.pin, s.username };
+    int dataLens[2] = { strlen(s.pin), strlen(s.username) };
+    if (create_hash(2, data, dataLens, NULL, out) != 0) {
+        return FALSE;
+    }
+    // check if hashes match
+    return !memcmp(saltedHash, out, BLAKE3_OUT_LEN);
+}
+
+
 // attempt to log in to the credentials in the shared buffer
 void login() {
     // first, copy attempted username and pin into local internal_state
@@ -347,35 +774,15 @@ void login() {
     if (s.logged_in) {
         mb_printf("Already logged in. Please log out first.\r\n");
     } else {
-        for (int i = 0; i < NUM_PROVISIONED_USERS; i++) {
-            // search for matching username
-            if (!strncmp(s.username, USERNAMES[PROVISIONED_UIDS[i]], USERNAME_SZ)) {
-                // basedecode pin hash
-                word32 outLen = B64_PIN_HASH_SZ;
-                char saltedHash[B64_PIN_HASH_SZ];
-                if (Base64_Decode((unsigned char *)PROVISIONED_B64PIN_HASHES[i], (word32)B64_PIN_HASH_SZ, (unsigned char *)saltedHash, &outLen) != 0) {
-                    break;
-                }
-                if (outLen != BLAKE3_OUT_LEN) break;
-                // hash pin+username
-                char out[32];
-                char* data[2] = { s.pin, s.username };
-                int dataLens[2] = { strlen(s.pin), strlen(s.username) };
-                if (create_hash(2, data, dataLens, NULL, out) != 0) {
-                    break;
-                }
-                // check if hashes match
-                if (!memcmp(saltedHash, out, BLAKE3_OUT_LEN)) {
-                    //update state
-                    s.logged_in = 1;
-                    s.uid = PROVISIONED_UIDS[i];
-                    mb_printf("Logged in for user '%s'\r\n", (void *)s.username);
-                    return;
-                } else {
-                    // username exists, but password does not match
-                    break;
-                }
-            }
+        // search for matching username
+        char uid;
+        if (username_to_uid(s.username, &uid, TRUE) &&
+            check_pin(UID_PROVISIONED[(u8)uid] - 1)) {
+            //update state
+            s.logged_in = 1;
+            s.uid = uid;
+            mb_printf("Logged in for user '%s'\r\n", (void *)s.username);
+            return;
         }
         // reject login attempt and wait 5 seconds
         mb_printf("Login failed\r\n");
@@ -404,11 +811,11 @@ void query_player() {
     c->query.num_users = NUM_PROVISIONED_USERS;
 
     for (int i = 0; i < NUM_PROVISIONED_REGIONS; i++) {
-        strncpy((char *)q_region_lookup(c->query, i), REGION_NAMES[PROVISIONED_RIDS[i]], REGION_NAME_SZ);
+        strncpy((char *)q_region_lookup(c->query, i), RID_REGION_NAMES[PROVISIONED_RIDS[i]], REGION_NAME_SZ);
     }
 
     for (int i = 0; i < NUM_PROVISIONED_USERS; i++) {
-        strncpy((char *)q_user_lookup(c->query, i), USERNAMES[i], USERNAME_SZ);
+        strncpy((char *)q_user_lookup(c->query, i), UID_USERNAMES[PROVISIONED_UIDS[i]], USERNAME_SZ);
     }
 }
 
@@ -490,6 +897,7 @@ void share_song() {
     // update song metadata in local state
     s.song_md.md_size++;
     s.song_md.uids[s.song_md.num_users++] = uid;
+    id_map_set(s.song_md.uid_map, uid);
 
     // actually modify the file in the shared memory
     c->song.md.md_size++;
@@ -497,9 +905,9 @@ void share_song() {
 
     // update metadata hash and copy it into the file in the shared memory
     char* data[1] = { c->song.iv };
-    int dataLens[1] = { SPECK_BLK_SZ + sizeof(int)*2 + MD_SZ };
+    int dataLens[1] = { s.layout.md_hashed_sz };
     char out[BLAKE3_OUT_LEN];
-    if (create_hash(1, data, dataLens, s.mdKey, out) != 0) {
+    if (create_hash(1, data, dataLens, &s.mdHasher, out) != 0) {
         mb_printf("Cannot share song\r\n");
         c->song.wav_size = 0;
         return;
@@ -516,13 +924,16 @@ void share_song() {
 
 
 // plays a song and enter the playback loop, which has its own commands
+// the audio is streamed by miPod through c->stream as it plays
 // if the metadata verification fails, set c->song.wav_size = 0 to notify DRM
 // if error occurs during playback, simply break out of the playback loop
 void play_song() {
-    u32 counter = 0, cp_num, cp_xfil_cnt, offset, dma_cnt, lenAudio, *fifo_fill;
+    u32 cp_num, lenAudio;
     // rem is the outBytes of audio remaining to play during the play loop
     // we need rem to be signed so we can check if under 0
     int rem;
+    // where playback has got to, and where a command moves it to
+    u32 played, target;
 
     mb_printf("Reading Audio File...\r\n");
     // verify and load song md
@@ -534,8 +945,9 @@ void play_song() {
     }
     load_song_md();
 
-    lenAudio = c->song.encAudioLen;
-    unsigned int nchunks = c->song.numChunks;
+    lenAudio = s.layout.enc_len;
+    unsigned int nchunks = s.layout.nchunks;
+    u32 chunk_sz = s.layout.chunk_sz, chunk_len;
 
     // truncate song if locked
     if (lenAudio > PREVIEW_SZ && is_locked()) {
@@ -546,38 +958,45 @@ void play_song() {
         mb_printf("Song is unlocked. Playing full song\r\n");
     }
 
-    // whether we are operating on the first chunk of the audio
-    int firstChunk = TRUE;
     // save a copy of the initialization vector used for the AES-CBC encryption
     char origIv[SPECK_BLK_SZ];
     memcpy(origIv, c->song.iv, SPECK_BLK_SZ);
-    // buffer used to store current "IV" value -- we change this value after decrypting
-    // each audio chunk, but initially, it is the original initialization vector
+    // buffer used to store current "IV" value -- the last ciphertext block of the
+    // previous chunk, as verify_decrypt_chunk() leaves it, or the original
+    // initialization vector for the first chunk; with DRM_EXT_CHUNK_IV, the
+    // chunk's own
     char iv[SPECK_BLK_SZ];
-    memcpy(iv, c->song.iv, SPECK_BLK_SZ);
-    // buffer used to hold current decrypted audio chunk
-    char plainChunk[CHUNK_SZ];
+    // DMA BRAM slot the current chunk is decrypted into and played from
+    char *plainChunk;
     // chunk number currently being decrypted
     int chunknum = 0;
+    // where the last seek landed in chunknum, played from there on
+    u32 skip = 0;
+    // whether chunknum is the one before where a seek landed, only decrypted
+    // to get a verified chaining value for it
+    int chain = FALSE;
+    seek_point sp;
 
     rem = lenAudio;
-    fifo_fill = (u32 *)XPAR_FIFO_COUNT_AXI_GPIO_0_BASEADDR;
-    
-    char paused = FALSE;
 
-    // write entire file to two-block codec fifo
-    // writes to one block while the other is being played
+    // decrypt the song chunk by chunk into the DMA BRAM slots, each played
+    // while the ones after it are decrypted
     set_playing();
+    audio_setup(chunk_sz);
     while(rem > 0) {
         // check for interrupt to stop playback
         while (InterruptProcessed) {
             InterruptProcessed = FALSE;
 
+            int seek = FALSE;
             switch (c->cmd) {
             case PAUSE:
                 mb_printf("Pausing... \r\n");
                 set_paused();
-                paused = TRUE;
+                // the slots the DMA has not started on are decrypted again
+                // once playback resumes
+                target = lenAudio - rem - audio_flush();
+                seek = (target != lenAudio - rem);
                 while (!InterruptProcessed) continue; // wait for interrupt
                 usleep(10000);
                 break;
@@ -591,128 +1010,146 @@ void play_song() {
             case RESTART:
                 mb_printf("Restarting song... \r\n");
                 usleep(10000); // prevent choppy audio on restart
+                audio_flush();
                 chunknum = 0; // reset chunk number
+                skip = 0;
+                chain = FALSE;
                 rem = lenAudio; // reset song counter
-                firstChunk = TRUE;
+                stream_seek(chunknum);
                 set_playing();
                 break;
             case FF:
                 mb_printf("Fast forwarding 5 seconds... \r\n");
-                paused = TRUE;
-                rem -= SKIP_SZ; // skip ahead
+                // seek from what has been played, not from what was queued
+                played = lenAudio - rem - audio_flush();
+                played -= audio_pending();
                 // if we try to skip past the end of the song/preview, end playback
-                if (rem <= 0) {
+                if (lenAudio - played <= SKIP_SZ) {
                     mb_printf("Done Playing Song. Press enter to continue.\r\n");
                     return;
                 }
-                chunknum += (SKIP_SZ / CHUNK_SZ);
+                // skip ahead to the sample 5 seconds on
+                target = played + SKIP_SZ;
+                seek = TRUE;
                 break;
             case RW:
                 mb_printf("Rewinding 5 seconds... \r\n");
-                paused = TRUE;
-                rem += SKIP_SZ; // rewind
+                played = lenAudio - rem - audio_flush();
+                played -= audio_pending();
                 // if we try to rewind past the beginning, play from the beginning
-                if (rem > lenAudio) {
+                if (played < SKIP_SZ) {
                     usleep(10000); // prevent choppy audio on restart
-                    rem = lenAudio;
-                    firstChunk = TRUE;
-                }
-                chunknum -= (SKIP_SZ / CHUNK_SZ);
-                if (chunknum < 0) {
-                    chunknum = 0;
+                    target = 0;
+                } else {
+                    // rewind to the sample 5 seconds back
+                    target = played - SKIP_SZ;
                 }
+                seek = TRUE;
             default:
                 break;
             }
-        }
-
-        // calculate write size and offset
-        cp_num = (rem > CHUNK_SZ) ? CHUNK_SZ : rem;
-        offset = (counter++ % 2 == 0) ? 0 : CHUNK_SZ;
 
-        // if first chunk, do nothing -- we have already copied the initialization
-        // vector into the iv buffer
-        // if not the first chunk, use the most previous AES block as the IV for the
-        // next chunk decryption
-        if (firstChunk) {
-            firstChunk = FALSE;
-        } else {
-            memcpy(iv, (get_drm_song(c->song) + lenAudio - rem - SPECK_BLK_SZ), SPECK_BLK_SZ);
+            // play on from the sample at target, in whatever chunk holds it
+            if (seek) {
+                seek_locate(target, &sp);
+                chunknum = sp.chunk;
+                skip = sp.offset;
+                rem = lenAudio - sp.pos;
+                chain = seek_chain(&chunknum);
+                stream_seek(chunknum);
+            }
         }
 
-        // verify chunk using blake3 chunk hash
-        char chunkHash[BLAKE3_OUT_LEN];
-        memcpy(chunkHash, get_drm_hash(c->song, chunknum++), BLAKE3_OUT_LEN);
+        // wait for miPod to stream the chunk in, still taking commands meanwhile
+        volatile stream_slot *slot = stream_get(chunknum);
+        if (slot == NULL) {
+            usleep(STREAM_WAIT_US);
+            continue;
+        }
 
-        char* data[2] = { get_drm_song(c->song) + lenAudio - rem, origIv };
-        int dataLens[2] = { cp_num, SPECK_BLK_SZ };
-        char out[BLAKE3_OUT_LEN];
-        if (create_hash(2, data, dataLens, s.chunkKey, out) != 0) {
-            mb_printf("Failed to play audio\r\n");
-            return;
+        // calculate chunk size
+        chunk_len = s.layout.enc_len - chunknum * chunk_sz;
+        chunk_len = (chunk_len > chunk_sz) ? chunk_sz : chunk_len;
+
+        // the first chunk chains from the original initialization vector, any
+        // other from the last ciphertext block of the chunk verified before it,
+        // already in iv, unless every chunk has its own
+        if (s.layout.flags & DRM_EXT_CHUNK_IV) {
+            chunk_iv(origIv, chunknum, iv);
+        } else if (chunknum == 0) {
+            memcpy(iv, origIv, SPECK_BLK_SZ);
         }
-        if (memcmp(chunkHash, out, BLAKE3_OUT_LEN) != 0) {
-            mb_printf("Failed to play audio\r\n");
-            return;
+
+        // verify chunk using blake3 chunk hash and decrypt it into the buffer
+        char chunkProof[MERKLE_MAX_DEPTH][BLAKE3_OUT_LEN];
+        if (s.layout.flags & DRM_EXT_MERKLE) {
+            memcpy(chunkProof, (char*)slot->path, s.layout.depth * BLAKE3_OUT_LEN);
+        } else {
+            memcpy(chunkProof[0], (char*)slot->hash, BLAKE3_OUT_LEN);
         }
 
-        // decrypt 16 KB chunk in buffer
-        memcpy(plainChunk, (get_drm_song(c->song) + lenAudio - rem), cp_num);
-        if (speckDecryptChunk(plainChunk, cp_num, iv) != 0) {
+        // decrypt straight into the next DMA BRAM slot, once the DMA is done with it
+        plainChunk = audio_slot();
+        int bad = !plainChunk || verify_decrypt_chunk((char*)slot->data, plainChunk, chunk_len, origIv, iv,
+                                                      chunknum++, chunkProof);
+        stream_release();
+        if (bad) {
             mb_printf("Failed to play audio\r\n");
             return;
         }
+        // the chunk before a seek only leaves its last block in iv; its slot
+        // is taken by the next chunk without being queued
+        if (chain) {
+            chain = FALSE;
+            continue;
+        }
 
         // if last chunk unpad using PKCS#7
         if (chunknum == nchunks) {
-            int pads = (int*)plainChunk[cp_num-1];
+            int pads = (u8)plainChunk[chunk_len-1];
             // terminate playback if padding is invalid
             if (pads == 0 || pads > 16) {
                 mb_printf("Failed to play audio\r\n");
                 return;
             }
             for (int i = 1; i <= pads; i++) {
-                int bite = (int*)plainChunk[cp_num-i];
+                int bite = (u8)plainChunk[chunk_len-i];
                 if (bite != pads) {
                     mb_printf("Failed to play audio\r\n");
                     return;
                 }
             }
             // padding is valid
-            cp_num -= pads;
-            rem -= pads;
+            chunk_len -= pads;
         }
 
-        // do first mem cpy here into DMA BRAM
-        Xil_MemCpy((void *)(XPAR_MB_DMA_AXI_BRAM_CTRL_0_S_AXI_BASEADDR + offset),
-                   (void*)plainChunk,
-                   (u32)(cp_num));
-        
-        cp_xfil_cnt = cp_num;
-
-        while (cp_xfil_cnt > 0) {
-            // polling while loop to wait for DMA to be ready
-            // DMA must run first for this to yield the proper state
-            // rem != lenAudio checks for first run
-            while (XAxiDma_Busy(&sAxiDma, XAXIDMA_DMA_TO_DEVICE)
-                   && rem != lenAudio && *fifo_fill < (FIFO_CAP - 32));
-
-            // do DMA
-            dma_cnt = (FIFO_CAP - *fifo_fill > cp_xfil_cnt)
-                      ? FIFO_CAP - *fifo_fill
-                      : cp_xfil_cnt;
-            // prevents choppy audio when resuming from pause
-            if (paused) {
-                dma_cnt = cp_xfil_cnt;
-                paused = FALSE;
-            }
-            fnAudioPlay(sAxiDma, offset, dma_cnt);
-            cp_xfil_cnt -= dma_cnt;
+        // play from where a seek landed, which can be past the end of the audio
+        // in the last chunk; a preview can end part way through a chunk
+        cp_num = (chunk_len > skip) ? chunk_len - skip : 0;
+        cp_num = (rem > cp_num) ? cp_num : rem;
+
+        // queue the slot, where the DMA plays it after the one before while the
+        // next chunks are decrypted; the DMA needs it to start on a word, so
+        // move audio from part way through the chunk to the start of the slot
+        if (cp_num && skip) {
+            memmove(plainChunk, plainChunk + skip, cp_num);
         }
+        if (cp_num && audio_queue(cp_num) != 0) {
+            mb_printf("Failed to play audio\r\n");
+            return;
+        }
+        skip = 0;
 
-        rem -= cp_num;
+        // the last chunk ends the song, whatever padding it dropped
+        rem = (chunknum == nchunks) ? 0 : rem - cp_num;
     } // end playback loop
 
+    // the song is done once the DMA has played the last chunk
+    audio_wait(0);
+    if (pq.underruns || pq.low_water) {
+        mb_printf("FIFO ran dry %d times, and low %d times\r\n", pq.underruns, pq.low_water);
+    }
+
     xil_printf("\r\n");
     mb_printf("Done Playing Song. Press enter to continue.\r\n");
 } // end play_song()
@@ -724,6 +1161,7 @@ void play_song() {
 // on error, set c->song.wav_size = 0 to notify DRM
 // note: implementation mirrors play_song()
 void digital_out() {
+    c->dout_chunks = 0;
     if (verify_song() != 0) {
         mb_printf("Cannot dump song\r\n");
         c->song.wav_size = 0;
@@ -731,11 +1169,12 @@ void digital_out() {
     }
     load_song_md();
 
-    // save metadata locally so we don't depend on values in volatile shared memory
-    int file_size = c->song.file_size; // whole .drm file size
-    int wav_size = c->song.wav_size; // size not including WAV metadata
-    // number of encrypted chunks
-    int nchunks = c->song.numChunks;
+    // take sizes from the verified layout so we don't depend on values in
+    // volatile shared memory
+    u32 nchunks = s.layout.nchunks;
+    u32 chunk_sz = s.layout.chunk_sz;
+    // size of the audio to dump, including the padding until it is removed
+    int wav_size = s.layout.enc_len;
     // save a copy of the initialization vector used for the AES-CBC encryption
     char origIv[SPECK_BLK_SZ];
     memcpy(origIv, c->song.iv, SPECK_BLK_SZ);
@@ -743,53 +1182,43 @@ void digital_out() {
     // each audio chunk, but initially, it is the original initialization vector
     char iv[SPECK_BLK_SZ];
     memcpy(iv, c->song.iv, SPECK_BLK_SZ);
+    // buffer used to hold current decrypted audio chunk until it is verified:
+    // the DMA BRAM, once the DMA has finished any song stopped part way, so
+    // the chunk does not need room on the stack
+    audio_wait(0);
+    char *plainChunk = (char *)XPAR_MB_DMA_AXI_BRAM_CTRL_0_S_AXI_BASEADDR;
     // chunk number currently being decrypted
     int chunknum = 0;
 
-    // remove all metadata size from file sizes to reflect audio only
-    unsigned int all_md_len = BLAKE3_OUT_LEN + SPECK_BLK_SZ + sizeof(int)*2 + MD_SZ + nchunks*BLAKE3_OUT_LEN;
-    file_size -= all_md_len;
-    wav_size -= all_md_len;
-
     // truncate song if locked
     if (is_locked() && PREVIEW_SZ < wav_size) {
         mb_printf("Only dumping 30 seconds\r\n");
-        file_size -= wav_size - PREVIEW_SZ;
         wav_size = PREVIEW_SZ;
     }
 
     mb_printf("Dumping song (%dB)...\r\n", wav_size);
     // taken & modified from play_song
-    unsigned int lenAudio = wav_size;
-
-    int rem = lenAudio;
-    unsigned int cp_num;
+    int rem = wav_size;
+    unsigned int chunk_len, cp_num;
+    wav_size = 0;
 
     // loop to decrypt and verify chunks of encrypted audio
     while(rem > 0) {
-        // calculate write size and offset
-        cp_num = (rem > CHUNK_SZ) ? CHUNK_SZ : rem;
-
-        // verify chunk using blake3 chunk hash
-        char chunkHash[BLAKE3_OUT_LEN];
-        memcpy(chunkHash, get_drm_hash(c->song, chunknum++), BLAKE3_OUT_LEN);
-
-        char* data[2] = { get_drm_song(c->song) + lenAudio - rem, origIv };
-        int dataLens[2] = { cp_num, SPECK_BLK_SZ };
-        char out[BLAKE3_OUT_LEN];
-        if (create_hash(2, data, dataLens, s.chunkKey, out) != 0) {
-            mb_printf("Failed to dump song\r\n");
-            c->song.wav_size = 0;
-            return;
-        }
-        if (memcmp(chunkHash, out, BLAKE3_OUT_LEN) != 0) {
-            mb_printf("Failed to dump song\r\n");
-            c->song.wav_size = 0;
-            return;
+        // calculate chunk and write size
+        char *chunk = get_layout_chunk(c->song, s.layout, chunknum);
+        chunk_len = s.layout.enc_len - chunknum * chunk_sz;
+        chunk_len = (chunk_len > chunk_sz) ? chunk_sz : chunk_len;
+
+        // verify chunk using blake3 chunk hash and decrypt it locally
+        char chunkProof[MERKLE_MAX_DEPTH][BLAKE3_OUT_LEN];
+        load_chunk_proof(chunknum, chunkProof);
+
+        // without chaining across chunks, each starts from its own IV
+        if (s.layout.flags & DRM_EXT_CHUNK_IV) {
+            chunk_iv(origIv, chunknum, iv);
         }
 
-        // decrypt 16 KB chunk in-place
-        if (speckDecryptChunk((get_drm_song(c->song) + lenAudio - rem), cp_num, iv) != 0) {
+        if (verify_decrypt_chunk(chunk, plainChunk, chunk_len, origIv, iv, chunknum++, chunkProof) != 0) {
             mb_printf("Failed to dump song\r\n");
             c->song.wav_size = 0;
             return;
@@ -797,7 +1226,7 @@ void digital_out() {
 
         // if last chunk unpad using PKCS#7
         if (chunknum == nchunks) {
-            int pads = (int*)(get_drm_song(c->song) + lenAudio - rem)[cp_num-1];
+            int pads = (u8)plainChunk[chunk_len-1];
             // terminate if invalid padding
             if (pads <= 0 || pads > 16) {
                 mb_printf("Failed to dump song\r\n");
@@ -805,24 +1234,31 @@ void digital_out() {
                 return;
             }
             for (int i = 1; i <= pads; i++) {
-                int bite = (int*)(get_drm_song(c->song) + lenAudio - rem)[cp_num-i];
+                int bite = (u8)plainChunk[chunk_len-i];
                 if (bite != pads) {
                     mb_printf("Failed to dump song\r\n");
                     c->song.wav_size = 0;
                     return;
                 }
             }
-            wav_size -= pads;
-            file_size -= pads;
+            chunk_len -= pads;
         }
-        rem -= cp_num;
+
+        // release the verified plaintext over the ciphertext it came from; the
+        // chunks are contiguous, so the audio stays in one piece
+        cp_num = (rem > chunk_len) ? chunk_len : rem;
+        memcpy(chunk, plainChunk, cp_num);
+        c->dout_chunks = chunknum;
+        wav_size += cp_num;
+        rem = (chunknum == nchunks) ? 0 : rem - cp_num;
     } // end decrypt loop
 
-    // move WAV file up in buffer, to cover song metadata ("removing" it)
+    // leave the audio where it is, over the song's chunks, and point miPod at
+    // it instead of moving it up to cover the song metadata
     mb_printf("Preparing song (%dB)...\r\n", wav_size);
-    c->song.file_size = file_size;
+    c->song.file_size = wav_size + WAV_HEADER_SZ - 8; // RIFF size of the WAV
+    c->dout.wav_off = s.layout.audio_off;
     c->song.wav_size = wav_size;
-    memmove((char*)&c->song.mdHash, get_drm_song(c->song), c->song.wav_size);
 
     mb_printf("Song dump finished\r\n");
 } // end digital_out()
@@ -832,7 +1268,7 @@ void mb_exit() {
     if (s.logged_in) {
         mb_printf("Logging out...\r\n");
     }
-    int sz = sizeof(char) + sizeof(u8) + USERNAME_SZ + MAX_PIN_SZ + sizeof(song_md);
+    int sz = offsetof(internal_state, song_md) + sizeof(song_md);
     memset((void*)&s, 0, sz);
 }
 
@@ -866,6 +1302,17 @@ int main() {
         return XST_FAILURE;
     }
 
+#ifdef XPAR_INTC_0_AXIDMA_0_MM2S_INTROUT_VEC_ID
+    // where the PL routes the DMA interrupt, start each buffer from it
+    status = fnConfigDmaIntr(&InterruptController, &sAxiDma, XPAR_INTC_0_AXIDMA_0_MM2S_INTROUT_VEC_ID,
+                             (XInterruptHandler)dmaISR);
+    if(status != XST_SUCCESS) {
+        mb_printf("DMA interrupt configuration ERROR\r\n");
+        return XST_FAILURE;
+    }
+    dma_intr = TRUE;
+#endif
+
     // Start the LED
     enableLED(led);
     set_stopped();
@@ -924,9 +1371,10 @@ int main() {
                 break;
             }
 
-            // reset statuses and sleep to allow player to recognize WORKING state
-            usleep(500);
+            // reset statuses, then count the command done, which is what the
+            // player waits on rather than catching the WORKING state
             set_stopped();
+            c->done++;
         }
     }
     // WolfCrypt cleanup */
@@ -0,0 +1,281 @@
+/*
+ * Speck 128/256 key schedule and CBC decryption kernel
+ */
+
+// the SDK Debug configuration builds at -O0, which spills every round of the
+// cipher to the stack; keep the hot kernel optimized regardless. This is done
+// here rather than in Debug/src/subdir.mk, which the SDK regenerates
+#pragma GCC optimize ("O2")
+
+#include <string.h>
+#include "speck.h"
+
+
+#define ROTL64(x,r) (((x)<<(r)) | (x>>(64-(r))))
+#define ROTR64(x,r) (((x)>>(r)) | ((x)<<(64-(r))))
+#define ER64(x,y,k) (x=ROTR64(x,8), x+=y, x^=k, y=ROTL64(y,3), y^=x)
+#define DR64(x,y,k) (y^=x, y=ROTR64(y,3), x^=k, x-=y, x=ROTL64(x,8))
+
+/* one decryption round on a block held as a pair of 32-bit word pairs
+ * (xh:xl, yh:yl), for cores without a 64-bit datapath. the rotates are
+ * split so each output word takes one shift from each half, and the
+ * subtraction carries its borrow from the low word into the high word
+ */
+#define DR32(xh,xl,yh,yl,k) do {                            \
+        u32 kl_ = (u32)(k), kh_ = (u32)((k) >> 32), t_;     \
+        yl ^= xl; yh ^= xh;                                 \
+        t_ = (yl >> 3) | (yh << 29);                        \
+        yh = (yh >> 3) | (yl << 29); yl = t_;               \
+        xl ^= kl_; xh ^= kh_;                               \
+        xh -= yh + (xl < yl); xl -= yl;                     \
+        t_ = (xl << 8) | (xh >> 24);                        \
+        xh = (xh << 8) | (xl >> 24); xl = t_;               \
+    } while (0)
+
+// decryption rounds i, i-1, ..., i-(n-1) with the round macro DR_ROUND
+#define DR_1(i)  DR_ROUND(i)
+#define DR_2(i)  DR_1(i); DR_1((i)-1)
+#define DR_17(i) DR_2(i); DR_2((i)-2); DR_2((i)-4); DR_2((i)-6); \
+                 DR_2((i)-8); DR_2((i)-10); DR_2((i)-12); DR_2((i)-14); DR_1((i)-16)
+#define DR_34(i) DR_17(i); DR_17((i)-17)
+
+#define DR_N(n, i)  DR_##n(i)
+#define DR_UNROLLED(n, i) DR_N(n, i)
+
+#if SPECK_ROUNDS % SPECK_UNROLL != 0
+#error "SPECK_UNROLL must divide SPECK_ROUNDS"
+#endif
+
+// applies m(j, i) to every lane j of an interleaved group
+#if SPECK_LANES == 1
+#define FOR_LANES(m, i) m(0, i)
+#elif SPECK_LANES == 2
+#define FOR_LANES(m, i) m(0, i); m(1, i)
+#elif SPECK_LANES == 4
+#define FOR_LANES(m, i) m(0, i); m(1, i); m(2, i); m(3, i)
+#else
+#error "SPECK_LANES must be 1, 2 or 4"
+#endif
+
+// host builds hold the lanes of the 64-bit kernel in one GCC vector, so each
+// round is a handful of SIMD instructions; the MicroBlaze has no vector unit
+#ifndef SPECK_VECTOR
+#if defined(__GNUC__) && !defined(__MICROBLAZE__)
+#define SPECK_VECTOR 1
+#else
+#define SPECK_VECTOR 0
+#endif
+#endif
+
+
+/* expands a 256-bit Speck key into the round keys
+ *
+ * K        : key as four 64-bit words, least significant first
+ * rk       : buffer to store the round keys
+ */
+void speck_key_schedule(const u64 K[4], u64 rk[SPECK_ROUNDS]) {
+    u64 D=K[3], C=K[2], B=K[1], A=K[0];
+    int i;
+    for (i=0; i<SPECK_ROUNDS-1;) {
+        rk[i]=A; ER64(B,A,i++);
+        rk[i]=A; ER64(C,A,i++);
+        rk[i]=A; ER64(D,A,i++);
+    }
+    rk[i]=A;
+}
+
+
+/* Speck 128/256 CBC decryption of a run of blocks, on 64-bit words
+ * CBC decryption of a block only needs its own ciphertext and the one before
+ * it, so SPECK_LANES blocks go through the rounds together: their dependency
+ * chains are independent and overlap in the pipeline, and the chaining XOR is
+ * applied afterwards. the round loop is unrolled SPECK_UNROLL times and the
+ * chaining value is kept in locals across blocks. in and out may be the same
+ *
+ * rk       : round keys from speck_key_schedule()
+ * in       : pointer to the ciphertext to decrypt
+ * out      : pointer to the buffer to store the plaintext
+ * len      : length in bytes, a multiple of SPECK_BLK_SZ
+ * iv       : pointer to the initialization vector, updated to the last
+ *            ciphertext block so the next call continues the chain
+ */
+void speck_decrypt_cbc64(const u64 rk[SPECK_ROUNDS], const char* in, char* out, int len, char* iv) {
+    const u64* ct = (const u64*)in;
+    u64* pt = (u64*)out;
+    u64 iv0, iv1;
+    int n = len / SPECK_BLK_SZ;
+
+    memcpy(&iv0, iv, 8);
+    memcpy(&iv1, iv + 8, 8);
+
+#if SPECK_LANES > 1
+#if SPECK_VECTOR
+    typedef u64 lanes64 __attribute__((vector_size(8 * SPECK_LANES)));
+#define DR_ROUND(i) DR64(x, y, rk[i])
+#else
+    typedef u64 lanes64[SPECK_LANES];
+#define DR_LANE(j, i) DR64(x[j], y[j], rk[i])
+#define DR_ROUND(i) FOR_LANES(DR_LANE, i)
+#endif
+#define LOAD_LANE(j, _) (y[j] = ct[2*(j)], x[j] = ct[2*(j)+1])
+    for (; n >= SPECK_LANES; n -= SPECK_LANES, ct += 2*SPECK_LANES, pt += 2*SPECK_LANES) {
+        lanes64 x, y;
+        FOR_LANES(LOAD_LANE, 0);
+
+        for (int i = SPECK_ROUNDS-1; i >= 0; i -= SPECK_UNROLL) {
+            DR_UNROLLED(SPECK_UNROLL, i);
+        }
+
+        // chain back to front so decrypting in place never overwrites a
+        // ciphertext block before the block after it has used it
+        u64 next0 = ct[2*SPECK_LANES-2], next1 = ct[2*SPECK_LANES-1];
+        for (int j = SPECK_LANES-1; j > 0; j--) {
+            pt[2*j] = y[j] ^ ct[2*j-2];
+            pt[2*j+1] = x[j] ^ ct[2*j-1];
+        }
+        pt[0] = y[0] ^ iv0;
+        pt[1] = x[0] ^ iv1;
+        iv0 = next0;
+        iv1 = next1;
+    }
+#undef LOAD_LANE
+#undef DR_LANE
+#undef DR_ROUND
+#endif
+
+#define DR_ROUND(i) DR64(x, y, rk[i])
+    for (; n > 0; n--, ct += 2, pt += 2) {
+        u64 c0 = ct[0], c1 = ct[1];
+        u64 y = c0, x = c1;
+
+        for (int i = SPECK_ROUNDS-1; i >= 0; i -= SPECK_UNROLL) {
+            DR_UNROLLED(SPECK_UNROLL, i);
+        }
+
+        pt[0] = y ^ iv0;
+        pt[1] = x ^ iv1;
+        iv0 = c0;
+        iv1 = c1;
+    }
+#undef DR_ROUND
+
+    memcpy(iv, &iv0, 8);
+    memcpy(iv + 8, &iv1, 8);
+}
+
+
+/* Speck 128/256 CBC decryption of a run of blocks, on 32-bit words
+ * bit-exact with speck_decrypt_cbc64(); the block, the chaining value and the
+ * round key halves all live in 32-bit registers, so a 32-bit core never goes
+ * through the compiler's generic 64-bit shift and subtract sequences. blocks
+ * are interleaved SPECK_LANES at a time as in speck_decrypt_cbc64()
+ *
+ * arguments as for speck_decrypt_cbc64()
+ */
+void speck_decrypt_cbc32(const u64 rk[SPECK_ROUNDS], const char* in, char* out, int len, char* iv) {
+    const u32* ct = (const u32*)in;
+    u32* pt = (u32*)out;
+    u32 iv0, iv1, iv2, iv3;
+    int n = len / SPECK_BLK_SZ;
+
+    memcpy(&iv0, iv, 4);
+    memcpy(&iv1, iv + 4, 4);
+    memcpy(&iv2, iv + 8, 4);
+    memcpy(&iv3, iv + 12, 4);
+
+    // words are little endian: y is ct[1]:ct[0] and x is ct[3]:ct[2]
+#if SPECK_LANES > 1
+#define DR_LANE(j, i) DR32(xh[j], xl[j], yh[j], yl[j], rk[i])
+#define DR_ROUND(i) FOR_LANES(DR_LANE, i)
+#define LOAD_LANE(j, _) (yl[j] = ct[4*(j)], yh[j] = ct[4*(j)+1], \
+                         xl[j] = ct[4*(j)+2], xh[j] = ct[4*(j)+3])
+    for (; n >= SPECK_LANES; n -= SPECK_LANES, ct += 4*SPECK_LANES, pt += 4*SPECK_LANES) {
+        u32 xh[SPECK_LANES], xl[SPECK_LANES], yh[SPECK_LANES], yl[SPECK_LANES];
+        FOR_LANES(LOAD_LANE, 0);
+
+        for (int i = SPECK_ROUNDS-1; i >= 0; i -= SPECK_UNROLL) {
+            DR_UNROLLED(SPECK_UNROLL, i);
+        }
+
+        // back to front, as in speck_decrypt_cbc64()
+        u32 next0 = ct[4*SPECK_LANES-4], next1 = ct[4*SPECK_LANES-3];
+        u32 next2 = ct[4*SPECK_LANES-2], next3 = ct[4*SPECK_LANES-1];
+        for (int j = SPECK_LANES-1; j > 0; j--) {
+            pt[4*j] = yl[j] ^ ct[4*j-4];
+            pt[4*j+1] = yh[j] ^ ct[4*j-3];
+            pt[4*j+2] = xl[j] ^ ct[4*j-2];
+            pt[4*j+3] = xh[j] ^ ct[4*j-1];
+        }
+        pt[0] = yl[0] ^ iv0;
+        pt[1] = yh[0] ^ iv1;
+        pt[2] = xl[0] ^ iv2;
+        pt[3] = xh[0] ^ iv3;
+        iv0 = next0;
+        iv1 = next1;
+        iv2 = next2;
+        iv3 = next3;
+    }
+#undef LOAD_LANE
+#undef DR_LANE
+#undef DR_ROUND
+#endif
+
+#define DR_ROUND(i) DR32(xh, xl, yh, yl, rk[i])
+    for (; n > 0; n--, ct += 4, pt += 4) {
+        u32 c0 = ct[0], c1 = ct[1], c2 = ct[2], c3 = ct[3];
+        u32 yl = c0, yh = c1, xl = c2, xh = c3;
+
+        for (int i = SPECK_ROUNDS-1; i >= 0; i -= SPECK_UNROLL) {
+            DR_UNROLLED(SPECK_UNROLL, i);
+        }
+
+        pt[0] = yl ^ iv0;
+        pt[1] = yh ^ iv1;
+        pt[2] = xl ^ iv2;
+        pt[3] = xh ^ iv3;
+        iv0 = c0;
+        iv1 = c1;
+        iv2 = c2;
+        iv3 = c3;
+    }
+#undef DR_ROUND
+
+    memcpy(iv, &iv0, 4);
+    memcpy(iv + 4, &iv1, 4);
+    memcpy(iv + 8, &iv2, 4);
+    memcpy(iv + 12, &iv3, 4);
+}
+
+
+/* Speck 128/256 CBC encryption of a run of blocks
+ * only the provisioning tools encrypt; the firmware never references this, so
+ * --gc-sections keeps it out of the image. in and out may be the same
+ *
+ * rk       : round keys from speck_key_schedule()
+ * in       : pointer to the plaintext to encrypt
+ * out      : pointer to the buffer to store the ciphertext
+ * len      : length in bytes, a multiple of SPECK_BLK_SZ
+ * iv       : pointer to the initialization vector, updated to the last
+ *            ciphertext block so the next call continues the chain
+ */
+void speck_encrypt_cbc(const u64 rk[SPECK_ROUNDS], const char* in, char* out, int len, char* iv) {
+    const u64* pt = (const u64*)in;
+    u64* ct = (u64*)out;
+    u64 y, x;
+
+    memcpy(&y, iv, 8);
+    memcpy(&x, iv + 8, 8);
+
+    for (int n = len / SPECK_BLK_SZ; n > 0; n--, pt += 2, ct += 2) {
+        y ^= pt[0];
+        x ^= pt[1];
+        for (int i = 0; i < SPECK_ROUNDS; i++) {
+            ER64(x, y, rk[i]);
+        }
+        ct[0] = y;
+        ct[1] = x;
+    }
+
+    memcpy(iv, &y, 8);
+    memcpy(iv + 8, &x, 8);
+}
@@ -0,0 +1,46 @@
+#ifndef SPECK_H
+#define SPECK_H
+
+#include "xil_types.h"
+
+// Speck 128/256 parameters
+#define SPECK_BLK_SZ 16
+#define SPECK_ROUNDS 34
+
+// rounds per iteration of the decryption loop: 1, 2, 17 or 34 (fully unrolled)
+#ifndef SPECK_UNROLL
+#define SPECK_UNROLL 34
+#endif
+
+// blocks decrypted side by side: 1, 2 or 4. the MicroBlaze has registers for
+// two 32-bit-word blocks and their round key; hosts interleave four
+#ifndef SPECK_LANES
+#ifdef __MICROBLAZE__
+#define SPECK_LANES 2
+#else
+#define SPECK_LANES 4
+#endif
+#endif
+
+// word size of the decryption kernel: the MicroBlaze has a 32-bit datapath and
+// no hardware multiplier, so it runs the cipher on pairs of 32-bit words
+#ifndef SPECK_WORD32
+#ifdef __MICROBLAZE__
+#define SPECK_WORD32 1
+#else
+#define SPECK_WORD32 0
+#endif
+#endif
+
+void speck_key_schedule(const u64 K[4], u64 rk[SPECK_ROUNDS]);
+void speck_decrypt_cbc64(const u64 rk[SPECK_ROUNDS], const char* in, char* out, int len, char* iv);
+void speck_decrypt_cbc32(const u64 rk[SPECK_ROUNDS], const char* in, char* out, int len, char* iv);
+void speck_encrypt_cbc(const u64 rk[SPECK_ROUNDS], const char* in, char* out, int len, char* iv);
+
+#if SPECK_WORD32
+#define speck_decrypt_cbc speck_decrypt_cbc32
+#else
+#define speck_decrypt_cbc speck_decrypt_cbc64
+#endif
+
+#endif
@@ -103,12 +103,107 @@ u32 fnAudioPlay(XAxiDma AxiDma, u32 offset, u32 u32NrSamples)
 {
 	u32 status;
 
-	status = XAxiDma_SimpleTransfer(&AxiDma,(u32) (XPAR_MB_DMA_AXI_BRAM_CTRL_0_S_AXI_BASEADDR + offset), u32NrSamples, XAXIDMA_DMA_TO_DEVICE);
+	status = XAxiDma_SimpleTransfer(&AxiDma,(UINTPTR) (XPAR_MB_DMA_AXI_BRAM_CTRL_0_S_AXI_BASEADDR + offset), u32NrSamples, XAXIDMA_DMA_TO_DEVICE);
 
 	return status;
 
 }
 
+/******************************************************************************
+ * Queue audio in the DMA BRAM on the TX BD ring, behind whatever the DMA is
+ * still playing, and start the ring the first time. Only for a DMA with
+ * scatter-gather, set up by fnConfigDma().
+ *
+ * @param	offset is where the audio starts in the DMA BRAM.
+ * @param	u32NrSamples is the number of bytes to play.
+ *
+ * @return	XST_SUCCESS, or XST_FAILURE if no descriptor is free or the
+ *		DMA refuses the buffer.
+ *****************************************************************************/
+u32 fnAudioQueue(XAxiDma *AxiDma, u32 offset, u32 u32NrSamples)
+{
+	XAxiDma_BdRing *TxRingPtr = XAxiDma_GetTxRing(AxiDma);
+	XAxiDma_Bd *BdPtr;
+
+	if (XAxiDma_BdRingAlloc(TxRingPtr, 1, &BdPtr) != XST_SUCCESS)
+	{
+		return XST_FAILURE;
+	}
+
+	if (XAxiDma_BdSetBufAddr(BdPtr, XPAR_MB_DMA_AXI_BRAM_CTRL_0_S_AXI_BASEADDR + offset) != XST_SUCCESS ||
+	    XAxiDma_BdSetLength(BdPtr, u32NrSamples, TxRingPtr->MaxTransferLen) != XST_SUCCESS)
+	{
+		XAxiDma_BdRingUnAlloc(TxRingPtr, 1, BdPtr);
+		return XST_FAILURE;
+	}
+	// each chunk is a packet of its own
+	XAxiDma_BdSetCtrl(BdPtr, XAXIDMA_BD_CTRL_TXSOF_MASK | XAXIDMA_BD_CTRL_TXEOF_MASK);
+
+	if (XAxiDma_BdRingToHw(TxRingPtr, 1, BdPtr) != XST_SUCCESS)
+	{
+		return XST_FAILURE;
+	}
+
+	// once running, the DMA picks up new descriptors by itself
+	if (TxRingPtr->RunState != AXIDMA_CHANNEL_NOT_HALTED)
+	{
+		return XAxiDma_BdRingStart(TxRingPtr);
+	}
+
+	return XST_SUCCESS;
+}
+
+/******************************************************************************
+ * Give the descriptors the DMA has finished with back to the TX BD ring.
+ *
+ * @return	the number of descriptors the DMA has yet to finish.
+ *****************************************************************************/
+int fnAudioReclaim(XAxiDma *AxiDma)
+{
+	XAxiDma_BdRing *TxRingPtr = XAxiDma_GetTxRing(AxiDma);
+	XAxiDma_Bd *BdPtr;
+	int NumBd;
+
+	NumBd = XAxiDma_BdRingFromHw(TxRingPtr, XAXIDMA_ALL_BDS, &BdPtr);
+	if (NumBd > 0)
+	{
+		XAxiDma_BdRingFree(TxRingPtr, NumBd, BdPtr);
+	}
+
+	return XAxiDma_BdRingGetCnt(TxRingPtr) - XAxiDma_BdRingGetFreeCnt(TxRingPtr);
+}
+
+/******************************************************************************
+ * Set up the TX BD ring, DMA_NUM_SLOTS descriptors with nothing queued yet.
+ *
+ * @return	XST_SUCCESS or XST_FAILURE.
+ *****************************************************************************/
+static XStatus fnConfigDmaRing(XAxiDma *AxiDma)
+{
+	// the descriptors, which the DMA fetches over its SG port
+	static XAxiDma_Bd BdSpace[DMA_NUM_SLOTS] __attribute__((aligned(XAXIDMA_BD_MINIMUM_ALIGNMENT)));
+	XAxiDma_BdRing *TxRingPtr = XAxiDma_GetTxRing(AxiDma);
+	XAxiDma_Bd BdTemplate;
+
+	if (XAxiDma_BdRingCreate(TxRingPtr, (UINTPTR)BdSpace, (UINTPTR)BdSpace,
+				 XAXIDMA_BD_MINIMUM_ALIGNMENT, DMA_NUM_SLOTS) != XST_SUCCESS)
+	{
+		xil_printf(MB_PROMPT "Failed to create the BD ring\r\n");
+
+		return XST_FAILURE;
+	}
+
+	XAxiDma_BdClear(&BdTemplate);
+	if (XAxiDma_BdRingClone(TxRingPtr, &BdTemplate) != XST_SUCCESS)
+	{
+		xil_printf(MB_PROMPT "Failed to clone the BD ring\r\n");
+
+		return XST_FAILURE;
+	}
+
+	return XST_SUCCESS;
+}
+
 XStatus fnConfigDma(XAxiDma *AxiDma)
 {
 	int Status;
@@ -137,13 +232,39 @@ XStatus fnConfigDma(XAxiDma *AxiDma)
 		return XST_FAILURE;
 	}
 
-	//Ensures that the Scatter Gather mode is not active
+	//In Scatter Gather mode, playback goes through the TX BD ring
 	if(XAxiDma_HasSg(AxiDma))
 	{
 		xil_printf(MB_PROMPT "Device configured as SG mode\r\n");
 
+		return fnConfigDmaRing(AxiDma);
+	}
+
+	return XST_SUCCESS;
+}
+
+/******************************************************************************
+ * Connect the DMA interrupt, on input Id of the interrupt controller, to hdlr
+ * and have the DMA raise it when it finishes a transfer, or a descriptor in
+ * Scatter Gather mode, or hits an error.
+ *
+ * @return	XST_SUCCESS or XST_FAILURE.
+ *****************************************************************************/
+XStatus fnConfigDmaIntr(XIntc *XIntcInstancePtr, XAxiDma *AxiDma, u8 Id, XInterruptHandler hdlr)
+{
+	int Status;
+
+	Status = XIntc_Connect(XIntcInstancePtr, Id, hdlr, (void *)0);
+	if (Status != XST_SUCCESS)
+	{
+		xil_printf(MB_PROMPT "Failed to connect the DMA interrupt\r\n");
+
 		return XST_FAILURE;
 	}
+	XIntc_Enable(XIntcInstancePtr, Id);
+
+	XAxiDma_IntrAckIrq(AxiDma, XAXIDMA_IRQ_ALL_MASK, XAXIDMA_DMA_TO_DEVICE);
+	XAxiDma_IntrEnable(AxiDma, XAXIDMA_IRQ_IOC_MASK | XAXIDMA_IRQ_ERROR_MASK, XAXIDMA_DMA_TO_DEVICE);
 
 	return XST_SUCCESS;
 }
@@ -9,5 +9,8 @@ void setLED(u32* led, struct color c);
 int SetUpInterruptSystem(XIntc *XIntcInstancePtr, XInterruptHandler hdlr);
 u32 fnAudioPlay(XAxiDma AxiDma, u32 offset, u32 u32NrSamples);
 XStatus fnConfigDma(XAxiDma *AxiDma);
+u32 fnAudioQueue(XAxiDma *AxiDma, u32 offset, u32 u32NrSamples);
+int fnAudioReclaim(XAxiDma *AxiDma);
+XStatus fnConfigDmaIntr(XIntc *XIntcInstancePtr, XAxiDma *AxiDma, u8 Id, XInterruptHandler hdlr);
 
 #endif
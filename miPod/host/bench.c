@@ -0,0 +1,694 @@
+/*
+ * Host latency harness for the miPod driver
+ *
+ * Runs the unmodified send_command() from ../src against a simulated DRM:
+ * the command channel and the GPIO register block are ordinary files that
+ * both miPod and the simulated DRM thread map, the way miPod and the
+ * MicroBlaze share the real ones. The simulated DRM latches the interrupt
+ * line like the interrupt controller does, clears it, and acknowledges the
+ * command, so the harness measures the full round trip from send_command()
+ * to the DRM having seen the command.
+ *
+ * With -w the simulated DRM also stays WORKING for a while on every command,
+ * and the harness compares miPod's wait_for_drm() with the original busy
+ * loops on wall time and on the CPU time the waiting thread burns.
+ *
+ * With -p the simulated DRM plays a .drm file that miPod streams to it,
+ * seeking once on the way, and checks every chunk it is handed against the
+ * file; the harness reports how long the first chunk took to arrive.
+ *
+ * The self-tests also have the simulated DRM answer DIGITAL_OUT by releasing
+ * audio part way into the loaded file a chunk at a time, and check the WAV
+ * miPod writes, some of it while the DRM is still working, and play a song
+ * to its end with the next command sent straight after.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "miPod.h"
+
+// miPod internals from main.c
+extern volatile cmd_channel *c;
+extern volatile unsigned int *gpio;
+int open_channel();
+int open_gpio();
+void send_command(int cmd);
+void wait_for_drm();
+size_t load_file(char *fname, char *song_buf);
+int open_stream(char *fname, feeder *f);
+void feed_stream(feeder *f, unsigned int max);
+void stream_sleep(feeder *f, int ms);
+void digital_out(char *song_name);
+int play_song(char *song_name);
+void query_song(char *song_name);
+
+
+//////////////////////// SIMULATED DRM ////////////////////////
+
+
+static double now_us(void);
+
+
+typedef struct {
+    volatile cmd_channel *ch;
+    volatile unsigned int *gpio;
+    volatile unsigned int acks;     // commands seen so far
+    volatile char last_cmd;
+    volatile unsigned int work_us;  // how long each command keeps the DRM WORKING
+    volatile unsigned int done_us;  // how long it is STOPPED before counting it done
+    volatile int stop;
+
+    // streamed playback
+    int play_fd;                    // file miPod is streaming, to check slots against
+    unsigned int chunk_sz;          // its layout, as the DRM reads it from the header
+    unsigned int table_off;
+    unsigned int audio_off;
+    int merkle;
+    double first_chunk_us;          // when chunk 0 arrived
+    volatile unsigned int played;   // chunks taken from the stream
+    unsigned int bad;               // chunks that did not match the file
+
+    // digital_out
+    const char *dout_path;          // file miPod writes the dump to
+    unsigned int dout_off;          // where the audio is left in the song
+    unsigned int dout_size;         // its size, or 0 to fail the dump
+    unsigned int dout_chunk_sz;     // size of the chunks it is released in
+    unsigned int dout_us;           // time each chunk takes
+    unsigned int dout_early;        // audio bytes miPod had written before the last chunk
+    int dout_bad;                   // whether those were not all released audio
+} sim_drm;
+
+static sim_drm sim = { .play_fd = -1 };
+
+
+// creates a zeroed file of len bytes for a simulated device
+static int create_device(const char *path, size_t len) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1 || ftruncate(fd, len) == -1) {
+        perror(path);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+
+// maps a simulated device separately from miPod, as the DRM sees it
+static void *map_device(const char *path, size_t len) {
+    int fd = open(path, O_RDWR);
+    void *p = (fd == -1) ? MAP_FAILED : mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fd != -1) {
+        close(fd);
+    }
+    return (p == MAP_FAILED) ? NULL : p;
+}
+
+
+// whether a stream slot holds exactly what the file has for its chunk
+static int slot_matches(volatile stream_slot *slot, unsigned int enc_len) {
+    char buf[32 + MAX_CHUNK_SZ];
+    unsigned int i = slot->chunk, cs = sim.chunk_sz;
+    unsigned int len = (enc_len - i * cs > cs) ? cs : enc_len - i * cs;
+    off_t pos = sim.audio_off + (off_t)i * cs;
+
+    if (pread(sim.play_fd, buf, 32, sim.table_off + i * 32LL) != 32 ||
+        pread(sim.play_fd, buf + 32, len, pos) != len ||
+        memcmp(buf, (void*)slot->hash, 32) != 0 || memcmp(buf + 32, (void*)slot->data, len) != 0) {
+        return 0;
+    }
+
+    // a Merkle tree path needs the node paired with this chunk's on each level
+    unsigned int n = drm_nchunks(sim.ch->song.numChunks), level = 0;
+    for (int k = 0; sim.merkle && n > 1; k++, level += n, n = (n + 1) / 2, i >>= 1) {
+        if ((i ^ 1) < n &&
+            (pread(sim.play_fd, buf, 32, sim.table_off + (level + (i ^ 1)) * 32LL) != 32 ||
+             memcmp(buf, (void*)slot->path[k], 32) != 0)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/* plays a streamed song the way the DRM does: takes the chunks from the
+ * stream in order, dropping slots from before a seek, and seeks from a
+ * quarter of the way in to half way
+ */
+static void sim_play(void) {
+    volatile stream *st = &sim.ch->stream;
+    unsigned int enc_len = st->song.encAudioLen, nchunks = drm_nchunks(st->song.numChunks);
+    unsigned int chunk = 0, seek_at = nchunks / 4, seek_to = nchunks / 2;
+
+    if (drm_version(st->song.numChunks) == DRM_V2) {
+        sim.chunk_sz = 1 << st->song.ext.chunk_shift;
+        sim.table_off = st->song.ext.table_off;
+        sim.audio_off = st->song.ext.audio_off;
+        sim.merkle = st->song.ext.flags & DRM_EXT_MERKLE;
+    } else {
+        sim.merkle = 0;
+        sim.chunk_sz = CHUNK_SZ;
+        sim.audio_off = offsetof(song, ext);
+        sim.table_off = sim.audio_off + enc_len;
+    }
+
+    sim.ch->drm_state = PLAYING;
+    while (chunk < nchunks) {
+        volatile stream_slot *slot = NULL;
+        while (!slot && st->tail != st->head) {
+            slot = &st->slots[st->tail % STREAM_SLOTS];
+            if (slot->chunk != chunk) {
+                slot = NULL;
+                st->tail++;
+            }
+        }
+        if (!slot) {
+            sched_yield();
+            continue;
+        }
+
+        if (chunk == 0) {
+            sim.first_chunk_us = now_us();
+        }
+        sim.bad += !slot_matches(slot, enc_len);
+        sim.played++;
+        st->tail++;
+
+        if (++chunk == seek_at && seek_to > seek_at) {
+            chunk = seek_to;
+            st->want = chunk;
+            st->seek++;
+        }
+    }
+}
+
+
+// whether the dump file holds the first len bytes of audio after its header
+static int dout_matches(volatile char *audio, unsigned int len) {
+    char buf[4096];
+    int fd = open(sim.dout_path, O_RDONLY), ok = (fd != -1);
+
+    for (unsigned int pos = 0; ok && pos < len; pos += sizeof(buf)) {
+        unsigned int n = (len - pos < sizeof(buf)) ? len - pos : sizeof(buf);
+        ok = pread(fd, buf, n, WAV_HEADER_SZ + pos) == n && memcmp(buf, (char *)audio + pos, n) == 0;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    return ok;
+}
+
+
+/* dumps a song the way the DRM does: "decrypts" the audio where it is in the
+ * shared buffer a chunk at a time, counting the chunks released, then fills in
+ * the WAV header
+ */
+static void sim_dout(void) {
+    volatile char *audio = (volatile char *)&sim.ch->song + sim.dout_off;
+    unsigned int cs = sim.dout_chunk_sz;
+    struct stat sb;
+
+    sim.ch->dout_chunks = 0;
+    for (unsigned int pos = 0; pos < sim.dout_size; pos += cs) {
+        usleep(sim.dout_us);
+        if (pos + cs >= sim.dout_size && stat(sim.dout_path, &sb) == 0) {
+            sim.dout_early = (sb.st_size > WAV_HEADER_SZ) ? sb.st_size - WAV_HEADER_SZ : 0;
+            sim.dout_bad = sim.dout_early > pos || !dout_matches(audio, sim.dout_early);
+        }
+        for (unsigned int i = pos; i < pos + cs && i < sim.dout_size; i++) {
+            audio[i] ^= 0x5a;
+        }
+        sim.ch->dout_chunks++;
+    }
+    sim.ch->song.file_size = sim.dout_size + WAV_HEADER_SZ - 8;
+    sim.ch->dout.wav_off = sim.dout_off;
+    sim.ch->song.wav_size = sim.dout_size;
+}
+
+
+// DRM thread: waits for the interrupt line, clears it and takes the command
+static void *drm_thread(void *arg) {
+    while (!sim.stop) {
+        if (!sim.gpio[GPIO_DATA]) {
+            sched_yield();
+            continue;
+        }
+        sim.gpio[GPIO_DATA] = 0;
+        sim.ch->drm_state = WORKING;
+        sim.last_cmd = sim.ch->cmd;
+        __sync_synchronize();
+        sim.acks++;
+        if (sim.work_us) {
+            usleep(sim.work_us);
+        }
+        if (sim.last_cmd == PLAY && sim.play_fd != -1) {
+            sim_play();
+        }
+        if (sim.last_cmd == DIGITAL_OUT) {
+            sim_dout();
+        }
+        sim.ch->drm_state = STOPPED;
+        if (sim.done_us) {
+            usleep(sim.done_us);
+        }
+        sim.ch->done++;
+    }
+    return NULL;
+}
+
+
+//////////////////////// TIMING ////////////////////////
+
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double cpu_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *name, double *us, int n) {
+    double total = 0;
+    for (int i = 0; i < n; i++) {
+        total += us[i];
+    }
+    qsort(us, n, sizeof(double), cmp_double);
+    printf("%-16s min %9.2f us  median %9.2f us  p99 %9.2f us  mean %9.2f us\n",
+           name, us[0], us[n / 2], us[n * 99 / 100], total / n);
+}
+
+
+// the original trigger: two devmem processes per command. devmem itself is
+// not on the host, so a shell running `true` stands in for each one
+static void legacy_send_command(int cmd) {
+    memcpy((void*)&c->cmd, &cmd, 1);
+    system("true");
+    gpio[GPIO_DATA] = 0;
+    system("true");
+    gpio[GPIO_DATA] = 1;
+}
+
+
+// sends one command and waits until the simulated DRM has taken it
+static double round_trip(void (*send)(int), int cmd) {
+    unsigned int acks = sim.acks;
+    double t0 = now_us();
+    send(cmd);
+    while (sim.acks == acks) {
+        sched_yield();
+    }
+    return now_us() - t0;
+}
+
+
+// the original wait: spin on drm_state for the whole command
+static void spin_wait_for_drm() {
+    while (c->drm_state == STOPPED) continue;
+    while (c->drm_state == WORKING) continue;
+}
+
+
+/* times n commands that keep the DRM busy for sim.work_us each, waiting for
+ * them with wait, and reports the wall time over the DRM's own, and the CPU
+ * time the waiting thread used
+ */
+static void bench_wait(const char *name, void (*wait)(), int n) {
+    double late = 0, cpu = 0;
+
+    for (int i = 0; i < n; i++) {
+        double t0 = now_us(), c0 = cpu_us();
+        send_command(LOGOUT);
+        wait();
+        cpu += cpu_us() - c0;
+        late += now_us() - t0 - sim.work_us;
+    }
+    printf("%-16s late %9.1f us  cpu %9.1f us  (%5.1f%% of a core)\n",
+           name, late / n, cpu / n, 100 * cpu / (n * sim.work_us + late));
+}
+
+
+/* streams a song to the simulated DRM the way play_song() does, and compares
+ * the time until the DRM has the first chunk with loading the whole file as
+ * miPod used to before PLAY
+ * returns 0 if the DRM was handed every chunk it asked for, intact
+ */
+static int bench_play(char *path) {
+    unsigned int expect;
+    feeder f;
+
+    double t0 = now_us();
+    size_t size = load_file(path, (char*)&c->song);
+    double whole = now_us() - t0;
+    if (!size) {
+        return 1;
+    }
+    expect = drm_nchunks(c->song.numChunks);
+    expect -= (expect / 2 > expect / 4) ? expect / 2 - expect / 4 : 0;
+
+    if ((sim.play_fd = open(path, O_RDONLY)) == -1) {
+        perror(path);
+        return 1;
+    }
+    sim.played = sim.bad = 0;
+    unsigned int acks = sim.acks;
+    t0 = now_us();
+    if (open_stream(path, &f)) {
+        return 1;
+    }
+    feed_stream(&f, 1);
+    send_command(PLAY);
+    while (sim.acks == acks || c->drm_state != STOPPED) {
+        stream_sleep(&f, STREAM_POLL_MS);
+    }
+    close(f.fd);
+    close(sim.play_fd);
+    sim.play_fd = -1;
+
+    printf("song: %zu B, %u chunks played\n", size, sim.played);
+    printf("%-16s %9.1f us to load the whole file\n", "load_file", whole);
+    printf("%-16s %9.1f us to the first chunk\n", "stream", sim.first_chunk_us - t0);
+    if (sim.bad || sim.played != expect) {
+        printf("FAIL: %u of %u chunks did not match the file, %u expected\n",
+               sim.bad, sim.played, expect);
+        return 1;
+    }
+    return 0;
+}
+
+
+// checks that every command reaches the DRM exactly once
+static int test_send(void) {
+    int fails = 0;
+
+    for (int cmd = QUERY_PLAYER; cmd <= EXIT; cmd++) {
+        unsigned int acks = sim.acks;
+        round_trip(send_command, cmd);
+        usleep(1000);
+        if (sim.last_cmd != cmd || sim.acks != acks + 1 || gpio[GPIO_DATA] != 0) {
+            printf("FAIL: command %d: DRM saw %d after %u interrupts\n",
+                   cmd, sim.last_cmd, sim.acks - acks);
+            fails++;
+        }
+    }
+    return fails;
+}
+
+
+static void wait_timeout(int sig) {
+    static const char msg[] = "FAIL: wait_for_drm is still waiting on a command the DRM has finished\n";
+    (void)sig;
+    write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+    _exit(1);
+}
+
+
+/* checks that wait_for_drm() only returns once the command is done, and that
+ * it returns when the DRM was WORKING too briefly for miPod to see it, as when
+ * miPod is descheduled for the whole command
+ */
+static int test_wait(void) {
+    int fails = 0;
+
+    signal(SIGALRM, wait_timeout);
+    alarm(10);
+    for (int i = 0; i < 50; i++) {
+        unsigned int acks = sim.acks;
+        send_command(LOGOUT);
+        while (sim.acks == acks || c->drm_state != STOPPED) {
+            sched_yield();
+        }
+        wait_for_drm();
+    }
+    alarm(0);
+    signal(SIGALRM, SIG_DFL);
+
+    sim.work_us = 500;
+    for (int i = 0; i < 50; i++) {
+        double t0 = now_us();
+        send_command(LOGOUT);
+        wait_for_drm();
+        if (c->drm_state != STOPPED || now_us() - t0 < sim.work_us) {
+            printf("FAIL: wait_for_drm returned early on command %d\n", i);
+            fails++;
+        }
+    }
+    sim.work_us = 0;
+    return fails;
+}
+
+
+// types a newline at the playback prompt once the song has finished playing
+static void *enter_after_song(void *arg) {
+    while (sim.played == 0 || sim.ch->drm_state != STOPPED) {
+        sched_yield();
+    }
+    write(*(int *)arg, "\n", 1);
+    return NULL;
+}
+
+
+/* plays a made-up song to its end and queries a song straight after, with the
+ * DRM slow to count the song done once it has STOPPED, checking the query is
+ * not taken as done by the song finishing
+ */
+static int test_play_query(void) {
+    const char *path = UIO_DEV "_play.drm";
+    unsigned int nchunks = 8, chunk_shift = MIN_CHUNK_SHIFT;
+    unsigned int enc_len = nchunks << chunk_shift, audio_off = sizeof(song);
+    unsigned int len = audio_off + enc_len + 32 * nchunks;
+    char *file = calloc(1, len);
+    int fails = 0, in[2], saved_in = dup(STDIN_FILENO);
+    pthread_t tid;
+
+    song *hdr = (song *)file;
+    hdr->wav_size = enc_len;
+    hdr->numChunks = DRM_V2 << 24 | nchunks;
+    hdr->encAudioLen = enc_len;
+    hdr->ext.chunk_shift = chunk_shift;
+    hdr->ext.audio_off = audio_off;
+    hdr->ext.table_off = audio_off + enc_len;
+    for (unsigned int i = audio_off; i < len; i++) {
+        file[i] = rand();
+    }
+    FILE *fp = fopen(path, "wb");
+    if (!fp || fwrite(file, 1, len, fp) != len || fclose(fp) || pipe(in) == -1 ||
+        (sim.play_fd = open(path, O_RDONLY)) == -1) {
+        perror(path);
+        return 1;
+    }
+    dup2(in[0], STDIN_FILENO);
+
+    sim.done_us = 20000;
+    sim.played = sim.bad = 0;
+    unsigned int done = c->done;
+    pthread_create(&tid, NULL, enter_after_song, &in[1]);
+    play_song((char *)path);
+    pthread_join(tid, NULL);
+    close(sim.play_fd);
+    sim.play_fd = -1;
+    query_song((char *)path);
+    if (c->done != done + 2 || c->drm_state != STOPPED) {
+        printf("FAIL: query after a song returned with %u of 2 commands done\n", c->done - done);
+        fails++;
+    }
+    wait_for_drm();
+    sim.done_us = 0;
+
+    dup2(saved_in, STDIN_FILENO);
+    close(saved_in);
+    close(in[0]);
+    close(in[1]);
+    unlink(path);
+    free(file);
+    return fails;
+}
+
+
+/* has miPod dump a made-up song whose audio the DRM leaves at various offsets,
+ * checking the file holds the WAV header and then exactly that audio, and that
+ * a dump pointing outside the shared buffer writes nothing. Where the audio is
+ * where the song header says, miPod has to have written some of it before the
+ * DRM released the last chunk; elsewhere, it has to start over from there
+ */
+static int test_dout(void) {
+    static const struct { unsigned int off, size; } dumps[] = {
+        { 244, 300001 }, { 4096, 1 << 20 }, { sizeof(dout_song), 7 },
+        { MAX_SONG_SZ - 100, 100 }, { MAX_SONG_SZ - 100, 101 }, { 244, 0 },
+    };
+    const char *path = UIO_DEV "_song.drm", *dout = UIO_DEV "_song.drm.dout";
+    unsigned int len = (1 << 20) + 4096;
+    char *file = malloc(len), *want = malloc(len), *got = malloc(len + 1);
+    int fails = 0;
+
+    for (unsigned int i = 0; i < len; i++) {
+        file[i] = rand();
+    }
+    song *hdr = (song *)file;
+    hdr->numChunks = DRM_V2 << 24 | 256;
+    hdr->ext.chunk_shift = 12;
+    hdr->ext.audio_off = 244;
+    FILE *fp = fopen(path, "wb");
+    if (!fp || fwrite(file, 1, len, fp) != len || fclose(fp)) {
+        perror(path);
+        return 1;
+    }
+
+    // the DRM keeps working a while before the dump starts
+    sim.work_us = 500;
+    sim.dout_path = dout;
+    sim.dout_chunk_sz = 1 << hdr->ext.chunk_shift;
+    sim.dout_us = 200;
+    for (int k = 0; k < sizeof(dumps) / sizeof(dumps[0]); k++) {
+        unsigned int off = dumps[k].off, size = dumps[k].size;
+        int valid = size && off + size <= MAX_SONG_SZ;
+        sim.dout_off = off;
+        sim.dout_size = size;
+        sim.dout_early = 0;
+        sim.dout_bad = 0;
+        unlink(dout);
+        digital_out((char *)path);
+
+        fp = fopen(dout, "rb");
+        size_t n = fp ? fread(got, 1, len + 1, fp) : 0;
+        if (fp) {
+            fclose(fp);
+        }
+        if (!valid) {
+            if (fp) {
+                printf("FAIL: digital_out wrote a dump of %u B at %u\n", size, off);
+                fails++;
+            }
+            continue;
+        }
+
+        // the header as loaded, with the sizes the DRM filled in; audio past
+        // the file is whatever the shared buffer held, so only check the length
+        memcpy(want, file, WAV_HEADER_SZ);
+        *(unsigned int *)(want + 4) = size + WAV_HEADER_SZ - 8;
+        *(unsigned int *)(want + 40) = size;
+        unsigned int have = (off < len) ? ((len - off < size) ? len - off : size) : 0;
+        for (unsigned int i = 0; i < have; i++) {
+            want[WAV_HEADER_SZ + i] = file[off + i] ^ 0x5a;
+        }
+        if (n != WAV_HEADER_SZ + size || memcmp(got, want, WAV_HEADER_SZ + have)) {
+            printf("FAIL: digital_out of %u B at %u wrote %zu B%s\n", size, off, n,
+                   (n == WAV_HEADER_SZ + size) ? " that do not match" : "");
+            fails++;
+        }
+        if (off == hdr->ext.audio_off && size > 2 * sim.dout_chunk_sz &&
+            (sim.dout_early == 0 || sim.dout_bad)) {
+            printf("FAIL: digital_out of %u B at %u wrote %s while the DRM worked\n", size, off,
+                   sim.dout_bad ? "audio it had not released" : "nothing");
+            fails++;
+        }
+    }
+    sim.work_us = 0;
+    unlink(dout);
+    unlink(path);
+    free(file);
+    free(want);
+    free(got);
+    return fails;
+}
+
+
+//////////////////////// MAIN ////////////////////////
+
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-n iters] [-l] [-w work_us] [-p song.drm] [-t]\n"
+            "  -n  round trips per measurement (default 10000)\n"
+            "  -l  also time the original devmem-style trigger\n"
+            "  -w  time waiting on commands that keep the DRM busy this long\n"
+            "  -p  stream this song to the DRM and check what it receives\n"
+            "  -t  run the self-tests instead\n", prog);
+}
+
+
+int main(int argc, char **argv) {
+    int iters = 10000, legacy = 0, test = 0, opt, ret = 0;
+    unsigned int work_us = 0;
+    char *play_path = NULL;
+    pthread_t tid;
+
+    while ((opt = getopt(argc, argv, "n:lw:p:t")) != -1) {
+        switch (opt) {
+        case 'n': iters = atoi(optarg); break;
+        case 'l': legacy = 1; break;
+        case 'w': work_us = strtoul(optarg, NULL, 0); break;
+        case 'p': play_path = optarg; break;
+        case 't': test = 1; break;
+        default: usage(argv[0]); return 2;
+        }
+    }
+    if (iters <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (create_device(UIO_DEV, sizeof(cmd_channel)) || create_device(GPIO_DEV, GPIO_MAP_SZ) ||
+        open_channel() || open_gpio()) {
+        return 1;
+    }
+    sim.ch = map_device(UIO_DEV, sizeof(cmd_channel));
+    sim.gpio = map_device(GPIO_DEV, GPIO_MAP_SZ);
+    if (!sim.ch || !sim.gpio || pthread_create(&tid, NULL, drm_thread, NULL)) {
+        fprintf(stderr, "Error starting the simulated DRM\n");
+        return 1;
+    }
+
+    if (test) {
+        int fails = test_send() + test_wait() + test_dout() + test_play_query();
+        printf("self-tests: %s\n", fails ? "FAILED" : "passed");
+        ret = fails ? 1 : 0;
+    } else if (play_path) {
+        ret = bench_play(play_path);
+    } else if (work_us) {
+        int n = (iters < 200) ? iters : 200;
+        sim.work_us = work_us;
+        printf("DRM busy %u us per command\n", work_us);
+        bench_wait("wait_for_drm", wait_for_drm, n);
+        bench_wait("spin", spin_wait_for_drm, n);
+    } else {
+        double *us = malloc(iters * sizeof(double));
+        for (int i = 0; i < iters; i++) {
+            us[i] = round_trip(send_command, LOGOUT);
+        }
+        report("send_command", us, iters);
+        if (legacy) {
+            int n = (iters < 1000) ? iters : 1000;
+            for (int i = 0; i < n; i++) {
+                us[i] = round_trip(legacy_send_command, LOGOUT);
+            }
+            report("devmem trigger", us, n);
+        }
+        free(us);
+    }
+
+    sim.stop = 1;
+    pthread_join(tid, NULL);
+    unlink(UIO_DEV);
+    unlink(GPIO_DEV);
+    return ret;
+}
@@ -15,9 +15,14 @@
 #include <errno.h>
 #include <linux/gpio.h>
 #include <string.h>
+#include <poll.h>
+#include <stddef.h>
 
 
 volatile cmd_channel *c;
+volatile unsigned int *gpio;
+// commands the DRM had finished when the last one was sent
+unsigned int sent_done;
 
 
 //////////////////////// UTILITY FUNCTIONS ////////////////////////
@@ -26,10 +31,87 @@ volatile cmd_channel *c;
 // sends a command to the microblaze using the shared command channel and interrupt
 void send_command(int cmd) {
     memcpy((void*)&c->cmd, &cmd, 1);
+    sent_done = c->done;
+
+    // the command must be in shared memory before the interrupt is raised
+    __sync_synchronize();
 
     //trigger gpio interrupt
-    system("devmem 0x41200000 32 0");
-    system("devmem 0x41200000 32 1");
+    gpio[GPIO_DATA] = 0;
+    gpio[GPIO_DATA] = 1;
+}
+
+
+// one poll of a wait on the DRM: spins for the first DRM_SPIN_POLLS polls so
+// quick commands return at once, then sleeps, doubling the sleep each poll up
+// to max_us so long commands leave the core free but wake at most max_us late
+void backoff(unsigned int *polls, unsigned int max_us) {
+    unsigned int us;
+
+    if (*polls < DRM_SPIN_POLLS) {
+        (*polls)++;
+        return;
+    }
+    us = (*polls - DRM_SPIN_POLLS < 20) ? 1u << (*polls - DRM_SPIN_POLLS) : max_us;
+    if (us >= max_us) {
+        us = max_us;
+    } else {
+        (*polls)++;
+    }
+    usleep(us);
+}
+
+
+// returns whether the DRM has finished the last command sent
+int drm_done() {
+    return c->done != sent_done;
+}
+
+
+// waits for the DRM to finish the last command, however briefly it was WORKING
+void wait_for_drm() {
+    unsigned int polls = 0;
+
+    while (!drm_done()) backoff(&polls, DRM_DONE_WAIT_US);
+}
+
+
+// maps the shared command channel
+// returns 0 on success or -1 on error
+int open_channel() {
+    int mem = open(UIO_DEV, O_RDWR);
+    if (mem == -1) {
+        mp_printf("Failed to open %s! Error = %d\r\n", UIO_DEV, errno);
+        return -1;
+    }
+    c = mmap(NULL, sizeof(cmd_channel), PROT_READ | PROT_WRITE,
+             MAP_SHARED, mem, 0);
+    close(mem);
+    if (c == MAP_FAILED){
+        mp_printf("MMAP Failed! Error = %d\r\n", errno);
+        return -1;
+    }
+    mp_printf("Command channel open at %p (%dB)\r\n", c, sizeof(cmd_channel));
+    return 0;
+}
+
+
+// maps the AXI GPIO register block once, so raising the MicroBlaze interrupt
+// is two stores rather than two devmem processes
+// returns 0 on success or -1 on error
+int open_gpio() {
+    int mem = open(GPIO_DEV, O_RDWR | O_SYNC);
+    if (mem == -1) {
+        mp_printf("Failed to open %s! Error = %d\r\n", GPIO_DEV, errno);
+        return -1;
+    }
+    gpio = mmap(NULL, GPIO_MAP_SZ, PROT_READ | PROT_WRITE, MAP_SHARED, mem, GPIO_BASE);
+    close(mem);
+    if (gpio == MAP_FAILED) {
+        mp_printf("GPIO MMAP Failed! Error = %d\r\n", errno);
+        return -1;
+    }
+    return 0;
 }
 
 
@@ -94,6 +176,183 @@ size_t load_file(char *fname, char *song_buf) {
 }
 
 
+// loads only the header and metadata of a song into the shared buffer, which is
+// all the DRM reads to query or share it
+// returns 0 on success or -1 on error
+int load_header(char *fname) {
+    int fd = open(fname, O_RDONLY);
+    if (fd == -1){
+        mp_printf("Failed to open file! Error = %d\r\n",errno);
+        return -1;
+    }
+
+    if (read(fd, (void*)&c->song, sizeof(song)) != sizeof(song)) {
+        mp_printf("Failed to read file! Error = %d\r\n", errno);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    mp_printf("Loaded song header into shared buffer (%dB)\r\n", sizeof(song));
+    return 0;
+}
+
+
+// returns the size of the header the DRM hashes, and may have changed: up to
+// the drm_ext for v1, and through it for v2
+size_t header_sz() {
+    size_t ext_sz = c->song.ext.ext_sz;
+
+    if (drm_version(c->song.numChunks) != DRM_V2) {
+        return offsetof(song, ext);
+    }
+    return offsetof(song, ext) + ((ext_sz < sizeof(drm_ext)) ? ext_sz : sizeof(drm_ext));
+}
+
+
+// writes len bytes from buf at pos in the file, however many writes it takes
+// returns 0 on success or -1 on error
+int write_at(int fd, char *buf, size_t len, off_t pos) {
+    while (len > 0) {
+        ssize_t wrote = pwrite(fd, buf, len, pos);
+        if (wrote == -1) {
+            mp_printf("Error in writing file! Error = %d \r\n", errno);
+            return -1;
+        }
+        buf += wrote;
+        pos += wrote;
+        len -= wrote;
+    }
+    return 0;
+}
+
+
+// returns the number of hashes in the song's table: the chunk hashes, and for
+// a Merkle tree every level above them up to the root
+unsigned int table_hashes(feeder *f) {
+    unsigned int total = f->nchunks, n = f->nchunks;
+    while (f->merkle && n > 1) {
+        n = (n + 1) / 2;
+        total += n;
+    }
+    return total;
+}
+
+
+// opens a song for streaming: loads only the header and metadata into the
+// shared buffer and resets the chunk stream
+// returns 0 on success or -1 on error
+int open_stream(char *fname, feeder *f) {
+    struct stat sb;
+
+    f->fd = open(fname, O_RDONLY);
+    if (f->fd == -1){
+        mp_printf("Failed to open file! Error = %d\r\n",errno);
+        return -1;
+    }
+
+    if (fstat(f->fd, &sb) == -1 || read(f->fd, (void*)&c->song, sizeof(song)) != sizeof(song)) {
+        mp_printf("Failed to read file! Error = %d\r\n", errno);
+        close(f->fd);
+        return -1;
+    }
+
+    // v1 keeps the hashes after the audio, v2 says where both are
+    // the DRM checks the layout again, this only keeps the reads in the file
+    f->enc_len = c->song.encAudioLen;
+    f->nchunks = drm_nchunks(c->song.numChunks);
+    f->merkle = drm_version(c->song.numChunks) == DRM_V2 && (c->song.ext.flags & DRM_EXT_MERKLE);
+    f->chunk_sz = 0;
+    if (drm_version(c->song.numChunks) == DRM_V1) {
+        f->chunk_sz = CHUNK_SZ;
+        f->audio_off = offsetof(song, ext);
+        f->table_off = f->audio_off + f->enc_len;
+    } else if (drm_version(c->song.numChunks) == DRM_V2 &&
+               c->song.ext.chunk_shift >= MIN_CHUNK_SHIFT && c->song.ext.chunk_shift <= MAX_CHUNK_SHIFT) {
+        f->chunk_sz = 1 << c->song.ext.chunk_shift;
+        f->table_off = c->song.ext.table_off;
+        f->audio_off = c->song.ext.audio_off;
+    }
+    if (!f->chunk_sz || (f->merkle && f->nchunks > 1 << MERKLE_MAX_DEPTH) ||
+        f->nchunks != (f->enc_len + f->chunk_sz - 1) / f->chunk_sz ||
+        (long long)f->audio_off + f->enc_len > sb.st_size ||
+        (long long)f->table_off + 32LL * table_hashes(f) > sb.st_size) {
+        mp_printf("Malformed song file\r\n");
+        close(f->fd);
+        return -1;
+    }
+
+    f->next = f->seek = 0;
+    c->stream.head = c->stream.tail = c->stream.want = c->stream.seek = 0;
+    mp_printf("Streaming file into shared buffer (%dB)\r\n", sb.st_size);
+    return 0;
+}
+
+
+// loads up to max of the next chunks into free stream slots, continuing from
+// wherever the DRM last seeked to
+void feed_stream(feeder *f, unsigned int max) {
+    if (c->stream.seek != f->seek) {
+        f->seek = c->stream.seek;
+        f->next = c->stream.want;
+    }
+
+    for (; max && f->next < f->nchunks && c->stream.head - c->stream.tail < STREAM_SLOTS; max--) {
+        volatile stream_slot *slot = &c->stream.slots[c->stream.head % STREAM_SLOTS];
+        off_t pos = f->audio_off + (off_t)f->next * f->chunk_sz;
+        unsigned int len = (f->enc_len - f->next * f->chunk_sz > f->chunk_sz)
+                           ? f->chunk_sz : f->enc_len - f->next * f->chunk_sz;
+
+        slot->chunk = f->next;
+        if (pread(f->fd, (void*)slot->hash, 32, f->table_off + f->next * 32LL) != 32 ||
+            pread(f->fd, (void*)slot->data, len, pos) != len) {
+            mp_printf("Failed to read file! Error = %d\r\n", errno);
+            f->next = f->nchunks;
+            return;
+        }
+
+        // for a Merkle tree, the sibling on each level up to the root
+        unsigned int n = f->nchunks, j = f->next, start = 0;
+        for (int k = 0; f->merkle && n > 1; k++) {
+            if ((j ^ 1) < n &&
+                pread(f->fd, (void*)slot->path[k], 32, f->table_off + (start + (j ^ 1)) * 32LL) != 32) {
+                mp_printf("Failed to read file! Error = %d\r\n", errno);
+                f->next = f->nchunks;
+                return;
+            }
+            start += n;
+            n = (n + 1) / 2;
+            j >>= 1;
+        }
+
+        // the slot must be complete before the DRM can see it
+        __sync_synchronize();
+        c->stream.head++;
+        f->next++;
+    }
+}
+
+
+// keeps the stream topped up until there is input on stdin
+void stream_wait_input(feeder *f) {
+    struct pollfd in = { .fd = STDIN_FILENO, .events = POLLIN };
+
+    fflush(stdout);
+    do {
+        feed_stream(f, STREAM_SLOTS);
+    } while (poll(&in, 1, STREAM_POLL_MS) == 0);
+}
+
+
+// keeps the stream topped up for ms milliseconds, in place of sleeping
+void stream_sleep(feeder *f, int ms) {
+    for (int t = 0; t < ms; t += STREAM_POLL_MS) {
+        feed_stream(f, STREAM_SLOTS);
+        usleep(STREAM_POLL_MS * 1000);
+    }
+}
+
+
 //////////////////////// COMMAND FUNCTIONS ////////////////////////
 
 
@@ -108,8 +367,7 @@ void login(char *username, char *pin) {
     strncpy((void*)c->username, username, USERNAME_SZ);
     strncpy((void*)c->pin, pin, MAX_PIN_SZ);
     send_command(LOGIN);
-    while (c->drm_state == STOPPED) continue; // wait for DRM to start working
-    while (c->drm_state == WORKING) continue; // wait for DRM to finish working
+    wait_for_drm(); // wait for DRM to finish working
 }
 
 
@@ -117,8 +375,7 @@ void login(char *username, char *pin) {
 void logout() {
     // drive DRM
     send_command(LOGOUT);
-    while (c->drm_state == STOPPED) continue; // wait for DRM to start working
-    while (c->drm_state == WORKING) continue; // wait for DRM to finish working
+    wait_for_drm(); // wait for DRM to finish working
 }
 
 
@@ -127,8 +384,7 @@ void logout() {
 void query_player() {
     // drive DRM
     send_command(QUERY_PLAYER);
-    while (c->drm_state == STOPPED) continue; // wait for DRM to start working
-    while (c->drm_state == WORKING) continue; // wait for DRM to dump file
+    wait_for_drm(); // wait for DRM to dump file
 
     // print query results
     mp_printf("Queried player (%d regions, %d users)\r\n", c->query.num_regions, c->query.num_users);
@@ -152,16 +408,15 @@ void query_player() {
 
 // queries the DRM about a song
 void query_song(char *song_name) {
-    // load the song into the shared buffer
-    if (!load_file(song_name, (void*)&c->song)) {
+    // load the song header into the shared buffer
+    if (load_header(song_name)) {
         mp_printf("Failed to load song!\r\n");
         return;
     }
 
     // drive DRM
     send_command(QUERY_SONG);
-    while (c->drm_state == STOPPED) continue; // wait for DRM to start working
-    while (c->drm_state == WORKING) continue; // wait for DRM to dump file
+    wait_for_drm(); // wait for DRM to dump file
 
     // query failed
     if (c->query.num_regions == 0) {
@@ -194,16 +449,14 @@ void query_song(char *song_name) {
 // attempts to share a song with a user
 void share_song(char *song_name, char *username) {
     int fd;
-    unsigned int length;
-    ssize_t wrote, written = 0;
 
     if (!song_name || !username) {
         mp_printf("Need song name and username\r\n");
         return;
     }
 
-    // load the song into the shared buffer
-    if (!load_file(song_name, (void*)&c->song)) {
+    // load the song header into the shared buffer
+    if (load_header(song_name)) {
         mp_printf("Failed to load song!\r\n");
         return;
     }
@@ -212,12 +465,10 @@ void share_song(char *song_name, char *username) {
 
     // drive DRM
     send_command(SHARE);
-    while (c->drm_state == STOPPED) continue; // wait for DRM to start working
-    while (c->drm_state == WORKING) continue; // wait for DRM to share song
+    wait_for_drm(); // wait for DRM to share song
 
     // request was rejected if WAV length is 0
-    length = c->song.wav_size;
-    if (length == 0) {
+    if (c->song.wav_size == 0) {
         return;
     }
 
@@ -228,15 +479,12 @@ void share_song(char *song_name, char *username) {
         return;
     }
 
-    // write song dump to file
-    mp_printf("Writing song to file '%s' (%dB)\r\n", song_name, length);
-    while (written < length) {
-        wrote = write(fd, (char *)&c->song + written, length - written);
-        if (wrote == -1) {
-            mp_printf("Error in writing file! Error = %d\r\n", errno);
-            return;
-        }
-        written += wrote;
+    // the DRM only changes the metadata and its hash, so only the header goes
+    // back, over the one in the file
+    mp_printf("Writing song header to file '%s' (%dB)\r\n", song_name, header_sz());
+    if (write_at(fd, (char *)&c->song, header_sz(), 0)) {
+        close(fd);
+        return;
     }
     close(fd);
     mp_printf("Finished writing file\r\n");
@@ -244,21 +492,27 @@ void share_song(char *song_name, char *username) {
 
 
 // plays a song and enters the playback command loop
+// the song is streamed to the DRM a chunk at a time while it plays, so playback
+// starts as soon as the first chunk is loaded
 int play_song(char *song_name) {
     char usr_cmd[USR_CMD_SZ + 1], *cmd = NULL, *arg1 = NULL, *arg2 = NULL;
+    feeder f;
 
-    // load song into shared buffer
-    if (!load_file(song_name, (void*)&c->song)) {
+    // load the song header and the first chunk into the shared buffer
+    if (open_stream(song_name, &f)) {
         mp_printf("Failed to load song!\r\n");
         return 0;
     }
+    feed_stream(&f, 1);
 
     // drive the DRM
     send_command(PLAY);
-    while (c->drm_state == STOPPED) continue; // wait for DRM to start playing
-    while (c->drm_state != PLAYING) continue; // wait for DRM to start playing
+    unsigned int polls = 0;
+    // wait for DRM to start playing, or to be done if it refused the song
+    while (c->drm_state != PLAYING && !drm_done()) backoff(&polls, DRM_START_WAIT_US);
 
     if (c->song.wav_size == 0) {
+        close(f.fd);
         return 0;
     }
 
@@ -269,11 +523,15 @@ int play_song(char *song_name) {
         // get a valid command
         do {
             print_prompt_msg(song_name);
+            stream_wait_input(&f);
             fgets(usr_cmd, USR_CMD_SZ, stdin);
 
-            // exit playback loop if DRM has finished song
+            // exit playback loop if DRM has finished song, once it has
+            // counted it done so the next command does not see it finish
             if (c->drm_state == STOPPED) {
                 //mp_printf("Song finished\r\n");
+                wait_for_drm();
+                close(f.fd);
                 return 0;
             }
         } while (strlen(usr_cmd) < 2);
@@ -288,7 +546,7 @@ int play_song(char *song_name) {
             if (paused) {
                 paused = 0;
                 send_command(PLAY);
-                usleep(200000); // wait for DRM to print
+                stream_sleep(&f, 200); // wait for DRM to print
             } else {
                 mp_printf("Song must be paused.\r\n");
             }
@@ -296,7 +554,7 @@ int play_song(char *song_name) {
             if (!paused) {
                 paused = 1;
                 send_command(PAUSE);
-                usleep(200000); // wait for DRM to print
+                stream_sleep(&f, 200); // wait for DRM to print
             } else {
                 mp_printf("Song must be playing.\r\n");
             }
@@ -304,7 +562,7 @@ int play_song(char *song_name) {
             if (!paused) {
                 paused = 0;
                 send_command(STOP);
-                usleep(200000); // wait for DRM to print
+                wait_for_drm(); // wait for DRM to stop the song
                 break;
             } else {
                 mp_printf("Song must be playing.\r\n");
@@ -312,18 +570,18 @@ int play_song(char *song_name) {
         } else if (!strcmp(cmd, "restart")) {
             paused = 0;
             send_command(RESTART);
-            usleep(200000); // wait for DRM to print
+            stream_sleep(&f, 200); // wait for DRM to print
         } else if (!strcmp(cmd, "rw")) {
             if (!paused) {
                 send_command(RW);
-                usleep(200000); // wait for DRM to print
+                stream_sleep(&f, 200); // wait for DRM to print
             } else {
                 mp_printf("Song must be playing.\r\n");
             }
         } else if (!strcmp(cmd, "ff")) {
             if (!paused) {
                 send_command(FF);
-                usleep(200000); // wait for DRM to print
+                stream_sleep(&f, 200); // wait for DRM to print
             } else {
                 mp_printf("Song must be playing.\r\n");
             }
@@ -332,11 +590,13 @@ int play_song(char *song_name) {
         }
     }
 
+    close(f.fd);
     return 0;
 }
 
 
 // turns DRM song into original WAV for digital output
+// the chunks the DRM has decrypted are written out while it works on the rest
 void digital_out(char *song_name) {
     char fname[255];
 
@@ -346,37 +606,78 @@ void digital_out(char *song_name) {
         return;
     }
 
-    // drive DRM
-    send_command(DIGITAL_OUT);
-    while (c->drm_state == STOPPED) continue; // wait for DRM to start working
-    while (c->drm_state == WORKING) continue; // wait for DRM to dump file
-
-    // digital_out failed
-    if (c->song.wav_size == 0) {
-        return;
+    // where the DRM will leave the audio, found the way open_stream() does
+    // the DRM's own answer once it is done is what counts
+    unsigned int chunk_sz = 0, audio_off = 0;
+    if (drm_version(c->song.numChunks) == DRM_V1) {
+        chunk_sz = CHUNK_SZ;
+        audio_off = offsetof(song, ext);
+    } else if (drm_version(c->song.numChunks) == DRM_V2 &&
+               c->song.ext.chunk_shift >= MIN_CHUNK_SHIFT && c->song.ext.chunk_shift <= MAX_CHUNK_SHIFT) {
+        chunk_sz = 1 << c->song.ext.chunk_shift;
+        audio_off = c->song.ext.audio_off;
     }
 
-    // open digital output file
-    int written = 0, wrote, length = c->song.file_size + 8;
+    // open digital output file, the audio going after the WAV header
     sprintf(fname, "%s.dout", song_name);
-    int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC);
+    int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     if (fd == -1){
         mp_printf("Failed to open file! Error = %d\r\n", errno);
         return;
     }
 
-    // write song dump to file
-    mp_printf("Writing song to file '%s' (%dB)\r\n", fname, length);
-    while (written < length) {
-        wrote = write(fd, (char *)&c->song + written, length - written);
-        if (wrote == -1) {
-            mp_printf("Error in writing file! Error = %d \r\n", errno);
+    // drive DRM
+    c->dout_chunks = 0;
+    send_command(DIGITAL_OUT);
+    unsigned int polls = 0;
+
+    // write out each chunk once the DRM has released the one after it, as
+    // the last one it releases can end short
+    size_t written = 0, ready;
+    mp_printf("Writing song to file '%s' as it is decrypted\r\n", fname);
+    while (!drm_done()) {
+        ready = (c->dout_chunks > 1) ? (size_t)(c->dout_chunks - 1) * chunk_sz : 0;
+        if (ready <= written || audio_off + ready > MAX_SONG_SZ) {
+            backoff(&polls, DRM_DONE_WAIT_US);
+            continue;
+        }
+        if (write_at(fd, (char *)&c->song + audio_off + written, ready - written,
+                     WAV_HEADER_SZ + written)) {
+            close(fd);
+            unlink(fname);
             return;
         }
-        written += wrote;
+        written = ready;
+        polls = 0;
+    }
+
+    // digital_out failed
+    unsigned int wav_off = c->dout.wav_off, wav_size = c->song.wav_size;
+    if (wav_size == 0) {
+        close(fd);
+        unlink(fname);
+        return;
+    }
+    if (wav_off < sizeof(dout_song) || wav_off > MAX_SONG_SZ || wav_size > MAX_SONG_SZ - wav_off) {
+        mp_printf("Bad song dump!\r\n");
+        close(fd);
+        unlink(fname);
+        return;
+    }
+
+    // the rest of the audio, all of it if the DRM left it somewhere else, then
+    // the WAV header with the sizes the DRM filled in
+    if (wav_off != audio_off || written > wav_size) {
+        written = 0;
+    }
+    if (write_at(fd, (char *)&c->song + wav_off + written, wav_size - written, WAV_HEADER_SZ + written) ||
+        write_at(fd, (char *)&c->song, WAV_HEADER_SZ, 0) || ftruncate(fd, WAV_HEADER_SZ + wav_size)) {
+        close(fd);
+        unlink(fname);
+        return;
     }
     close(fd);
-    mp_printf("Finished writing file\r\n");
+    mp_printf("Finished writing file (%dB)\r\n", WAV_HEADER_SZ + wav_size);
 }
 
 // tells DRM to clear local state (effectively logs out user)
@@ -384,8 +685,7 @@ void mi_exit() {
     mp_printf("Exiting...\r\n");
     // drive DRM
     send_command(EXIT);
-    while (c->drm_state == STOPPED) continue; // wait for DRM to start working
-    while (c->drm_state == WORKING) continue; // wait for DRM to finish working
+    wait_for_drm(); // wait for DRM to finish working
 }
 
 
@@ -394,19 +694,16 @@ void mi_exit() {
 
 int main(int argc, char** argv)
 {
-    int mem;
     char usr_cmd[USR_CMD_SZ + 1], *cmd = NULL, *arg1 = NULL, *arg2 = NULL;
     memset(usr_cmd, 0, USR_CMD_SZ + 1);
 
-    // open command channel
-    mem = open("/dev/uio0", O_RDWR);
-    c = mmap(NULL, sizeof(cmd_channel), PROT_READ | PROT_WRITE,
-             MAP_SHARED, mem, 0);
-    if (c == MAP_FAILED){
-        mp_printf("MMAP Failed! Error = %d\r\n", errno);
+    // read stdin unbuffered so polling it during playback sees every line
+    setvbuf(stdin, NULL, _IONBF, 0);
+
+    // open command channel and interrupt line
+    if (open_channel() || open_gpio()) {
         return -1;
     }
-    mp_printf("Command channel open at %p (%dB)\r\n", c, sizeof(cmd_channel));
 
     // dump player information before command loop
     query_player();
@@ -446,8 +743,9 @@ int main(int argc, char** argv)
         }
     }
 
-    // unmap the command channel
+    // unmap the command channel and GPIO
     munmap((void*)c, sizeof(cmd_channel));
+    munmap((void*)gpio, GPIO_MAP_SZ);
 
     return 0;
 }
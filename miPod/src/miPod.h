@@ -12,6 +12,29 @@
 // miPod constants
 #define USR_CMD_SZ 128
 
+// devices: the shared command channel is UIO device 0, and the AXI GPIO that
+// interrupts the MicroBlaze is mapped straight from physical memory
+#ifndef UIO_DEV
+#define UIO_DEV "/dev/uio0"
+#endif
+#ifndef GPIO_DEV
+#define GPIO_DEV "/dev/mem"
+#endif
+#ifndef GPIO_BASE
+#define GPIO_BASE 0x41200000
+#endif
+#define GPIO_MAP_SZ 0x1000
+#define GPIO_DATA 0 // channel 1 data register, in 32-bit words
+
+// waiting on the DRM: polls spun before sleeping, and the longest sleep while
+// waiting for playback to start, and for a command to finish
+#define DRM_SPIN_POLLS 256
+#define DRM_START_WAIT_US 100
+#define DRM_DONE_WAIT_US 1000
+
+// how often the playback loop tops up the chunk stream while it waits
+#define STREAM_POLL_MS 10
+
 // protocol constants
 #define MAX_REGIONS 32
 #define REGION_NAME_SZ 64
@@ -20,7 +43,7 @@
 #define MAX_PIN_SZ 64
 //#define MAX_SONG_SZ (1<<25)
 #define MD_SZ 100
-#define MAX_SONG_SZ 33621768 // actual space needed for 32 MB song with our file format
+#define MAX_SONG_SZ 33686160 // actual space needed for 32 MB song with our file format
 
 // printing utility
 #define MP_PROMPT "mP> "
@@ -61,6 +84,34 @@ typedef struct __attribute__((__packed__)) {
 /* see '/ectf/mb/drm_audio_fw/src/constants.h' for detailed info on
   DRM audio file format */
 
+// format versions, kept in the top byte of numChunks
+#define DRM_V1 0
+#define DRM_V2 2
+#define drm_version(n) ((unsigned int)(n) >> 24)
+#define drm_nchunks(n) ((unsigned int)(n) & 0xffffff)
+
+// chunk sizes: fixed for v1, a power of two up to MAX_CHUNK_SZ for v2
+#define CHUNK_SZ 16000
+#define MIN_CHUNK_SHIFT 10
+#define MAX_CHUNK_SHIFT 14
+#define MAX_CHUNK_SZ (1 << MAX_CHUNK_SHIFT)
+
+// drm_ext flags
+#define DRM_EXT_MERKLE 0x01     // the table is a Merkle tree, with its root in the drm_ext
+#define MERKLE_MAX_DEPTH 16
+
+// v2 extension header, right after the metadata
+typedef struct __attribute__((__packed__)) {
+    unsigned char chunk_shift;  // log2 of the chunk size
+    unsigned char flags;
+    unsigned short ext_sz;      // DRM_EXT_SZ, or sizeof(drm_ext) with DRM_EXT_MERKLE
+    unsigned int table_off;     // file offset of the chunk hash table
+    unsigned int audio_off;     // file offset of the first encrypted chunk
+    char root[32];              // Merkle root, with DRM_EXT_MERKLE only
+} drm_ext;
+
+#define DRM_EXT_SZ 12
+
 // struct to interpret shared buffer as a drm song file
 // packing values skip over non-relevant WAV metadata
 typedef struct __attribute__((__packed__)) {
@@ -75,9 +126,56 @@ typedef struct __attribute__((__packed__)) {
     int numChunks;          // number of encrypted audio chunks
     int encAudioLen;        // length of encrypted audio
     drm_md md;              // song metadata
+    drm_ext ext;            // v2 only, audio for v1
 } song;
 
 
+// ring of chunk slots miPod streams the song through during playback
+// see '/ectf/mb/drm_audio_fw/src/constants.h' for the protocol
+#define STREAM_SLOTS 16
+
+typedef struct __attribute__((__packed__)) {
+    unsigned int chunk;     // number of the chunk in this slot
+    char hash[32];          // chunk hash from the table, without DRM_EXT_MERKLE
+    char path[MERKLE_MAX_DEPTH][32]; // with DRM_EXT_MERKLE, the sibling of the
+                            // chunk's node at each level, where it has one
+    char data[MAX_CHUNK_SZ];// encrypted chunk
+} stream_slot;
+
+typedef struct __attribute__((__packed__)) {
+    song song;              // header and metadata, as at the start of the file
+    unsigned int head;      // slots filled, written by miPod
+    unsigned int tail;      // slots consumed, written by the DRM
+    unsigned int want;      // chunk to continue from after a seek, written by the DRM
+    unsigned int seek;      // seeks requested, written by the DRM
+    stream_slot slots[STREAM_SLOTS];
+} stream;
+
+
+// miPod's side of a song being streamed
+typedef struct {
+    int fd;
+    unsigned int enc_len;
+    unsigned int nchunks;
+    unsigned int chunk_sz;
+    unsigned int table_off; // file offset of the chunk hashes
+    unsigned int audio_off; // file offset of the first chunk
+    int merkle;             // whether the table is a Merkle tree
+    unsigned int next;      // next chunk to load
+    unsigned int seek;      // DRM seek count last followed
+} feeder;
+
+
+// song dumped by digital_out: the WAV header, and where the DRM left the audio
+// see '/ectf/mb/drm_audio_fw/src/constants.h' for the protocol
+#define WAV_HEADER_SZ 44
+
+typedef struct __attribute__((__packed__)) {
+    char header[WAV_HEADER_SZ]; // the song's WAV header
+    unsigned int wav_off;   // offset of the audio from the start of the song
+} dout_song;
+
+
 // shared buffer values
 enum commands { QUERY_PLAYER, QUERY_SONG, LOGIN, LOGOUT, SHARE, PLAY, STOP, DIGITAL_OUT, PAUSE, RESTART, FF, RW, EXIT };
 enum states   { STOPPED, WORKING, PLAYING, PAUSED };
@@ -87,13 +185,17 @@ enum states   { STOPPED, WORKING, PLAYING, PAUSED };
 typedef volatile struct __attribute__((__packed__)) {
     char cmd;                   // from commands enum
     char drm_state;             // from states enum
-    char padding[2];            // unused
+    unsigned short dout_chunks; // chunks digital_out has released so far
+    unsigned int done;          // commands finished since boot, counted once STOPPED again
     char username[USERNAME_SZ]; // stores logged in or attempted username
     char pin[MAX_PIN_SZ];       // stores logged in or attempted pin
 
-    // shared buffer is either a drm song or a query
+    // shared buffer is either a drm song, a song being streamed, a song
+    // dumped by digital_out, or a query
     union {
         song song;
+        stream stream;
+        dout_song dout;
         query query;
         char buf[MAX_SONG_SZ]; // sets correct size of cmd_channel for allocation
     };
@@ -0,0 +1,138 @@
+"""
+Description: ctypes binding for the native DRM helpers in native/
+Use: imported by the song tools; build the library with make -C tools/native
+"""
+
+import ctypes
+import os
+
+_LIB_PATH = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'native', 'libdrmtools.so')
+
+try:
+    _lib = ctypes.CDLL(_LIB_PATH)
+except OSError as e:
+    raise ImportError('unable to load %s (run make -C tools/native): %s' % (_LIB_PATH, e))
+
+_lib.drm_speck_decrypt_cbc.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p,
+                                       ctypes.c_char_p, ctypes.c_uint32]
+_lib.drm_speck_decrypt_cbc.restype = ctypes.c_int
+_lib.drm_keys_size.restype = ctypes.c_uint32
+_lib.drm_keys_init.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p]
+_lib.drm_keys_init.restype = None
+_lib.drm_strerror.argtypes = [ctypes.c_int]
+_lib.drm_strerror.restype = ctypes.c_char_p
+
+
+class DrmStats(ctypes.Structure):
+    """mirrors drm_stats in native/drmtools.h"""
+    _fields_ = [('audio_bytes', ctypes.c_uint64),
+                ('out_bytes', ctypes.c_uint64),
+                ('chunks', ctypes.c_uint32),
+                ('threads', ctypes.c_uint32),
+                ('seconds', ctypes.c_double),
+                ('bad_chunk', ctypes.c_int32)]
+
+
+_lib.drm_protect_song.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p,
+                                  ctypes.c_char_p, ctypes.c_int, ctypes.c_int, ctypes.c_int,
+                                  ctypes.POINTER(DrmStats)]
+_lib.drm_protect_song.restype = ctypes.c_int
+_lib.drm_unprotect_song.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_int,
+                                    ctypes.POINTER(DrmStats)]
+_lib.drm_unprotect_song.restype = ctypes.c_int
+
+DRM_ECHUNKHASH = -9
+
+BLOCK_SZ = 16
+KEY_SZ = 32
+MD_SZ = 100
+
+# .drm file format versions, see mb/drm_audio_fw/src/constants.h
+DRM_V1 = 0
+DRM_V2 = 2
+
+# drm_ext flag: every chunk is encrypted from its own IV instead of chaining CBC across chunks
+DRM_EXT_CHUNK_IV = 0x02
+
+
+class DrmError(Exception):
+    pass
+
+
+class DrmKeys(object):
+    """device keys with the Speck key schedule expanded once, for any number of songs"""
+
+    def __init__(self, speck_key, md_key, chunk_key):
+        if len(speck_key) < KEY_SZ or len(md_key) < KEY_SZ or len(chunk_key) < KEY_SZ:
+            raise ValueError('keys must be 32 bytes')
+        self._buf = ctypes.create_string_buffer(_lib.drm_keys_size())
+        _lib.drm_keys_init(self._buf, bytes(speck_key[:KEY_SZ]), bytes(md_key[:KEY_SZ]), bytes(chunk_key[:KEY_SZ]))
+
+    @classmethod
+    def from_dir(cls, path):
+        """loads speck_key, md_key and chunk_key from the directory createDevice wrote them to"""
+        keys = []
+        for name in ('speck_key', 'md_key', 'chunk_key'):
+            with open(os.path.join(path, name), 'rb') as f:
+                keys.append(f.read(KEY_SZ))
+        return cls(*keys)
+
+
+def protect_song(keys, infile, outfile, metadata, iv, threads=0, version=DRM_V2, chunk_ivs=False):
+    """writes the protected .drm file for the WAV infile to outfile
+    The GIL is released for the whole run, so songs can be protected from several Python threads at once.
+    Args:
+        keys (DrmKeys): device keys
+        metadata (bytes): 100 bytes of song metadata from create_metadata()
+        iv (bytes): 16 byte Speck IV
+        threads (int): hash worker threads, 0 for one per spare core
+        version (int): DRM_V2, or DRM_V1 for firmware that predates it
+        chunk_ivs (bool): v2 only, derive an IV per chunk so any chunk decrypts on its own
+    Returns:
+        DrmStats for the run"""
+    if len(metadata) != MD_SZ or len(iv) != BLOCK_SZ:
+        raise ValueError('metadata must be 100 bytes and the iv 16 bytes')
+    stats = DrmStats()
+    err = _lib.drm_protect_song(keys._buf, os.fsencode(infile), os.fsencode(outfile), bytes(metadata),
+                                bytes(iv), version, DRM_EXT_CHUNK_IV if chunk_ivs else 0, threads,
+                                ctypes.byref(stats))
+    if err:
+        raise DrmError('%s: %s' % (infile, _lib.drm_strerror(err).decode()))
+    return stats
+
+
+class SpeckCBCDecryptor(object):
+    """Speck 128/256 CBC decryption with the firmware's kernel
+    The chaining value carries over between calls, like a stateful cipher object."""
+
+    def __init__(self, key, iv):
+        if len(key) != 32 or len(iv) != BLOCK_SZ:
+            raise ValueError('Speck 128/256 needs a 32 byte key and a 16 byte iv')
+        self.key = bytes(key)
+        self.iv = ctypes.create_string_buffer(bytes(iv), BLOCK_SZ)
+
+    def decrypt(self, data):
+        """decrypts data, a whole number of blocks, and returns the plaintext"""
+        if len(data) % BLOCK_SZ:
+            raise ValueError('ciphertext is not a multiple of the block size')
+        out = ctypes.create_string_buffer(len(data))
+        _lib.drm_speck_decrypt_cbc(self.key, self.iv, bytes(data), out, len(data))
+        return out.raw
+
+
+def unprotect_song(keys, infile, outfile, threads=0):
+    """checks every hash of the .drm file infile and decrypts it to the WAV outfile
+    The song is streamed a chunk at a time; chunk hashes are checked in parallel before anything is written.
+    Args:
+        keys (DrmKeys): device keys
+        threads (int): extra hash worker threads, 0 for one per spare core
+    Returns:
+        DrmStats for the run"""
+    stats = DrmStats()
+    err = _lib.drm_unprotect_song(keys._buf, os.fsencode(infile), os.fsencode(outfile), threads,
+                                  ctypes.byref(stats))
+    if err == DRM_ECHUNKHASH:
+        raise DrmError('chunk hash #%d does not match' % stats.bad_chunk)
+    if err:
+        raise DrmError('%s: %s' % (infile, _lib.drm_strerror(err).decode()))
+    return stats
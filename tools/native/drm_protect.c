@@ -0,0 +1,135 @@
+/*
+ * drm_protect: protect a song with the native pipeline
+ *
+ * Command line front end to drm_protect_song() for scripts that do not want
+ * to go through Python. Owner and regions are given as the numeric IDs from
+ * user_secrets.json and region_secrets.json; protectSong does the name
+ * lookup and calls the same library.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+
+#include "drmtools.h"
+
+#define MAX_REGIONS 32
+
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s --keys DIR --infile WAV --outfile DRM --owner-id ID --region-ids ID[,ID...]\n"
+            "          [--iv HEX] [--format 1|2] [--chunk-ivs] [--threads N]\n"
+            "  --keys        directory holding speck_key, md_key and chunk_key\n"
+            "  --owner-id    numeric id of the song owner\n"
+            "  --region-ids  comma separated numeric ids of the regions to lock to\n"
+            "  --iv          32 hex digits of Speck IV (default: random)\n"
+            "  --format      .drm file format version (default 2)\n"
+            "  --chunk-ivs   v2: derive an IV per chunk instead of chaining CBC across chunks\n"
+            "  --threads     hash worker threads (default: one per spare core)\n", prog);
+}
+
+
+// parses 2*n hex digits into out; returns 0 on success
+static int parse_hex(const char *s, u8 *out, int n) {
+    if ((int)strlen(s) != 2 * n) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        unsigned v;
+        if (sscanf(s + 2 * i, "%2x", &v) != 1) {
+            return -1;
+        }
+        out[i] = v;
+    }
+    return 0;
+}
+
+
+/* builds the metadata the same way protectSong's create_metadata() does:
+ * length, owner, region count, user count (always 0), region ids, zero pad
+ * returns 0 on success
+ */
+static int make_metadata(u8 *md, int owner, char *regions) {
+    int n = 0;
+
+    memset(md, 0, DRM_MD_SZ);
+    for (char *tok = strtok(regions, ","); tok; tok = strtok(NULL, ",")) {
+        char *end;
+        long id = strtol(tok, &end, 0);
+        if (*end || id < 0 || id > 255 || n == MAX_REGIONS) {
+            return -1;
+        }
+        md[4 + n++] = id;
+    }
+    if (n == 0 || owner < 0 || owner > 255) {
+        return -1;
+    }
+    md[0] = 4 + n;
+    md[1] = owner;
+    md[2] = n;
+    md[3] = 0;
+    return 0;
+}
+
+
+int main(int argc, char **argv) {
+    static const struct option opts[] = {
+        { "keys", required_argument, NULL, 'k' },
+        { "infile", required_argument, NULL, 'i' },
+        { "outfile", required_argument, NULL, 'o' },
+        { "owner-id", required_argument, NULL, 'u' },
+        { "region-ids", required_argument, NULL, 'r' },
+        { "iv", required_argument, NULL, 'v' },
+        { "format", required_argument, NULL, 'f' },
+        { "chunk-ivs", no_argument, NULL, 'c' },
+        { "threads", required_argument, NULL, 't' },
+        { NULL, 0, NULL, 0 },
+    };
+    const char *keys_dir = NULL, *infile = NULL, *outfile = NULL, *iv_hex = NULL;
+    char *regions = NULL;
+    int owner = -1, format = 2, flags = 0, threads = 0, opt, err;
+    u8 md[DRM_MD_SZ], iv[DRM_IV_SZ];
+    drm_keys keys;
+    drm_stats st;
+
+    while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'k': keys_dir = optarg; break;
+        case 'i': infile = optarg; break;
+        case 'o': outfile = optarg; break;
+        case 'u': owner = atoi(optarg); break;
+        case 'r': regions = optarg; break;
+        case 'v': iv_hex = optarg; break;
+        case 'f': format = atoi(optarg); break;
+        case 'c': flags = DRM_EXT_CHUNK_IV; break;
+        case 't': threads = atoi(optarg); break;
+        default: usage(argv[0]); return 2;
+        }
+    }
+    if (!keys_dir || !infile || !outfile || !regions || make_metadata(md, owner, regions) ||
+        (format != 1 && format != 2) || (flags && format != 2)) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (iv_hex ? parse_hex(iv_hex, iv, DRM_IV_SZ) : getrandom(iv, DRM_IV_SZ, 0) != DRM_IV_SZ) {
+        fprintf(stderr, "Unable to set up the IV\n");
+        return 2;
+    }
+
+    if ((err = drm_keys_load(&keys, keys_dir))) {
+        fprintf(stderr, "Unable to load keys from %s: %s\n", keys_dir, drm_strerror(err));
+        return 1;
+    }
+    if ((err = drm_protect_song(&keys, infile, outfile, md, iv,
+                                (format == 2) ? DRM_V2 : DRM_V1, flags, threads, &st))) {
+        fprintf(stderr, "Unable to protect %s: %s\n", infile, drm_strerror(err));
+        return 1;
+    }
+    printf("%s: %llu B audio, %u chunks, %.3f s, %.1f MB/s\n", outfile,
+           (unsigned long long)st.audio_bytes, st.chunks, st.seconds,
+           st.audio_bytes / st.seconds / 1e6);
+    return 0;
+}
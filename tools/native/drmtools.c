@@ -0,0 +1,174 @@
+/*
+ * C entry points for drmtools.py
+ *
+ * Thin wrappers that give the Python tools the firmware's Speck kernel with
+ * byte-buffer arguments, plus the key handling shared by the native tools.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "blake3.h"
+#include "drmtools.h"
+
+
+/* Speck 128/256 CBC decryption, as done by the DRM
+ *
+ * key      : 32-byte Speck key, as stored in the speck_key file
+ * iv       : 16-byte initialization vector, updated to the last ciphertext
+ *            block so consecutive calls continue the chain
+ * in       : ciphertext
+ * out      : buffer for the plaintext, may be the same as in
+ * len      : length in bytes, a multiple of SPECK_BLK_SZ
+ * returns 0 on success, -1 if len is not a whole number of blocks
+ */
+int drm_speck_decrypt_cbc(const u8 *key, u8 *iv, const u8 *in, u8 *out, u32 len) {
+    u64 K[4], rk[SPECK_ROUNDS];
+
+    if (len % SPECK_BLK_SZ) {
+        return -1;
+    }
+    memcpy(K, key, sizeof(K));
+    speck_key_schedule(K, rk);
+    speck_decrypt_cbc(rk, (const char *)in, (char *)out, len, (char *)iv);
+    return 0;
+}
+
+
+// lets the Python binding allocate a drm_keys without knowing its layout
+u32 drm_keys_size(void) {
+    return sizeof(drm_keys);
+}
+
+
+/* fills a drm_keys from the three raw 32-byte keys, expanding the Speck key
+ * schedule once so it can be shared by any number of songs
+ */
+void drm_keys_init(drm_keys *k, const u8 *speck_key, const u8 *md_key, const u8 *chunk_key) {
+    u64 K[4];
+
+    memcpy(K, speck_key, sizeof(K));
+    speck_key_schedule(K, k->rk);
+    memcpy(k->md_key, md_key, DRM_KEY_SZ);
+    memcpy(k->chunk_key, chunk_key, DRM_KEY_SZ);
+}
+
+
+// reads exactly DRM_KEY_SZ bytes of the key file dir/name into key
+static int read_key(const char *dir, const char *name, u8 *key) {
+    char path[4096];
+    FILE *f;
+    int ok;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (!(f = fopen(path, "rb"))) {
+        return DRM_EOPEN;
+    }
+    ok = fread(key, 1, DRM_KEY_SZ, f) == DRM_KEY_SZ;
+    fclose(f);
+    return ok ? DRM_OK : DRM_EREAD;
+}
+
+
+/* loads speck_key, md_key and chunk_key from the directory createDevice
+ * wrote them to
+ * returns 0 on success or a drm_errors code
+ */
+int drm_keys_load(drm_keys *k, const char *dir) {
+    u8 speck_key[DRM_KEY_SZ], md_key[DRM_KEY_SZ], chunk_key[DRM_KEY_SZ];
+    int err;
+
+    if ((err = read_key(dir, "speck_key", speck_key)) ||
+        (err = read_key(dir, "md_key", md_key)) ||
+        (err = read_key(dir, "chunk_key", chunk_key))) {
+        return err;
+    }
+    drm_keys_init(k, speck_key, md_key, chunk_key);
+    memset(speck_key, 0, sizeof(speck_key));
+    return DRM_OK;
+}
+
+
+// number of nodes in a Merkle tree over n chunk hashes, the chunk hashes included
+u32 drm_merkle_nodes(u32 n) {
+    u32 total = n;
+    while (n > 1) {
+        n = (n + 1) / 2;
+        total += n;
+    }
+    return total;
+}
+
+
+/* fills in the levels of the Merkle tree above the n chunk hashes at the
+ * start of table, as in mb/drm_audio_fw/src/constants.h: each node is the
+ * keyed Blake3 of 0x01 and its two children, and the last node of an odd
+ * level moves up unchanged. table must have room for drm_merkle_nodes(n)
+ * returns the root, the last hash of the table
+ */
+u8 *drm_merkle_build(const drm_keys *k, u8 *table, u32 n) {
+    const u8 tag = 0x01;
+    u8 *level = table;
+
+    while (n > 1) {
+        u8 *up = level + (size_t)n * DRM_HASH_SZ;
+        for (u32 j = 0; j < n; j += 2) {
+            if (j + 1 < n) {
+                blake3_hasher h;
+                blake3_hasher_init_keyed(&h, k->chunk_key);
+                blake3_hasher_update(&h, &tag, 1);
+                blake3_hasher_update(&h, level + (size_t)j * DRM_HASH_SZ, 2 * DRM_HASH_SZ);
+                blake3_hasher_finalize(&h, up + (size_t)j / 2 * DRM_HASH_SZ, DRM_HASH_SZ);
+            } else {
+                memcpy(up + (size_t)j / 2 * DRM_HASH_SZ, level + (size_t)j * DRM_HASH_SZ, DRM_HASH_SZ);
+            }
+        }
+        level = up;
+        n = (n + 1) / 2;
+    }
+    return level;
+}
+
+
+/* derives the IV chunk i of a DRM_EXT_CHUNK_IV song is encrypted from, as in
+ * mb/drm_audio_fw/src/constants.h: the first DRM_IV_SZ bytes of the Blake3
+ * hash of the song IV and i as a 32-bit little-endian
+ */
+void drm_chunk_iv(const u8 *iv, u32 i, u8 *out) {
+    u8 num[4], hash[DRM_HASH_SZ];
+    blake3_hasher h;
+
+    put_u32(num, i);
+    blake3_hasher_init(&h);
+    blake3_hasher_update(&h, iv, DRM_IV_SZ);
+    blake3_hasher_update(&h, num, sizeof(num));
+    blake3_hasher_finalize(&h, hash, DRM_HASH_SZ);
+    memcpy(out, hash, DRM_IV_SZ);
+}
+
+
+// monotonic wall clock for the run statistics
+double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+const char *drm_strerror(int err) {
+    switch (err) {
+    case DRM_OK:        return "success";
+    case DRM_EOPEN:     return "unable to open file";
+    case DRM_EREAD:     return "read error";
+    case DRM_EWRITE:    return "write error";
+    case DRM_EFORMAT:   return "malformed WAV or .drm file";
+    case DRM_ETOOBIG:   return "song too large";
+    case DRM_ENOMEM:    return "out of memory";
+    case DRM_EARG:      return "invalid argument";
+    case DRM_EMDHASH:   return "metadata hash does not match";
+    case DRM_ECHUNKHASH: return "chunk hash does not match";
+    case DRM_EPAD:      return "bad padding";
+    case DRM_EMERKLE:   return "hash tree does not match its root";
+    default:            return "unknown error";
+    }
+}
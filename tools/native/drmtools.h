@@ -0,0 +1,107 @@
+/*
+ * Native helpers for the provisioning tools
+ *
+ * The Speck kernel is the firmware's own (mb/drm_audio_fw/src/speck.c); this
+ * library adds the host-side song protection pipeline around it. Everything
+ * here is exported from libdrmtools.so for drmtools.py as well as used by the
+ * drm_protect command line tool.
+ */
+
+#ifndef DRMTOOLS_H
+#define DRMTOOLS_H
+
+#include <stdio.h>
+#include "xil_types.h"
+#include "speck.h"
+
+// .drm format constants, as in mb/drm_audio_fw/src/constants.h
+#define DRM_CHUNK_SZ 16000          // v1 chunk size
+#define DRM_MIN_CHUNK_SHIFT 10
+#define DRM_MAX_CHUNK_SHIFT 14
+#define DRM_MAX_CHUNK_SZ (1 << DRM_MAX_CHUNK_SHIFT)
+#define DRM_MD_SZ 100
+#define DRM_EXT_SZ 12               // v2 drm_ext: shift, flags, ext_sz, table_off, audio_off
+#define DRM_EXT_MERKLE 0x01         // drm_ext flag: the table is a Merkle tree
+#define DRM_EXT_CHUNK_IV 0x02       // drm_ext flag: every chunk has its own derived IV
+#define DRM_EXT_MERKLE_SZ (DRM_EXT_SZ + DRM_HASH_SZ) // drm_ext with the Merkle root
+#define DRM_MERKLE_MAX_DEPTH 16
+#define DRM_LINE_SZ 64              // v2 audio alignment
+#define DRM_V1 0
+#define DRM_V2 2
+#define DRM_KEY_SZ 32
+#define DRM_IV_SZ 16
+#define DRM_HASH_SZ 32
+
+// error codes returned by the library, see drm_strerror()
+enum drm_errors {
+    DRM_OK = 0,
+    DRM_EOPEN = -1,     // could not open an input or output file
+    DRM_EREAD = -2,     // read error or short file
+    DRM_EWRITE = -3,    // write error
+    DRM_EFORMAT = -4,   // input is not a PCM WAV file or a well-formed .drm
+    DRM_ETOOBIG = -5,   // song does not fit the 32-bit length fields
+    DRM_ENOMEM = -6,    // out of memory or threads
+    DRM_EARG = -7,      // bad argument
+    DRM_EMDHASH = -8,   // metadata hash does not match
+    DRM_ECHUNKHASH = -9,// a chunk hash does not match, see drm_stats.bad_chunk
+    DRM_EPAD = -10,     // bad padding on the decrypted audio
+    DRM_EMERKLE = -11,  // the Merkle tree does not match its root
+};
+
+
+// device keys with the Speck key schedule already expanded
+typedef struct {
+    u64 rk[SPECK_ROUNDS];
+    u8 md_key[DRM_KEY_SZ];
+    u8 chunk_key[DRM_KEY_SZ];
+} drm_keys;
+
+
+// what one protect or unprotect run did
+typedef struct {
+    u64 audio_bytes;    // bytes of PCM audio read or written
+    u64 out_bytes;      // size of the file written
+    u32 chunks;         // encrypted audio chunks
+    u32 threads;        // hash workers used
+    double seconds;     // wall time of the whole run
+    s32 bad_chunk;      // first chunk whose hash did not match, or -1
+} drm_stats;
+
+
+// format of a WAV file as python's wave module sees it
+typedef struct {
+    u16 nchannels;
+    u16 sampwidth;
+    u32 framerate;
+    u64 data_len;       // bytes readframes(getnframes()) returns
+} wav_info;
+
+#define WAV_HDR_SZ 44
+
+
+int drm_speck_decrypt_cbc(const u8 *key, u8 *iv, const u8 *in, u8 *out, u32 len);
+
+u32 drm_keys_size(void);
+void drm_keys_init(drm_keys *k, const u8 *speck_key, const u8 *md_key, const u8 *chunk_key);
+int drm_keys_load(drm_keys *k, const char *dir);
+
+int drm_protect_song(const drm_keys *k, const char *infile, const char *outfile,
+                     const u8 *md, const u8 *iv, int version, int flags, int threads, drm_stats *st);
+int drm_unprotect_song(const drm_keys *k, const char *infile, const char *outfile,
+                       int threads, drm_stats *st);
+
+u32 drm_merkle_nodes(u32 n);
+u8 *drm_merkle_build(const drm_keys *k, u8 *table, u32 n);
+void drm_chunk_iv(const u8 *iv, u32 i, u8 *out);
+
+u32 get_u32(const u8 *p);
+u16 get_u16(const u8 *p);
+void put_u32(u8 *p, u32 v);
+void put_u16(u8 *p, u16 v);
+int wav_open(FILE *f, wav_info *w);
+void wav_header(u8 *p, const wav_info *w, u32 data_len);
+
+const char *drm_strerror(int err);
+double now_sec(void);
+
+#endif /* DRMTOOLS_H */
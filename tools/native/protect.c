@@ -0,0 +1,355 @@
+/*
+ * Native song protection pipeline
+ *
+ * For v1, produces the same .drm file as the original Python protectSong for
+ * a given IV: the WAV header python's wave module writes, the metadata hash,
+ * IV, counts and metadata, the Speck CBC encrypted PKCS#7 padded audio, then
+ * the keyed Blake3 hash of every CHUNK_SZ chunk. v2 adds the drm_ext after
+ * the metadata and moves the hash table in front of the audio, as a Merkle
+ * tree over the chunk hashes with its root in the drm_ext. The root is only
+ * known once every chunk is hashed, so the metadata hash, the root and the
+ * tree are written as zeros first and filled in at the end. With
+ * DRM_EXT_CHUNK_IV, the CBC chain restarts at every chunk from an IV derived
+ * from the song IV and the chunk number, so any chunk decrypts on its own.
+ *
+ * CBC encryption is inherently serial, so the calling thread reads and
+ * encrypts one chunk at a time. Each finished chunk is handed to a pool of
+ * hash workers and to a single writer thread through a small ring of chunk
+ * slots; a slot is reused once it has been both hashed and written. The
+ * whole song is never held in memory.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blake3.h"
+#include "drmtools.h"
+
+#define IO_BUF_SZ (1 << 20)
+#define MAX_WORKERS 64
+
+
+//////////////////////// PIPELINE ////////////////////////
+
+
+typedef struct {
+    u8 buf[DRM_MAX_CHUNK_SZ];
+    u32 len;
+    int refs;           // outstanding hash and write; 0 when the slot is free
+} slot;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    slot *slots;
+    u32 nslots;
+    u32 nchunks;
+    u32 chunk_sz;
+    u32 encrypted;      // chunks [0, encrypted) are ready to hash and write
+    int chunk_ivs;      // DRM_EXT_CHUNK_IV: every chunk starts its own chain
+    u32 next_hash;      // next chunk a hash worker should take
+    int err;
+
+    const drm_keys *keys;
+    const u8 *iv;       // original IV, part of every chunk hash
+    u8 *hashes;
+    FILE *out;
+} pipeline;
+
+
+// drops one reference to chunk i's slot and wakes anyone waiting on it
+static void release(pipeline *p, u32 i) {
+    pthread_mutex_lock(&p->lock);
+    p->slots[i % p->nslots].refs--;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+
+static void fail(pipeline *p, int err) {
+    pthread_mutex_lock(&p->lock);
+    if (!p->err) {
+        p->err = err;
+    }
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+
+// hash worker: keyed Blake3 over chunk || iv for chunks as they are encrypted
+static void *hash_worker(void *arg) {
+    pipeline *p = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (!p->err && p->next_hash < p->nchunks && p->next_hash >= p->encrypted) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if (p->err || p->next_hash == p->nchunks) {
+            pthread_mutex_unlock(&p->lock);
+            return NULL;
+        }
+        u32 i = p->next_hash++;
+        pthread_mutex_unlock(&p->lock);
+
+        slot *sl = &p->slots[i % p->nslots];
+        blake3_hasher h;
+        blake3_hasher_init_keyed(&h, p->keys->chunk_key);
+        blake3_hasher_update(&h, sl->buf, sl->len);
+        blake3_hasher_update(&h, p->iv, DRM_IV_SZ);
+        blake3_hasher_finalize(&h, p->hashes + i * DRM_HASH_SZ, DRM_HASH_SZ);
+        release(p, i);
+    }
+}
+
+
+// writer: appends the encrypted chunks to the output in order
+static void *writer(void *arg) {
+    pipeline *p = arg;
+
+    for (u32 i = 0; i < p->nchunks; i++) {
+        pthread_mutex_lock(&p->lock);
+        while (!p->err && i >= p->encrypted) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        int err = p->err;
+        pthread_mutex_unlock(&p->lock);
+        if (err) {
+            return NULL;
+        }
+
+        slot *sl = &p->slots[i % p->nslots];
+        if (fwrite(sl->buf, 1, sl->len, p->out) != sl->len) {
+            fail(p, DRM_EWRITE);
+            return NULL;
+        }
+        release(p, i);
+    }
+    return NULL;
+}
+
+
+/* reads, pads and encrypts every chunk of audio into the ring, in order
+ * returns 0 on success or a drm_errors code
+ */
+static int encrypt_chunks(pipeline *p, FILE *in, u64 audio_len, u64 enc_len) {
+    char chain[DRM_IV_SZ];
+    u64 pos = 0;
+
+    memcpy(chain, p->iv, DRM_IV_SZ);
+    for (u32 i = 0; i < p->nchunks; i++, pos += p->chunk_sz) {
+        slot *sl = &p->slots[i % p->nslots];
+
+        pthread_mutex_lock(&p->lock);
+        while (!p->err && sl->refs) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        int err = p->err;
+        pthread_mutex_unlock(&p->lock);
+        if (err) {
+            return err;
+        }
+
+        u32 len = (enc_len - pos > p->chunk_sz) ? p->chunk_sz : enc_len - pos;
+        u32 have = (audio_len > pos) ? ((audio_len - pos < len) ? audio_len - pos : len) : 0;
+        if (fread(sl->buf, 1, have, in) != have) {
+            return DRM_EREAD;
+        }
+        // PKCS#7: the last chunk ends with enc_len - audio_len bytes of that value
+        memset(sl->buf + have, (u8)(enc_len - audio_len), len - have);
+        if (p->chunk_ivs) {
+            drm_chunk_iv(p->iv, i, (u8 *)chain);
+        }
+        speck_encrypt_cbc(p->keys->rk, (char *)sl->buf, (char *)sl->buf, len, chain);
+        sl->len = len;
+        sl->refs = 2;
+
+        pthread_mutex_lock(&p->lock);
+        p->encrypted = i + 1;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return DRM_OK;
+}
+
+
+/* protects one song
+ *
+ * k        : device keys from drm_keys_init() or drm_keys_load()
+ * infile   : PCM WAV to protect
+ * outfile  : path of the .drm file to write
+ * md       : DRM_MD_SZ bytes of song metadata, as built by protectSong
+ * iv       : DRM_IV_SZ byte Speck IV; the output is fully determined by it
+ * version  : DRM_V1, or DRM_V2 with the largest chunks
+ * flags    : DRM_EXT_CHUNK_IV for a derived IV per chunk, v2 only, or 0
+ * threads  : number of hash workers, or 0 for one per spare core
+ * st       : if not NULL, filled in with what the run did
+ * returns 0 on success or a drm_errors code; a partial outfile is removed
+ */
+int drm_protect_song(const drm_keys *k, const char *infile, const char *outfile,
+                     const u8 *md, const u8 *iv, int version, int flags, int threads, drm_stats *st) {
+    double t0 = now_sec();
+    pipeline p = { .keys = k, .iv = iv, .chunk_ivs = flags & DRM_EXT_CHUNK_IV };
+    pthread_t tids[MAX_WORKERS + 1];
+    int started = 0, err;
+    FILE *in, *out = NULL;
+    char *inbuf = NULL, *outbuf = NULL;
+    wav_info w = { 0 };
+
+    if ((version != DRM_V1 && version != DRM_V2) ||
+        (flags & ~DRM_EXT_CHUNK_IV) || (flags && version != DRM_V2)) {
+        return DRM_EARG;
+    }
+    if (threads <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (n > 1) ? n - 1 : 1;
+    }
+    if (threads > MAX_WORKERS) {
+        threads = MAX_WORKERS;
+    }
+
+    if (!(in = fopen(infile, "rb"))) {
+        return DRM_EOPEN;
+    }
+    if ((err = wav_open(in, &w))) {
+        fclose(in);
+        return err;
+    }
+
+    u64 audio_len = w.data_len;
+    u64 enc_len = (audio_len / SPECK_BLK_SZ + 1) * SPECK_BLK_SZ;
+    u32 chunk_sz = (version == DRM_V2) ? DRM_MAX_CHUNK_SZ : DRM_CHUNK_SZ;
+    u64 nchunks = (enc_len + chunk_sz - 1) / chunk_sz;
+    if (version == DRM_V2 && nchunks > 1 << DRM_MERKLE_MAX_DEPTH) {
+        fclose(in);
+        return DRM_ETOOBIG;
+    }
+    u64 table_len = ((version == DRM_V2) ? drm_merkle_nodes(nchunks) : nchunks) * DRM_HASH_SZ;
+    u32 ext_len = (version == DRM_V2) ? DRM_EXT_MERKLE_SZ : 0;
+    u64 md_end = WAV_HDR_SZ + DRM_HASH_SZ + DRM_IV_SZ + 8 + DRM_MD_SZ;
+    u64 table_off = (version == DRM_V2) ? md_end + ext_len : md_end + enc_len;
+    u64 audio_off = (version == DRM_V2)
+        ? (table_off + table_len + DRM_LINE_SZ - 1) & ~(u64)(DRM_LINE_SZ - 1) : md_end;
+    u64 data_len = ((version == DRM_V2) ? audio_off + enc_len : table_off + table_len) - WAV_HDR_SZ;
+    if (36 + data_len > 0xffffffffULL) {
+        fclose(in);
+        return DRM_ETOOBIG;
+    }
+
+    p.nchunks = nchunks;
+    p.chunk_sz = chunk_sz;
+    p.nslots = 2 * threads + 2;
+    p.slots = calloc(p.nslots, sizeof(slot));
+    p.hashes = malloc(table_len);
+    inbuf = malloc(IO_BUF_SZ);
+    outbuf = malloc(IO_BUF_SZ);
+    if (!p.slots || !p.hashes || !inbuf || !outbuf) {
+        err = DRM_ENOMEM;
+        goto done;
+    }
+    setvbuf(in, inbuf, _IOFBF, IO_BUF_SZ);
+
+    if (!(out = fopen(outfile, "wb"))) {
+        err = DRM_EOPEN;
+        goto done;
+    }
+    setvbuf(out, outbuf, _IOFBF, IO_BUF_SZ);
+
+    // for v1, everything up to the audio is known before encrypting anything
+    u8 hdr[WAV_HDR_SZ + DRM_HASH_SZ + DRM_IV_SZ + 8];
+    u8 *md_hash = hdr + WAV_HDR_SZ;
+    u8 *counts = hdr + WAV_HDR_SZ + DRM_HASH_SZ + DRM_IV_SZ;
+    u8 ext[DRM_EXT_MERKLE_SZ] = { DRM_MAX_CHUNK_SHIFT, DRM_EXT_MERKLE | flags };
+    blake3_hasher h;
+
+    wav_header(hdr, &w, data_len);
+    memcpy(hdr + WAV_HDR_SZ + DRM_HASH_SZ, iv, DRM_IV_SZ);
+    put_u32(counts, (u32)version << 24 | nchunks);
+    put_u32(counts + 4, enc_len);
+    put_u16(ext + 2, DRM_EXT_MERKLE_SZ);
+    put_u32(ext + 4, table_off);
+    put_u32(ext + 8, audio_off);
+    blake3_hasher_init_keyed(&h, k->md_key);
+    blake3_hasher_update(&h, iv, DRM_IV_SZ);
+    blake3_hasher_update(&h, counts, 8);
+    blake3_hasher_update(&h, md, DRM_MD_SZ);
+    if (version == DRM_V1) {
+        blake3_hasher_finalize(&h, md_hash, DRM_HASH_SZ);
+    }
+    if (fwrite(hdr, 1, sizeof(hdr), out) != sizeof(hdr) ||
+        fwrite(md, 1, DRM_MD_SZ, out) != DRM_MD_SZ ||
+        fwrite(ext, 1, ext_len, out) != ext_len) {
+        err = DRM_EWRITE;
+        goto done;
+    }
+    // v2: room for the hash table and the alignment before the audio
+    for (u64 n = (version == DRM_V2) ? audio_off - table_off : 0; n; n--) {
+        if (putc(0, out) == EOF) {
+            err = DRM_EWRITE;
+            goto done;
+        }
+    }
+
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+    p.out = out;
+    if (pthread_create(&tids[started], NULL, writer, &p) == 0) {
+        started++;
+    }
+    for (int i = 0; started && i < threads; i++) {
+        if (pthread_create(&tids[started], NULL, hash_worker, &p) == 0) {
+            started++;
+        }
+    }
+
+    err = (started > 1) ? encrypt_chunks(&p, in, audio_len, enc_len) : DRM_ENOMEM;
+    if (err) {
+        fail(&p, err);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    err = err ? err : p.err;
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+
+    // v2: the tree gives the root, which completes the metadata hash
+    if (!err && version == DRM_V2) {
+        memcpy(ext + DRM_EXT_SZ, drm_merkle_build(k, p.hashes, nchunks), DRM_HASH_SZ);
+        blake3_hasher_update(&h, ext, ext_len);
+        blake3_hasher_finalize(&h, md_hash, DRM_HASH_SZ);
+        if (fseeko(out, WAV_HDR_SZ, SEEK_SET) || fwrite(md_hash, 1, DRM_HASH_SZ, out) != DRM_HASH_SZ ||
+            fseeko(out, md_end, SEEK_SET) || fwrite(ext, 1, ext_len, out) != ext_len) {
+            err = DRM_EWRITE;
+        }
+    }
+    if (!err && (fseeko(out, table_off, SEEK_SET) || fwrite(p.hashes, 1, table_len, out) != table_len)) {
+        err = DRM_EWRITE;
+    }
+
+done:
+    if (out && fclose(out) && !err) {
+        err = DRM_EWRITE;
+    }
+    if (out && err) {
+        unlink(outfile);
+    }
+    fclose(in);
+    free(p.slots);
+    free(p.hashes);
+    free(inbuf);
+    free(outbuf);
+
+    if (st) {
+        st->audio_bytes = audio_len;
+        st->out_bytes = WAV_HDR_SZ + data_len;
+        st->chunks = nchunks;
+        st->threads = threads;
+        st->seconds = now_sec() - t0;
+        st->bad_chunk = -1;
+    }
+    return err;
+}
@@ -0,0 +1,345 @@
+/*
+ * Native streaming song unprotection
+ *
+ * Checks and decrypts a .drm file with memory bounded by a few chunks per
+ * thread instead of the size of the song:
+ *
+ *   1. the metadata hash over IV, counts, metadata and, for v2, the drm_ext
+ *   2. every chunk hash, in parallel: each worker preads its own chunks
+ *   3. the padding, by decrypting only the last block, so the output length
+ *      and WAV header are known up front
+ *   4. one sequential pass that reads, decrypts and writes a chunk at a time
+ *
+ * The output matches what the Python unprotectSong wrote. Both file format
+ * versions are read; v2 gives the chunk size and where the hash table and the
+ * audio are in its drm_ext. A v2 Merkle tree is rebuilt from the chunk hashes
+ * and must match the table and the root, so that every node the DRM could be
+ * handed is checked as well. With DRM_EXT_CHUNK_IV, each chunk is decrypted
+ * from its own derived IV instead of the end of the chunk before it.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blake3.h"
+#include "drmtools.h"
+
+#define DRM_PREFIX_SZ (DRM_HASH_SZ + DRM_IV_SZ + 8 + DRM_MD_SZ)
+#define IO_BUF_SZ (1 << 20)
+#define MAX_WORKERS 64
+
+
+typedef struct {
+    pthread_mutex_t lock;
+    int fd;
+    off_t audio_off;    // file offset of the encrypted audio
+    u32 chunk_sz;
+    u32 enc_len;
+    u32 nchunks;
+    u32 next;           // next chunk to claim
+    s32 bad;            // lowest chunk found not to match, or -1
+    int err;
+    const u8 *hashes;
+    const u8 *iv;
+    const u8 *key;
+} verifier;
+
+
+// worker: recomputes the keyed chunk || iv hash of each chunk it claims
+static void *verify_worker(void *arg) {
+    verifier *v = arg;
+    u8 buf[DRM_MAX_CHUNK_SZ], hash[DRM_HASH_SZ];
+
+    for (;;) {
+        pthread_mutex_lock(&v->lock);
+        // chunks past a known mismatch can no longer change the result
+        int done = v->err || v->next == v->nchunks || (v->bad >= 0 && (s32)v->next > v->bad);
+        u32 i = v->next++;
+        pthread_mutex_unlock(&v->lock);
+        if (done) {
+            return NULL;
+        }
+
+        u32 pos = i * v->chunk_sz;
+        u32 len = (v->enc_len - pos > v->chunk_sz) ? v->chunk_sz : v->enc_len - pos;
+        if (pread(v->fd, buf, len, v->audio_off + pos) != (ssize_t)len) {
+            pthread_mutex_lock(&v->lock);
+            v->err = DRM_EREAD;
+            pthread_mutex_unlock(&v->lock);
+            return NULL;
+        }
+
+        blake3_hasher h;
+        blake3_hasher_init_keyed(&h, v->key);
+        blake3_hasher_update(&h, buf, len);
+        blake3_hasher_update(&h, v->iv, DRM_IV_SZ);
+        blake3_hasher_finalize(&h, hash, DRM_HASH_SZ);
+        if (memcmp(hash, v->hashes + i * DRM_HASH_SZ, DRM_HASH_SZ)) {
+            pthread_mutex_lock(&v->lock);
+            if (v->bad < 0 || (s32)i < v->bad) {
+                v->bad = i;
+            }
+            pthread_mutex_unlock(&v->lock);
+        }
+    }
+}
+
+
+/* runs the chunk hash pass on threads workers
+ * returns 0 if every chunk matches, DRM_ECHUNKHASH with *bad set to the
+ * first chunk that does not, or another drm_errors code
+ */
+static int verify_chunks(verifier *v, int threads, s32 *bad) {
+    pthread_t tids[MAX_WORKERS];
+    int started = 0;
+
+    pthread_mutex_init(&v->lock, NULL);
+    v->bad = -1;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&tids[started], NULL, verify_worker, v) == 0) {
+            started++;
+        }
+    }
+    // run on this thread as well, so the pass finishes even if no worker started
+    verify_worker(v);
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    pthread_mutex_destroy(&v->lock);
+
+    *bad = v->bad;
+    if (v->err) {
+        return v->err;
+    }
+    return (v->bad >= 0) ? DRM_ECHUNKHASH : DRM_OK;
+}
+
+
+/* checks and decrypts one .drm file back to the original WAV
+ *
+ * k        : device keys from drm_keys_init() or drm_keys_load()
+ * infile   : protected song
+ * outfile  : path of the WAV to write; only created once every hash matched
+ * threads  : chunk hash workers besides the calling thread, 0 for one per
+ *            spare core
+ * st       : if not NULL, filled in with what the run did
+ * returns 0 on success or a drm_errors code
+ */
+int drm_unprotect_song(const drm_keys *k, const char *infile, const char *outfile,
+                       int threads, drm_stats *st) {
+    double t0 = now_sec();
+    u8 pre[DRM_PREFIX_SZ + DRM_EXT_MERKLE_SZ], hdr[WAV_HDR_SZ], hash[DRM_HASH_SZ];
+    u8 *hashes = NULL, *tree = NULL, *buf = NULL;
+    char *outbuf = NULL;
+    u32 nchunks = 0, enc_len = 0, out_len = 0;
+    s32 bad = -1;
+    FILE *in, *out = NULL;
+    wav_info w;
+    int err;
+
+    if (threads <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (n > 1) ? n - 1 : 0;
+    }
+    if (threads > MAX_WORKERS) {
+        threads = MAX_WORKERS;
+    }
+
+    if (!(in = fopen(infile, "rb"))) {
+        return DRM_EOPEN;
+    }
+    if ((err = wav_open(in, &w))) {
+        goto done;
+    }
+    off_t data_off = ftello(in);
+
+    // metadata hash over iv || numChunks || encAudioLen || md [|| drm_ext]
+    if (w.data_len < DRM_PREFIX_SZ || fread(pre, 1, DRM_PREFIX_SZ, in) != DRM_PREFIX_SZ) {
+        err = DRM_EFORMAT;
+        goto done;
+    }
+    const u8 *iv = pre + DRM_HASH_SZ;
+    const u8 *ext = pre + DRM_PREFIX_SZ;
+    u32 version = get_u32(iv + DRM_IV_SZ) >> 24;
+    u32 ext_len = (version == DRM_V2) ? DRM_EXT_SZ : 0;
+    if (w.data_len < DRM_PREFIX_SZ + ext_len || fread(pre + DRM_PREFIX_SZ, 1, ext_len, in) != ext_len) {
+        err = DRM_EFORMAT;
+        goto done;
+    }
+    // the Merkle root follows the rest of the drm_ext
+    if (ext_len && get_u16(ext + 2) == DRM_EXT_MERKLE_SZ) {
+        ext_len = DRM_EXT_MERKLE_SZ;
+        if (w.data_len < DRM_PREFIX_SZ + ext_len ||
+            fread(pre + DRM_PREFIX_SZ + DRM_EXT_SZ, 1, DRM_HASH_SZ, in) != DRM_HASH_SZ) {
+            err = DRM_EFORMAT;
+            goto done;
+        }
+    }
+    blake3_hasher h;
+    blake3_hasher_init_keyed(&h, k->md_key);
+    blake3_hasher_update(&h, pre + DRM_HASH_SZ, DRM_PREFIX_SZ - DRM_HASH_SZ + ext_len);
+    blake3_hasher_finalize(&h, hash, DRM_HASH_SZ);
+    if (memcmp(hash, pre, DRM_HASH_SZ)) {
+        err = DRM_EMDHASH;
+        goto done;
+    }
+
+    // file offsets of the hash table and the audio
+    u64 table_off, audio_off;
+    u32 chunk_sz, table_hashes;
+    int chunk_ivs = 0;
+    nchunks = get_u32(iv + DRM_IV_SZ) & 0xffffff;
+    enc_len = get_u32(iv + DRM_IV_SZ + 4);
+    if (version == DRM_V1) {
+        chunk_sz = DRM_CHUNK_SZ;
+        audio_off = data_off + DRM_PREFIX_SZ;
+        table_off = audio_off + enc_len;
+        table_hashes = nchunks;
+    } else if (version == DRM_V2 && ext[0] >= DRM_MIN_CHUNK_SHIFT && ext[0] <= DRM_MAX_CHUNK_SHIFT &&
+               (((ext[1] & ~DRM_EXT_CHUNK_IV) == 0 && ext_len == DRM_EXT_SZ) ||
+                ((ext[1] & ~DRM_EXT_CHUNK_IV) == DRM_EXT_MERKLE && ext_len == DRM_EXT_MERKLE_SZ &&
+                 nchunks <= 1 << DRM_MERKLE_MAX_DEPTH))) {
+        chunk_sz = 1 << ext[0];
+        table_off = get_u32(ext + 4);
+        audio_off = get_u32(ext + 8);
+        table_hashes = (ext[1] & DRM_EXT_MERKLE) ? drm_merkle_nodes(nchunks) : nchunks;
+        chunk_ivs = ext[1] & DRM_EXT_CHUNK_IV;
+    } else {
+        err = DRM_EFORMAT;
+        goto done;
+    }
+    if (pre[DRM_HASH_SZ + DRM_IV_SZ + 8] > DRM_MD_SZ ||
+        enc_len == 0 || enc_len % SPECK_BLK_SZ ||
+        nchunks != (enc_len + chunk_sz - 1) / chunk_sz ||
+        table_off < (u64)data_off + DRM_PREFIX_SZ + ext_len ||
+        audio_off < (u64)data_off + DRM_PREFIX_SZ + ext_len ||
+        table_off + (u64)table_hashes * DRM_HASH_SZ > data_off + w.data_len ||
+        audio_off + enc_len > data_off + w.data_len) {
+        err = DRM_EFORMAT;
+        goto done;
+    }
+
+    hashes = malloc((size_t)table_hashes * DRM_HASH_SZ);
+    buf = malloc(chunk_sz);
+    outbuf = malloc(IO_BUF_SZ);
+    if (!hashes || !buf || !outbuf) {
+        err = DRM_ENOMEM;
+        goto done;
+    }
+    if (pread(fileno(in), hashes, table_hashes * DRM_HASH_SZ, table_off) !=
+        (ssize_t)(table_hashes * DRM_HASH_SZ)) {
+        err = DRM_EREAD;
+        goto done;
+    }
+
+    // the tree above the chunk hashes must be the one they give
+    if (table_hashes != nchunks) {
+        if (!(tree = malloc((size_t)table_hashes * DRM_HASH_SZ))) {
+            err = DRM_ENOMEM;
+            goto done;
+        }
+        memcpy(tree, hashes, (size_t)nchunks * DRM_HASH_SZ);
+        if (memcmp(drm_merkle_build(k, tree, nchunks), ext + DRM_EXT_SZ, DRM_HASH_SZ) ||
+            memcmp(tree, hashes, (size_t)table_hashes * DRM_HASH_SZ)) {
+            err = DRM_EMERKLE;
+            goto done;
+        }
+    }
+
+    verifier v = {
+        .fd = fileno(in), .audio_off = audio_off, .chunk_sz = chunk_sz,
+        .enc_len = enc_len, .nchunks = nchunks,
+        .hashes = hashes, .iv = iv, .key = k->chunk_key,
+    };
+    if ((err = verify_chunks(&v, threads, &bad))) {
+        goto done;
+    }
+
+    // the last block alone gives the padding, so the header can go out first
+    char chain[DRM_IV_SZ];
+    u8 last[2 * SPECK_BLK_SZ];
+    // with an IV per chunk, a last chunk of one block starts from its own
+    int nlast = (enc_len > SPECK_BLK_SZ && !(chunk_ivs && (enc_len - SPECK_BLK_SZ) % chunk_sz == 0)) ? 2 : 1;
+    if (pread(fileno(in), last + (2 - nlast) * SPECK_BLK_SZ, nlast * SPECK_BLK_SZ,
+              audio_off + enc_len - nlast * SPECK_BLK_SZ) != nlast * SPECK_BLK_SZ) {
+        err = DRM_EREAD;
+        goto done;
+    }
+    if (nlast == 2) {
+        memcpy(chain, last, DRM_IV_SZ);
+    } else if (chunk_ivs) {
+        drm_chunk_iv(iv, nchunks - 1, (u8 *)chain);
+    } else {
+        memcpy(chain, iv, DRM_IV_SZ);
+    }
+    speck_decrypt_cbc(k->rk, (char *)last + SPECK_BLK_SZ, (char *)last + SPECK_BLK_SZ,
+                      SPECK_BLK_SZ, chain);
+    u8 pad = last[2 * SPECK_BLK_SZ - 1];
+    if (pad == 0 || pad > SPECK_BLK_SZ) {
+        err = DRM_EPAD;
+        goto done;
+    }
+    for (int i = 1; i <= pad; i++) {
+        if (last[2 * SPECK_BLK_SZ - i] != pad) {
+            err = DRM_EPAD;
+            goto done;
+        }
+    }
+    out_len = enc_len - pad;
+
+    if (!(out = fopen(outfile, "wb"))) {
+        err = DRM_EOPEN;
+        goto done;
+    }
+    setvbuf(out, outbuf, _IOFBF, IO_BUF_SZ);
+    wav_header(hdr, &w, out_len);
+    if (fwrite(hdr, 1, WAV_HDR_SZ, out) != WAV_HDR_SZ) {
+        err = DRM_EWRITE;
+        goto done;
+    }
+
+    memcpy(chain, iv, DRM_IV_SZ);
+    for (u32 pos = 0; pos < enc_len; pos += chunk_sz) {
+        u32 len = (enc_len - pos > chunk_sz) ? chunk_sz : enc_len - pos;
+        u32 keep = (out_len - pos < len) ? out_len - pos : len;
+
+        if (pread(fileno(in), buf, len, audio_off + pos) != (ssize_t)len) {
+            err = DRM_EREAD;
+            goto done;
+        }
+        if (chunk_ivs) {
+            drm_chunk_iv(iv, pos / chunk_sz, (u8 *)chain);
+        }
+        speck_decrypt_cbc(k->rk, (char *)buf, (char *)buf, len, chain);
+        if (fwrite(buf, 1, keep, out) != keep) {
+            err = DRM_EWRITE;
+            goto done;
+        }
+    }
+
+done:
+    if (out && fclose(out) && !err) {
+        err = DRM_EWRITE;
+    }
+    if (out && err) {
+        unlink(outfile);
+    }
+    fclose(in);
+    free(hashes);
+    free(tree);
+    free(buf);
+    free(outbuf);
+
+    if (st) {
+        st->audio_bytes = out_len;
+        st->out_bytes = out ? WAV_HDR_SZ + out_len : 0;
+        st->chunks = nchunks;
+        st->threads = threads + 1;
+        st->seconds = now_sec() - t0;
+        st->bad_chunk = bad;
+    }
+    return err;
+}
@@ -0,0 +1,100 @@
+/*
+ * WAV helpers for the native tools
+ *
+ * Reads and writes WAV files exactly the way python's wave module does, since
+ * the .drm format is a WAV whose frames are the protected song and the tools
+ * must stay byte-compatible with the Python ones.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "drmtools.h"
+
+
+u32 get_u32(const u8 *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+u16 get_u16(const u8 *p) {
+    return p[0] | (p[1] << 8);
+}
+
+void put_u32(u8 *p, u32 v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+void put_u16(u8 *p, u16 v) {
+    p[0] = v; p[1] = v >> 8;
+}
+
+
+/* walks the RIFF chunks like wave.Wave_read and leaves f at the first audio
+ * byte. data_len is what readframes(getnframes()) would return: the data
+ * chunk rounded down to whole frames, or less if the file is truncated
+ * returns 0 on success or a drm_errors code
+ */
+int wav_open(FILE *f, wav_info *w) {
+    u8 hdr[12], ck[8], fmt[16];
+    struct stat sb;
+    int have_fmt = 0;
+
+    if (fread(hdr, 1, 12, f) != 12 || memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "WAVE", 4)) {
+        return DRM_EFORMAT;
+    }
+    for (;;) {
+        if (fread(ck, 1, 8, f) != 8) {
+            return DRM_EFORMAT;
+        }
+        u32 size = get_u32(ck + 4);
+
+        if (!memcmp(ck, "fmt ", 4)) {
+            if (size < 16 || fread(fmt, 1, 16, f) != 16 || get_u16(fmt) != 1) {
+                return DRM_EFORMAT;
+            }
+            w->nchannels = get_u16(fmt + 2);
+            w->framerate = get_u32(fmt + 4);
+            w->sampwidth = (get_u16(fmt + 14) + 7) / 8;
+            if (w->nchannels == 0 || w->sampwidth == 0) {
+                return DRM_EFORMAT;
+            }
+            have_fmt = 1;
+            size -= 16;
+        } else if (!memcmp(ck, "data", 4)) {
+            if (!have_fmt || fstat(fileno(f), &sb)) {
+                return DRM_EFORMAT;
+            }
+            u32 framesz = w->nchannels * w->sampwidth;
+            off_t at = ftello(f);
+            u64 avail = (sb.st_size > at) ? sb.st_size - at : 0;
+            w->data_len = (u64)(size / framesz) * framesz;
+            if (w->data_len > avail) {
+                w->data_len = avail;
+            }
+            return DRM_OK;
+        }
+        // chunks are word aligned
+        if (fseeko(f, size + (size & 1), SEEK_CUR)) {
+            return DRM_EFORMAT;
+        }
+    }
+}
+
+
+// the 44-byte header python's wave module writes for data_len bytes of frames
+void wav_header(u8 *p, const wav_info *w, u32 data_len) {
+    memcpy(p, "RIFF", 4);
+    put_u32(p + 4, 36 + data_len);
+    memcpy(p + 8, "WAVEfmt ", 8);
+    put_u32(p + 16, 16);
+    put_u16(p + 20, 1);
+    put_u16(p + 22, w->nchannels);
+    put_u32(p + 24, w->framerate);
+    put_u32(p + 28, w->nchannels * w->framerate * w->sampwidth);
+    put_u16(p + 32, w->nchannels * w->sampwidth);
+    put_u16(p + 34, w->sampwidth * 8);
+    memcpy(p + 36, "data", 4);
+    put_u32(p + 40, data_len);
+}
+